@@ -1,10 +1,18 @@
+#define _GNU_SOURCE // Enables struct ucred, used to check who owns the local socket
 #include <arpa/inet.h> // This header file provides functions for handling IP addresses and network addresses.
+#include <ctype.h> // This header file provides character classification functions such as isalnum.
+#include <errno.h> // This header file defines errno values, used to tell a closed connection from an idle one.
 #include <stdio.h> // This C standard input/output library is used for input and output operations.
 #include <stdlib.h> // This library provides functions for memory allocation, process control, conversions, and other operations.
 #include <string.h> // This library provides functions for manipulating strings, such as copy, concatenate, and compare.
 #include <sys/socket.h> // This header file defines types and functions for socket programming, which are used to create network sockets and communicate over them.
 #include <sys/stat.h> // This header file provides functions for obtaining information about files (such as size, permissions, etc.).
+#include <sys/un.h> // This header file defines sockaddr_un, used to reach a server on the same host without TCP.
 #include <sys/types.h> // This header file defines various data types used in system calls and other system-related operations.
+#include <netinet/tcp.h> // This header file defines TCP_NODELAY and TCP_FASTOPEN_CONNECT.
+#include <poll.h> // This header file provides poll, used to notice a connection the server closed.
+#include <signal.h> // This header file provides signal, used to ignore SIGPIPE.
+#include <stdint.h> // This header file defines fixed width integer types such as uint32_t.
 #include <unistd.h> // This header file provides access to the POSIX operating system API, which includes file operations, process management, and others.
 
 // Defining constants and ports
@@ -13,18 +21,44 @@
 #define MIRROR_PORT_2 7001          // Port number for mirror server 2
 #define GZIP_FILENAME "temp.tar.gz" // Expected gzip compressed file name
 #define MAX_BUFFER_SIZE 1024
+#define MAX_COMMAND_LEN 8192 // Longest request line - batch w24fn lists names
+#define STREAMED_SIZE -1 // Size header of an archive sent as chunk frames
+#define NO_ARCHIVE_SIZE -2 // Size header when the server has no archive
+#define BUSY_SIZE -3 // Size header when the server rejected the request
+#define MAX_EXTENSION_LEN 15 // Longest w24ft extension the server accepts
+#define LOCAL_SOCKET_DIR "/tmp/serverw24-%d" // Server's private socket directory without XDG_RUNTIME_DIR
+#define LOCAL_SOCKET_NAME "%s/serverw24-%d.sock" // Same-host listener of a server port
+#define RECONNECT_ATTEMPTS 6 // Tries before giving up on a failed session
+#define RECONNECT_BASE_MS 100 // First backoff delay, doubled per try
 int validCommand = 0;
 
-// Function to check if a file extension is supported
+// Function to check if a file extension is well formed (e.g. txt, tar.gz)
 int isValidExtension(const char *extension) {
-  const char *extensions[] = {"py",  "c",   "sh",  "txt",
-                              "jpg", "pdf", "png", "jpeg"};
-  for (int i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
-    if (strcmp(extension, extensions[i]) == 0) {
-      return 1; // Extension is supported
+  size_t len = strlen(extension);
+  if (len == 0 || len > MAX_EXTENSION_LEN || extension[0] == '.') {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (!isalnum((unsigned char)extension[i]) &&
+        strchr("._-+~", extension[i]) == NULL) {
+      return 0; // Extension is not supported
     }
   }
-  return 0; // Extension is not supported
+  return 1; // Extension is supported
+}
+
+// Function to receive exactly len bytes - returns -1 on error/closed connection
+int recv_all(int sock, void *data, size_t len) {
+  char *ptr = data;
+  while (len > 0) {
+    ssize_t n = recv(sock, ptr, len, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    ptr += n;
+    len -= n;
+  }
+  return 0;
 }
 
 // Function to recieve file sent from the server
@@ -65,9 +99,48 @@ void receive_file(int server_socket) {
 
   long gzip_size;
   memcpy(&gzip_size, size_buffer, sizeof(long));
+  if (gzip_size == BUSY_SIZE) {
+    fclose(file);
+    remove(targz_path);
+    printf("Server busy - please try again later\n");
+    return;
+  }
+  if (gzip_size == NO_ARCHIVE_SIZE) {
+    fclose(file);
+    remove(targz_path);
+    printf("No archive available (job unknown, failed or cancelled)\n");
+    return;
+  }
 
   char buffer[MAX_BUFFER_SIZE];
   size_t total_received = 0;
+  if (gzip_size == STREAMED_SIZE) {
+    // Archive is streamed while being built - length prefixed chunks, 0 ends
+    while (1) {
+      uint32_t frame;
+      if (recv_all(server_socket, &frame, sizeof(frame)) < 0) {
+        perror("Failed to receive chunk header");
+        fclose(file);
+        exit(EXIT_FAILURE);
+      }
+      size_t chunk = ntohl(frame);
+      if (chunk == 0) {
+        break;
+      }
+      while (chunk > 0) {
+        size_t want = chunk < sizeof(buffer) ? chunk : sizeof(buffer);
+        if (recv_all(server_socket, buffer, want) < 0) {
+          perror("Failed to receive data");
+          fclose(file);
+          exit(EXIT_FAILURE);
+        }
+        fwrite(buffer, 1, want, file);
+        total_received += want;
+        chunk -= want;
+      }
+    }
+    gzip_size = 0; // Nothing left for the sized transfer below
+  }
   while (total_received < gzip_size) {
     bytes_received = recv(server_socket, buffer, sizeof(buffer),
                           0); // recieve all the bytes sent from the server
@@ -86,10 +159,186 @@ void receive_file(int server_socket) {
          w24_folder_path);
 }
 
+// Function to print a streamed text reply - length prefixed frames, 0 ends it
+void receive_stream(int server_socket) {
+  char buffer[MAX_BUFFER_SIZE + 1];
+  while (1) {
+    uint32_t frame;
+    if (recv_all(server_socket, &frame, sizeof(frame)) < 0) {
+      perror("Failed to receive reply");
+      exit(EXIT_FAILURE);
+    }
+    size_t chunk = ntohl(frame);
+    if (chunk == 0) {
+      break;
+    }
+    while (chunk > 0) {
+      size_t want = chunk < MAX_BUFFER_SIZE ? chunk : MAX_BUFFER_SIZE;
+      if (recv_all(server_socket, buffer, want) < 0) {
+        perror("Failed to receive reply");
+        exit(EXIT_FAILURE);
+      }
+      buffer[want] = '\0';
+      printf("%s", buffer);
+      chunk -= want;
+    }
+  }
+  printf("\n");
+}
+
+// Function to find a port's local socket - in $XDG_RUNTIME_DIR or the server's
+// 0700 directory, as the server puts it; 0 if that directory is not private
+int local_socket_path(int port, char *path, size_t len) {
+  char dir[MAX_BUFFER_SIZE];
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime != NULL && runtime[0] == '/') {
+    snprintf(dir, sizeof(dir), "%s", runtime);
+  } else {
+    snprintf(dir, sizeof(dir), LOCAL_SOCKET_DIR, (int)getuid());
+  }
+  struct stat sb;
+  if (lstat(dir, &sb) != 0 || !S_ISDIR(sb.st_mode) || sb.st_uid != getuid() ||
+      (sb.st_mode & 077) != 0) {
+    return 0;
+  }
+  return snprintf(path, len, LOCAL_SOCKET_NAME, dir, port) < (int)len;
+}
+
+// Function to check that a local socket's server runs as this user - and is
+// not someone else listening at its path
+int served_by_us(int sockfd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+}
+
+// Function to connect to a node - over its AF_UNIX socket when it runs on this
+// host, else over TCP - returns -1 if it is not reachable. With fast_open the
+// command rides on the SYN when the node gave us a cookie before; connect()
+// then succeeds at once and a dead node only shows when sending.
+int connect_to_node(int port, int fast_open) {
+  struct sockaddr_un local_addr = {.sun_family = AF_UNIX};
+  int sockfd = -1;
+  if (local_socket_path(port, local_addr.sun_path, sizeof(local_addr.sun_path))) {
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  }
+  if (sockfd != -1 && connect(sockfd, (struct sockaddr *)&local_addr,
+                              sizeof(local_addr)) == 0 &&
+      served_by_us(sockfd)) {
+    return sockfd;
+  }
+  if (sockfd != -1) {
+    close(sockfd); // No local listener - a stale path or a remote node
+  }
+
+  struct sockaddr_in node_addr;
+  sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&node_addr, '\0', sizeof(node_addr));
+  node_addr.sin_family = AF_INET;
+  node_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  node_addr.sin_port = htons(port);
+
+  int on = 1; // Commands are small - no waiting for ACKs
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef TCP_FASTOPEN_CONNECT
+  if (fast_open) {
+    setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+  }
+#endif
+
+  if (connect(sockfd, (struct sockaddr *)&node_addr, sizeof(node_addr)) == -1) {
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+// Function to get the session back after its node failed - retries the
+// session's node with exponential backoff, falling back to the main server
+int reconnect_session(int *session_port) {
+  int delay_ms = RECONNECT_BASE_MS;
+  for (int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+    int sockfd = connect_to_node(*session_port, 0);
+    if (sockfd < 0 && *session_port != PORT) {
+      sockfd = connect_to_node(PORT, 0); // It may hand us to another mirror
+      if (sockfd >= 0) {
+        *session_port = PORT;
+      }
+    }
+    if (sockfd >= 0) {
+      return sockfd;
+    }
+    usleep(delay_ms * 1000);
+    delay_ms *= 2;
+  }
+  fprintf(stderr, "Server unreachable - giving up\n");
+  exit(EXIT_FAILURE);
+}
+
+// Function to send a command to the session's node - on any failure (the node
+// went away, a fast open SYN to it was refused) reconnects and sends it again
+void send_command(int *sockfd, int *session_port, const char *command) {
+  for (int attempt = 0; send(*sockfd, command, strlen(command), 0) < 0; attempt++) {
+    if (attempt == RECONNECT_ATTEMPTS) {
+      perror("Failed to send command");
+      exit(EXIT_FAILURE);
+    }
+    close(*sockfd);
+    *sockfd = reconnect_session(session_port);
+  }
+}
+
+// Function to check whether the node closed the connection while we were idle
+// - a REDIRECT it left before closing still counts as open
+int connection_closed(int sockfd) {
+  struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+  char byte;
+  if (poll(&pfd, 1, 0) <= 0) {
+    return 0;
+  }
+  ssize_t n = recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+// Function to take a REDIRECT reply off the socket - returns its port, or 0 if
+// the reply is the command's own (text, stream frames or a file size header)
+int take_redirect(int sockfd) {
+  const char *prefix = "REDIRECT:";
+  char peek[MAX_BUFFER_SIZE];
+  while (1) {
+    ssize_t n = recv(sockfd, peek, sizeof(peek) - 1, MSG_PEEK);
+    if (n <= 0) {
+      return 0; // Receiving the reply reports it
+    }
+    size_t same = (size_t)n < strlen(prefix) ? (size_t)n : strlen(prefix);
+    if (strncmp(peek, prefix, same) != 0) {
+      return 0;
+    }
+    peek[n] = '\0';
+    if (memchr(peek, '\n', n) != NULL) {
+      break; // Whole line is here
+    }
+    usleep(1000); // Line split across segments - rare
+  }
+  char line[MAX_BUFFER_SIZE] = {0};
+  size_t len = 0;
+  while (len < sizeof(line) - 1 && recv(sockfd, line + len, 1, 0) == 1 &&
+         line[len] != '\n') {
+    len++;
+  }
+  return atoi(line + strlen(prefix));
+}
+
 // Function used to parse the request send by the user
 void parse_request(char *buff, int *rf, char *command) {
   // Duplicate the input string - for maintaining originality of buffer
-  char user_input[1024];
+  char user_input[MAX_COMMAND_LEN];
   strcpy(user_input, buff);
   char *token = strtok(user_input, " ");
   *rf = 0; // Reset the file receptor flag
@@ -99,17 +348,23 @@ void parse_request(char *buff, int *rf, char *command) {
     return;
   }
 
-  /*Prints list of folders*/
+  /*Prints list of folders - streamed, optionally a page at a time
+   * dirlist -a|-t [-n page_size] [-c cursor]*/
   if (strcmp(token, "dirlist") == 0) {
     char *arg = strtok(NULL, " ");
-    if (strcmp(arg, "-a") == 0) {
-      /*List of subdirectories in alphabetical order*/
-      sprintf(command, "dirlist %s", arg);
-      validCommand = 1;
-    } else if (strcmp(arg, "-t") == 0) {
-      /*List of subdirectories in creation order - Oldest First*/
-      sprintf(command, "dirlist %s", arg);
+    if (arg != NULL && (strcmp(arg, "-a") == 0 || strcmp(arg, "-t") == 0)) {
+      /*-a: alphabetical order, -t: creation order - Oldest First*/
       validCommand = 1;
+      char *opt;
+      while ((opt = strtok(NULL, " ")) != NULL) {
+        char *value = strtok(NULL, " ");
+        if (value == NULL ||
+            (strcmp(opt, "-n") != 0 && strcmp(opt, "-c") != 0) ||
+            (strcmp(opt, "-n") == 0 && atoi(value) <= 0)) {
+          validCommand = 0;
+        }
+      }
+      *rf = 2; // Reply arrives as a framed stream
     } else {
       strcpy(command, "");
       // printf("Invalid dirlist extensions. Please try again\n");
@@ -118,7 +373,7 @@ void parse_request(char *buff, int *rf, char *command) {
   }
 
   /*Fetch file details from filename such as name, size, date created,
-   * permissions*/
+   * permissions - several names are looked up in one request, streamed back*/
   if (strcmp(token, "w24fn") == 0) {
     char *filename = strtok(NULL, " ");
     if (filename == NULL) {
@@ -127,7 +382,65 @@ void parse_request(char *buff, int *rf, char *command) {
     } else {
       sprintf(command, "w24fn %s", filename);
       validCommand = 1;
+      if (strtok(NULL, " ") != NULL) {
+        *rf = 2; // Batch - one record per name, as a framed stream
+      }
+    }
+  }
+
+  /*Search file names by prefix, glob or approximate spelling - streamed
+   * w24search -p prefix | -g glob | -f name [-d distance] [-n count]*/
+  if (strcmp(token, "w24search") == 0) {
+    char *flag = strtok(NULL, " ");
+    char *query = strtok(NULL, " ");
+    validCommand = flag != NULL && query != NULL &&
+                   (strcmp(flag, "-p") == 0 || strcmp(flag, "-g") == 0 ||
+                    strcmp(flag, "-f") == 0);
+    char *opt;
+    while (validCommand && (opt = strtok(NULL, " ")) != NULL) {
+      char *value = strtok(NULL, " ");
+      if (value == NULL || (strcmp(opt, "-n") != 0 && strcmp(opt, "-d") != 0) ||
+          atoi(value) < 0) {
+        validCommand = 0;
+      }
+    }
+    *rf = 2; // Reply arrives as a framed stream
+  }
+
+  /*Size, type and date predicates in one query - listed or archived
+   * w24q [-l] [size:MIN..MAX] [ext:E1,E2] [before:DATE] [after:DATE]*/
+  if (strcmp(token, "w24q") == 0) {
+    char *arg = strtok(NULL, " ");
+    int listing = arg != NULL && strcmp(arg, "-l") == 0;
+    if (listing) {
+      arg = strtok(NULL, " ");
     }
+    validCommand = 1;
+    for (; arg != NULL; arg = strtok(NULL, " ")) {
+      if (strncmp(arg, "size:", 5) != 0 && strncmp(arg, "ext:", 4) != 0 &&
+          strncmp(arg, "before:", 7) != 0 && strncmp(arg, "after:", 6) != 0) {
+        validCommand = 0;
+      }
+    }
+    *rf = listing ? 2 : 1;
+  }
+
+  /*Largest or newest files - streamed
+   * w24top -s | -n [count]*/
+  if (strcmp(token, "w24top") == 0) {
+    char *flag = strtok(NULL, " ");
+    char *count = strtok(NULL, " ");
+    validCommand = flag != NULL &&
+                   (strcmp(flag, "-s") == 0 || strcmp(flag, "-n") == 0) &&
+                   (count == NULL || atoi(count) > 0);
+    *rf = 2; // Reply arrives as a framed stream
+  }
+
+  /*Recursive size and file count of a directory under ~ - streamed
+   * w24du [dir] [-d depth]*/
+  if (strcmp(token, "w24du") == 0) {
+    validCommand = 1;
+    *rf = 2; // Reply arrives as a framed stream
   }
 
   /*Tar with files whose size is size1 <= fileSize <= size2*/
@@ -146,31 +459,24 @@ void parse_request(char *buff, int *rf, char *command) {
   }
 
   /*Tar with files (with filetypes) as in the extension list specified by
-   * request*/
+   * request - any number of extensions*/
   if (strcmp(token, "w24ft") == 0) {
-    char *file_extension1 = strtok(NULL, " ");
-    char *file_extension2 = strtok(NULL, " ");
-    char *file_extension3 = strtok(NULL, " ");
+    char *file_extension = strtok(NULL, " ");
 
-    if (file_extension1 == NULL) {
+    if (file_extension == NULL) {
       strcpy(command, "");
       validCommand = 0; // Invalid syntax - the extension list is empty
     } else {
-      // Check if each extension is supported
-      if (!isValidExtension(file_extension1) ||
-          (file_extension2 && !isValidExtension(file_extension2)) ||
-          (file_extension3 && !isValidExtension(file_extension3))) {
-        printf("Invalid file extension provided.\n");
-        return;
-      }
-
-      // Construct the command with up to 3 different file types
-      sprintf(command, "w24ft %s", file_extension1);
-      if (file_extension2 != NULL) {
-        sprintf(command + strlen(command), " %s", file_extension2);
-      }
-      if (file_extension3 != NULL) {
-        sprintf(command + strlen(command), " %s", file_extension3);
+      // Construct the command with every requested file type
+      strcpy(command, "w24ft");
+      for (; file_extension != NULL; file_extension = strtok(NULL, " ")) {
+        // Check if each extension is supported
+        if (!isValidExtension(file_extension)) {
+          printf("Invalid file extension provided.\n");
+          validCommand = 0;
+          return;
+        }
+        sprintf(command + strlen(command), " %s", file_extension);
       }
       validCommand = 1;
     }
@@ -189,6 +495,34 @@ void parse_request(char *buff, int *rf, char *command) {
     }
   }
 
+  /*Scheduler statistics of the connected node*/
+  if (strcmp(token, "w24stat") == 0) {
+    validCommand = 1;
+  }
+
+  /*Background archive jobs - submit, list, status, fetch, cancel*/
+  if (strcmp(token, "w24job") == 0) {
+    char *action = strtok(NULL, " ");
+    char *arg = strtok(NULL, " ");
+    if (action == NULL) {
+      validCommand = 0;
+    } else if (strcmp(action, "list") == 0) {
+      validCommand = 1;
+      *rf = 2; // Reply arrives as a framed stream
+    } else if (strcmp(action, "submit") == 0) {
+      validCommand = (arg != NULL); // Server validates the archive command
+    } else if (strcmp(action, "status") == 0 ||
+               strcmp(action, "cancel") == 0 ||
+               strcmp(action, "fetch") == 0) {
+      validCommand = (arg != NULL && atoi(arg) > 0);
+      if (strcmp(action, "fetch") == 0) {
+        *rf = 1; // Fetch replies with the job's archive
+      }
+    } else {
+      validCommand = 0;
+    }
+  }
+
   /*Tar with files created before the requested date*/
   if (strcmp(token, "w24fdb") == 0) {
     char *ldate = strtok(NULL, " ");
@@ -208,32 +542,18 @@ void parse_request(char *buff, int *rf, char *command) {
 // main function to establish connection with server
 int main() {
   int sockfd;
-  struct sockaddr_in serv_addr, mirror_addr;
-  char buff[1024], command[1024];
-  int rf = 0; // Flag indicating if file reception is expected
+  char buff[MAX_COMMAND_LEN], command[MAX_COMMAND_LEN];
+  int rf = 0; // Reply kind - 1: file, 2: framed text stream
+  int session_port = PORT; // Node serving this session
 
-  // setup of socket
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
-    perror("Error creating socket");
-    exit(EXIT_FAILURE);
-  }
-  // initializing addresses
-  memset(&serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(PORT);
-  if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-    perror("Invalid IP address / Address not supported");
-    close(sockfd);
-    return -1;
-  }
   // connecting with the server
-  if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+  sockfd = connect_to_node(PORT, 1);
+  if (sockfd < 0) {
     perror("Connection failed - Server NOT connected");
-    close(sockfd);
     return -1;
   }
 
+  signal(SIGPIPE, SIG_IGN); // A failed node surfaces as a closed connection
   printf("Connected to the server!\n");
   // after connections ask for user inputs
   while (1) {
@@ -258,56 +578,34 @@ int main() {
       continue;
     }
 
-    send(sockfd, command, strlen(command), 0);
-    if (rf) {
+    if (connection_closed(sockfd)) {
+      close(sockfd); // Node restarted or went away while we were idle
+      int old_port = session_port;
+      sockfd = reconnect_session(&session_port);
+      printf("Port %d closed the session - reconnected to port %d\n", old_port,
+             session_port);
+    }
+    send_command(&sockfd, &session_port, command);
+    // The main server may hand the session over to another node - stay there
+    // for every later command, file transfers included
+    int new_port;
+    while ((new_port = take_redirect(sockfd)) > 0) {
+      close(sockfd);
+      session_port = new_port;
+      sockfd = connect_to_node(session_port, 1);
+      if (sockfd < 0) {
+        sockfd = reconnect_session(&session_port);
+      }
+      send_command(&sockfd, &session_port, command);
+    }
+    if (rf == 2) {
+      receive_stream(sockfd);
+    } else if (rf) {
       receive_file(sockfd);
     } else {
       char response[1024] = {0};
-      int bytes_read = read(sockfd, response, sizeof(response));
-      // response[bytes_read] = '\0';  // Ensure null termination
-      if (strncmp(response, "REDIRECT:", 9) != 0) {
-        printf("%s\n", response);
-      }
-
-      // Check if the response is a redirection
-      if (strncmp(response, "REDIRECT:", 9) == 0) {
-        int new_port = atoi(response + 9); // Extract the new port number
-        close(sockfd); // Close the current connection - switching to mirrors
-
-        // Creates new socket for the mirror server
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd == -1) {
-          perror("socket");
-          exit(EXIT_FAILURE);
-        }
-
-        memset(&mirror_addr, '\0', sizeof(mirror_addr));
-        mirror_addr.sin_family = AF_INET;
-        mirror_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-        // Connect to the mirror server
-        if (new_port == 7000) {
-          mirror_addr.sin_port = htons(MIRROR_PORT_1);
-        } else {
-          mirror_addr.sin_port = htons(MIRROR_PORT_2);
-        }
-
-        if (connect(sockfd, (struct sockaddr *)&mirror_addr,
-                    sizeof(mirror_addr)) == -1) {
-          perror("connect");
-          exit(EXIT_FAILURE);
-        }
-
-        if (new_port == 7000 || new_port == 7001) {
-          // Send the original command to the new server (mirror1)
-          send(sockfd, command, strlen(command), 0);
-
-          // Read the response from the new server
-          memset(response, 0, sizeof(response));
-          bytes_read = read(sockfd, response, sizeof(response));
-          printf("%s\n", response);
-        }
-      }
+      read(sockfd, response, sizeof(response) - 1);
+      printf("%s\n", response);
     }
   } // end-while
 
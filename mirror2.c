@@ -6,6 +6,7 @@
 */
 
 /*Libraries defined*/
+#define _GNU_SOURCE  // Enables statx, pipe2 and nftw FTW_ACTIONRETVAL
 #define _XOPEN_SOURCE 700  // Enables certain features in POSIX APIs - nftw PHYS Flag issues resolver
 #include <arpa/inet.h>  // Provides functions for manipulating IP addresses
 #include <dirent.h>  // Allows accessing directory entries
@@ -13,6 +14,8 @@
 #include <ftw.h>  // Offers file tree walk functionality
 #include <libgen.h>  // Provides filename manipulation functions
 #include <netinet/in.h>  // Defines internet address structures
+#include <netinet/tcp.h>  // Defines TCP_NODELAY/TCP_CORK/TCP_FASTOPEN - transport profiles
+#include <stdarg.h>  // Provides variable argument lists
 #include <stdbool.h>  // Defines boolean data type and values
 #include <stdio.h>  // Provides standard input/output functionality
 #include <stdlib.h>  // Provides standard library functions
@@ -25,22 +28,124 @@
 #include <unistd.h>  // Provides various standard POSIX operating system functions
 #include <limits.h>  // Defines system-specific constants for pathnames
 #include <pwd.h>  // Provides functions for retrieving user information
+#include <grp.h>  // Provides functions for retrieving group information
+#include <sys/ioctl.h>  // Provides ioctl - used for FIEMAP extent lookups
+#include <linux/fs.h>  // Defines FS_IOC_FIEMAP
+#include <linux/fiemap.h>  // Defines fiemap request/extent structures
+#include <pthread.h>  // Provides threads for the archive pipeline stages
+#include <stdatomic.h>  // Provides atomics for the lock-free stage queues
+#include <stdint.h>  // Defines fixed width integer types
+#include <sched.h>  // Provides sched_yield
+#include <errno.h>  // Defines error numbers
+#include <signal.h>  // Provides signal handling functions
+#include <poll.h>  // Provides poll - detects client hang ups during long requests
+#include <sys/mman.h>  // Provides mmap - shared scheduler state
+#include <sys/resource.h>  // Provides setpriority - archive stage priority
+#include <sys/syscall.h>  // Provides syscall numbers - ioprio_set
+#include <sys/inotify.h>  // Provides inotify - keeps the catalog current
+#include <sys/file.h>  // Provides flock - picks the node maintaining the shared catalog
+#include <sys/un.h>  // Defines sockaddr_un - same-host clients connect over AF_UNIX
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // Provides SSE2/AVX2 intrinsics - extension matching
+#endif
 
 
 // Global definitions (Ports/Buffer sizes)
 #define SERVER_PORT 6999
 #define MIRROR1_PORT 7000
 #define MIRROR2_PORT 7001
+#define LOCAL_SOCKET_DIR "/tmp/serverw24-%d" // Private (0700) home of the AF_UNIX listeners without XDG_RUNTIME_DIR
+#define LOCAL_SOCKET_NAME "%s/serverw24-%d.sock" // AF_UNIX listener of a node's port
+#define RELOAD_TCP_FD "SERVERW24_TCP_FD" // Environment passing the listeners to a reloaded image
+#define RELOAD_LOCAL_FD "SERVERW24_LOCAL_FD"
 #define BUFFER_SIZE 2048
-#define MAX_DIRS 100
-#define MAX_DIR_NAME_LEN 256
+#define MAX_COMMAND_LEN 8192 // Longest request line - batch w24fn lists names
+#define FILE_INFO_LEN 1024
+#define ARENA_BLOCK 65536 // Initial request arena of a connection
+#define REPLY_LEN 1024 // Text replies the client reads in one go
+#define MAX_BATCH_NAMES 1024 // Filenames per w24fn request
+#define STREAM_CHUNK 4096 // Frame size of streamed text replies (dirlist)
+#define NO_ID UINT32_MAX // Catalog id meaning "none"
+#define SKIP_MAX_LEVEL 20 // Catalog skiplist height limit
+#define MAX_SCAN_DEPTH 256 // Deepest directory level indexed by the catalog
+#define INOTIFY_BUFFER 65536
+#define RESCAN_INTERVAL 10 // Seconds between fingerprint rescans of unwatched directories
+#define SNAPSHOT_DIR "/dev/shm/serverw24-%d" // Private (0700) home of the shared catalog and node table - outside ~ so saving is not an event
+#define SNAPSHOT_INTERVAL 1 // Seconds a catalog change may wait to be saved and shared
+#define SNAPSHOT_VERSION 2
+#define FOLLOW_INTERVAL_MS 200 // How often other nodes look for a newer shared catalog
+#define VALIDATE_CHUNK 4096 // Entries checked per catalog lock hold after a load
+#define FORK_LOCK_POLL_US 100 // Retry interval of a fork waiting for the catalog lock
+#define MIN_NAME_SLOTS 1024 // Initial size of the catalog name table
+#define BLOOM_HASHES 4 // Bits set per name in the catalog Bloom filter
+#define SIZE_CLASSES 65 // Catalog size histogram - 0, then one per power of two
+#define BTIME_BUCKETS 1024 // Catalog birth time histogram buckets
+#define BTIME_BUCKET_SECS 2592000 // 30 days per birth time bucket
+#define MAX_PATTERN_LEN 63 // Longest w24search pattern (one bit per position)
+#define MAX_EDIT_DISTANCE 3
+#define DEFAULT_SEARCH_RESULTS 20
+#define MAX_SEARCH_RESULTS 1000
+#define DEFAULT_TOP_RESULTS 10
+#define MAX_TOP_RESULTS 1000
+#define MAX_DU_DEPTH 8 // Deepest w24du listing below the requested directory
+#define PLAN_WALK 0  // Query planner access paths
+#define PLAN_SCAN 1
+#define PLAN_EXT 2
+#define PLAN_BTIME 3
+#define COLUMN_SCAN_SPEEDUP 8 // Filter kernel rows per index candidate, cost wise
+#define EXT_OTHER 0       // Extension id shared once the table is full
+#define EXT_NONE 0xffff   // Extension id of names without one
+#define SEARCH_GLOB 0 // w24search -g, and -p as "prefix*"
+#define SEARCH_FUZZY 1
 #define MAX_PATH_LEN 2560
+#define CURSOR_KEY_LEN (MAX_PATH_LEN + NAME_MAX + 2) // Longest dirlist sort key - name, tab, path
+#define READAHEAD_WINDOW 16 // Archive members prefetched/ordered per reader batch
+#define READ_CHUNK 65536 // Read/send granularity of the archive pipeline
+#define LOADED_DEPTH 64 // Opened members waiting for the archiver - each holds an fd
+#define TAR_BLOCK 512
+#define SUFFIX_BLOCK 16 // Bytes per packed w24ft suffix (".ext")
+#define MAX_COMMAND_ARGS 1024 // Arguments of an archive command
+#define MAX_STAGE_THREADS 16
+#define MAX_JOBS 16 // Background archive jobs per connection
+#define MAX_SHARD_NODES 16 // Nodes splitting ~ into subtree shards (-g)
+#define ROUTE_NODES 3 // Nodes the main server routes connections to
+#define RING_POINTS 64 // Consistent hash ring points per node
+#define MAX_LOAD_NODES 16 // Entries of the shared node load table
+#define ROUTE_MIN_CAPACITY 4 // Connections a node takes before spilling over at low load
+#define PENDING_EXPIRY_MS 2000 // Redirected clients that did not reconnect by then never will
+#define NO_ARCHIVE_SIZE -2 // Size header when there is no archive to send
+
+// Scheduler command classes
+#define CLASS_LIGHT 0 // Metadata queries - dirlist, w24fn, job control
+#define CLASS_HEAVY 1 // Archive builds
+#define MAX_SLOTS 64
+#define LATENCY_BUCKETS 32
+#define HEAVY_NICE 10 // CPU nice value of archive stages
+#define BUSY_SIZE -3  // Size header when an archive request is rejected
+#define MAX_FLOWS 64  // Concurrent bulk transfers paced by the egress scheduler
+#define MAX_CLIENT_RULES 32
+#define EGRESS_BURST_NS 50000000LL // Idle flows may burst 50ms worth of data
+
+// IO priority (no glibc wrapper)
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << 13) | (data))
+
+// Archive job states
+#define JOB_RUNNING 0
+#define JOB_DONE 1
+#define JOB_FAILED 2
+#define JOB_CANCELLED 3
+#define JOB_FETCHED 4
+#define JOB_REJECTED 5
+
+// Archive member ordering modes (physical layout aware reads)
+#define ORDER_PATH 0   // Keep walk order - deterministic archives
+#define ORDER_INODE 1  // Sort by inode number
+#define ORDER_EXTENT 2 // Sort by first physical extent (FIEMAP), inode on ties
 
-char file_info[1024] = {0};
-char *inputFileName;
-char *file_list[1024];
-int file_count = 0;
 time_t date_limit;
+int archive_order = ORDER_EXTENT; // Changed via -p / -i on the command line
 char *homePath = "home/";
 
 //char* tar_filename = "temp.tar";
@@ -52,224 +157,5085 @@ void caught_error(const char *msg) {
   exit(1);
 }
 
-/*Function: Comparion for Qsort */
-int compareStrings(const void *a, const void *b) {
-  return strcmp(*(const char **)a, *(const char **)b);
+/*Function: Write a whole buffer to a descriptor (pipe, file or socket)*/
+int write_all(int fd, const void *data, size_t len) {
+  const char *ptr = data;
+  while (len > 0) {
+    ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) {
+      n = write(fd, ptr, len);
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    ptr += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*Function: Write the header of a payload that follows at once - MSG_MORE
+keeps the header from leaving as a segment of its own*/
+int write_header(int fd, const void *data, size_t len) {
+  ssize_t n = send(fd, data, len, MSG_NOSIGNAL | MSG_MORE);
+  if (n == (ssize_t)len) {
+    return 0;
+  }
+  if (n < 0 && errno != ENOTSOCK && errno != EINTR) {
+    return -1;
+  }
+  n = n < 0 ? 0 : n;
+  return write_all(fd, (const char *)data + n, len - n);
+}
+
+/*Function: Read exactly len bytes from a descriptor - -1 on end of file or error*/
+int read_all(int fd, void *data, size_t len) {
+  char *ptr = data;
+  while (len > 0) {
+    ssize_t n = read(fd, ptr, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    ptr += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+*Transport profiles - socket options of a node's listener and its connections
+*/
+
+/*Structure: Socket options applied to a listener and the connections it accepts*/
+struct transport_profile {
+  const char *name;
+  int nodelay;       // TCP_NODELAY - replies leave without waiting for ACKs
+  int sndbuf;        // SO_SNDBUF bytes, 0 - kernel autotuning
+  int rcvbuf;        // SO_RCVBUF bytes (set on the listener), 0 - autotuning
+  int fastopen;      // TCP_FASTOPEN queue of the listener, 0 - off
+  int notsent_lowat; // TCP_NOTSENT_LOWAT bytes, 0 - unlimited
+};
+
+struct transport_profile transport_profiles[] = {
+    {"interactive", 1, 0, 0, 16, 16384},          // Small replies, low latency
+    {"bulk", 1, 4194304, 1048576, 16, 131072},    // Archive transfers over high latency links - untested
+    {"kernel", 0, 0, 0, 0, 0},                    // Untuned - Nagle stalls framed replies
+};
+struct transport_profile *transport = &transport_profiles[0]; // Changed via -t
+
+/*Function: Pick the transport profile by name - false if there is none*/
+bool set_transport_profile(const char *name) {
+  for (size_t i = 0; i < sizeof(transport_profiles) / sizeof(transport_profiles[0]); i++) {
+    if (strcmp(transport_profiles[i].name, name) == 0) {
+      transport = &transport_profiles[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+/*Function: Whether a socket connects us to a same-host client over AF_UNIX*/
+bool local_socket(int sock) {
+  struct sockaddr_un addr;
+  socklen_t len = sizeof(addr);
+  return getsockname(sock, (struct sockaddr *)&addr, &len) == 0 &&
+         addr.sun_family == AF_UNIX;
+}
+
+/*Function: Options that must be set before listen() - call on TCP listeners*/
+void transport_tune_listener(int sockfd) {
+  // Accepted connections inherit the receive buffer - its size fixes window scaling
+  if (transport->rcvbuf > 0) {
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &transport->rcvbuf, sizeof(int));
+  }
+  if (transport->fastopen > 0 &&
+      setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &transport->fastopen,
+                 sizeof(int)) < 0) {
+    perror("TCP_FASTOPEN"); // Plain handshakes then
+  }
+}
+
+/*Function: Options of an accepted connection*/
+void transport_tune_connection(int sock) {
+  if (transport->sndbuf > 0) {
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &transport->sndbuf, sizeof(int));
+  }
+  if (local_socket(sock)) {
+    return; // No TCP underneath
+  }
+  if (transport->nodelay) {
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &transport->nodelay, sizeof(int));
+  }
+  if (transport->notsent_lowat > 0) {
+    setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &transport->notsent_lowat,
+               sizeof(int));
+  }
+}
+
+/*Function: Hold back partial segments while a header and its payload are
+written - uncorking pushes them out even while Nagle would wait for an ACK*/
+void transport_cork(int sock, int on) {
+  setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)); // Fails harmlessly off TCP
+}
+
+/*
+*Request arena - what a request allocates comes from its connection's arena
+*and is released in one go when the request ends. A request that outgrows the
+*arena spills into heap blocks, and the arena then grows to fit it, so a
+*connection's steady state makes no heap calls at all.
+*/
+
+/*Structure: Bump allocator of a connection - each connection is a process*/
+struct arena {
+  char *base;
+  size_t used;
+  size_t cap;
+  size_t spilled; // Bytes of this request that did not fit
+  void *spills;   // Heap blocks holding them, chained through their first word
+};
+
+struct arena request_arena;
+
+/*Function: Allocate from the request arena - 16 byte aligned, not zeroed*/
+void *arena_alloc(size_t len) {
+  struct arena *a = &request_arena;
+  len = (len + 15) & ~(size_t)15;
+  if (a->used + len <= a->cap) {
+    void *ptr = a->base + a->used;
+    a->used += len;
+    return ptr;
+  }
+  void **block = malloc(16 + len);
+  if (block == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  *block = a->spills;
+  a->spills = block;
+  a->spilled += len;
+  return (char *)block + 16;
+}
+
+/*Function: Zeroed arena allocation*/
+void *arena_calloc(size_t count, size_t len) {
+  void *ptr = arena_alloc(count * len);
+  memset(ptr, 0, count * len);
+  return ptr;
+}
+
+/*Function: Copy a string into the request arena*/
+char *arena_strdup(const char *str) {
+  size_t len = strlen(str) + 1;
+  return memcpy(arena_alloc(len), str, len);
+}
+
+/*Function: Release everything the request allocated - grows the arena to the
+request's size first if it spilled*/
+void arena_reset() {
+  struct arena *a = &request_arena;
+  size_t needed = a->used + a->spilled;
+  while (a->spills != NULL) {
+    void *next = *(void **)a->spills;
+    free(a->spills);
+    a->spills = next;
+  }
+  if (needed > a->cap || a->base == NULL) {
+    size_t cap = a->cap ? a->cap : ARENA_BLOCK;
+    while (cap < needed) {
+      cap *= 2;
+    }
+    free(a->base);
+    a->base = malloc(cap);
+    if (a->base == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    a->cap = cap;
+  }
+  a->used = 0;
+  a->spilled = 0;
+}
+
+/*Structure: Text reply that grows inside the request arena - always NUL terminated*/
+struct out_buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+/*Function: Start an empty reply*/
+void out_init(struct out_buffer *out, size_t cap) {
+  out->data = arena_alloc(cap);
+  out->data[0] = '\0';
+  out->len = 0;
+  out->cap = cap;
+}
+
+/*Function: Drop what a reply holds so far*/
+void out_reset(struct out_buffer *out) {
+  out->data[0] = '\0';
+  out->len = 0;
+}
+
+/*Function: Append formatted text to a reply*/
+void out_printf(struct out_buffer *out, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, args);
+  va_end(args);
+  if (n < 0) {
+    out->data[out->len] = '\0';
+    return;
+  }
+  if (out->len + n >= out->cap) {
+    size_t cap = out->cap * 2;
+    while (cap <= out->len + n) {
+      cap *= 2;
+    }
+    char *data = arena_alloc(cap); // The old copy goes with the request
+    memcpy(data, out->data, out->len);
+    out->data = data;
+    out->cap = cap;
+    va_start(args, fmt);
+    vsnprintf(out->data + out->len, out->cap - out->len, fmt, args);
+    va_end(args);
+  }
+  out->len += n;
+}
+
+#ifdef COUNT_ALLOCATIONS
+/*
+*Allocation counting (build with -DCOUNT_ALLOCATIONS) - the process's heap
+*calls go through these, and crequest logs how many each request made
+*/
+extern void *__libc_malloc(size_t len);
+extern void *__libc_calloc(size_t count, size_t len);
+extern void *__libc_realloc(void *ptr, size_t len);
+extern void __libc_free(void *ptr);
+atomic_long heap_calls;
+
+void *malloc(size_t len) {
+  atomic_fetch_add(&heap_calls, 1);
+  return __libc_malloc(len);
+}
+
+void *calloc(size_t count, size_t len) {
+  atomic_fetch_add(&heap_calls, 1);
+  return __libc_calloc(count, len);
+}
+
+void *realloc(void *ptr, size_t len) {
+  atomic_fetch_add(&heap_calls, 1);
+  return __libc_realloc(ptr, len);
+}
+
+void free(void *ptr) {
+  if (ptr != NULL) {
+    atomic_fetch_add(&heap_calls, 1);
+  }
+  __libc_free(ptr);
+}
+#endif
+
+/*Function: If w24 folder doesnot exist - create it*/
+void create_w24_directory() {
+    // Get the home directory path
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        perror("getenv");
+        exit(EXIT_FAILURE);
+    }
+
+    // Concatenate the home directory path with the w24 directory name
+    char w24_dir[1024];
+    snprintf(w24_dir, sizeof(w24_dir), "%s/w24", home_dir);
+
+    // Check if the w24 directory exists
+    struct stat st;
+    if (stat(w24_dir, &st) == -1) {
+        // If the directory doesn't exist, create it
+        if (mkdir(w24_dir, 0700) == -1) {
+            perror("mkdir");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+*Catalog - in-memory view of the directory tree under ~
+*
+* Built once by a background scan, then kept current from inotify events by
+* the same thread. Directories without a watch (no inotify, or over the
+* watch limit) are re-statted every RESCAN_INTERVAL seconds and re-read
+* only when their fingerprint changed. Every directory is linked into two skiplists - by name
+* (dirlist -a) and by birth time (dirlist -t) - so both orders are served in
+* time proportional to the output. Hidden directories are kept in the tree
+* but not in the lists. Every other entry is a file record, chained to its
+* name in the name table behind a Bloom filter so that w24fn misses cost a
+* few bit tests, and its name is counted in a radix trie that w24search
+* walks. Files are also chained per extension and kept in a birth time
+* ordered skiplist, with size and birth time histograms, for the query
+* planner. Size, birth time, extension and directory are kept in columns
+* the query filter kernels scan (sizes follow IN_CLOSE_WRITE), and every
+* directory keeps the file count and size of its subtree. Paths are
+* never stored: entries point at their parent directory and full paths
+* are rebuilt only for results, and each distinct file name is stored
+* once, however many files share it. Everything
+* is stored in flat arrays addressed by 32-bit ids. Connection processes get
+* a copy-on-write snapshot when they are forked, and compare its generations
+* with the published ones to know whether it is still current. The catalog
+* is also saved to a snapshot file and loaded back on restart, then checked
+* against the disk in the background while it already answers queries.
+* Nodes on one host share it: one maintains it, the others map its
+* snapshots read only, so all answer from the same data.
+*/
+
+/*Structure: Append-only store of NUL terminated strings, addressed by offset*/
+struct string_arena {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+/*Structure: What a directory looked like when its entries were last read*/
+struct dir_fingerprint {
+  ino_t ino;
+  int64_t mtime;         // Nanoseconds
+  int64_t ctime;
+  off_t size;            // Follows the entries on most filesystems
+};
+
+/*Structure: One directory of the catalog*/
+struct dir_record {
+  uint32_t name;         // Offset into the name arena
+  uint32_t parent;       // Parent dir id, NO_ID for ~
+  uint32_t first_child;  // Sub-directory tree
+  uint32_t next_sibling;
+  int64_t btime;         // Birth time, 0 if the fs has none
+  uid_t uid;
+  uint32_t first_file;   // Files directly inside
+  uint32_t files;        // Files in the whole subtree
+  uint64_t bytes;        // Their total size
+  struct dir_fingerprint fingerprint; // Rescans re-read it only when it changed
+  int wd;                // inotify watch, -1 if none
+  bool hidden;           // Hidden itself or below a hidden dir - not listed
+  bool live;
+};
+
+/*Structure: One file (any non-directory, non-symlink entry) of the catalog*/
+struct file_record {
+  uint32_t name;           // Offset into the name arena
+  uint32_t prev_in_dir;    // Files of the same directory
+  uint32_t next_in_dir;    // ... also threads the free list
+  uint32_t next_same_name; // Files with this name
+  uint32_t prev_same_ext;  // Files of the same extension
+  uint32_t next_same_ext;
+};
+
+/*Structure: File metadata columns, indexed by file id like the records*/
+struct file_columns {
+  uint64_t *size;          // Bytes as of the last create/close after write
+  int64_t *btime;          // Birth time, 0 if the fs has none, INT64_MIN if free
+  uint16_t *ext;           // Extension id, EXT_NONE if the name has none
+  uint32_t *dir;           // Containing dir id
+};
+
+/*Structure: One distinct file name, stored once in the name arena*/
+struct name_entry {
+  uint32_t name;           // Offset into the name arena, NO_ID for a free slot
+  uint32_t first_file;     // Files with this name - the slot is freed with the last
+};
+
+/*Structure: One file name extension (text after the last dot)*/
+struct ext_record {
+  uint32_t name;           // Offset into the name arena
+  uint32_t first_file;
+  uint32_t files;
+};
+
+/*Structure: Radix trie node over the distinct file names (w24search)*/
+struct trie_node {
+  uint32_t label;         // Edge label - offset into the name arena
+  uint32_t label_len;
+  uint32_t first_child;   // Children sorted by first label byte
+  uint32_t next_sibling;  // ... also threads the free list
+  uint32_t files;         // Files whose name ends here
+};
+
+/*Structure: Latest catalog generations - shared with connection processes*/
+struct catalog_versions {
+  atomic_long dirs;
+  atomic_long files;
+  atomic_long sizes;
+};
+
+/*Structure: Skiplist over catalog ids - links live in one pool*/
+struct skiplist {
+  uint32_t head[SKIP_MAX_LEVEL];
+  int level;
+  uint32_t *links;       // Forward links, a height sized slice per node
+  size_t links_len;
+  size_t links_cap;
+  uint32_t *base;        // Per id: start of its slice in links
+  uint8_t *height;       // Per id: 0 when not in the list
+  size_t nodes_cap;
+  int (*compare)(uint32_t a, uint32_t b);
+};
+
+/*Structure: The catalog*/
+struct catalog {
+  pthread_rwlock_t lock;
+  atomic_int ready;        // Initial scan done
+  bool complete;           // Every directory indexed and watched
+  long dir_generation;     // Bumped when a listed directory changes
+  long file_generation;    // Bumped when any file may have changed
+  long size_generation;    // Bumped when a file size column changes
+  struct catalog_versions *published;
+  const char *root;
+  uint32_t root_dir;
+  struct dir_record *dirs;
+  uint32_t dir_count;      // Ids handed out (live or free)
+  uint32_t dir_cap;
+  uint32_t free_dirs;      // Free list threaded through next_sibling
+  struct string_arena names;
+  struct skiplist dirs_by_name;
+  struct skiplist dirs_by_time;
+  struct file_record *files;
+  struct file_columns columns;
+  uint32_t file_count;     // Ids handed out (live or free)
+  uint32_t file_cap;
+  uint32_t free_files;
+  uint32_t live_files;
+  struct name_entry *name_table; // Open addressing by name hash
+  uint32_t name_slots;     // Power of two, at least twice name_count
+  uint32_t name_count;
+  uint64_t *bloom;         // File names - 8 bits per slot
+  struct skiplist files_by_time;
+  struct ext_record *exts; // Id 0 is EXT_OTHER, never looked up by name
+  uint32_t ext_count;
+  uint32_t ext_cap;
+  uint32_t *ext_slots;     // Extension name hash -> ext id, open addressing
+  uint32_t ext_slot_count; // Power of two, at least twice ext_count
+  uint32_t size_classes[SIZE_CLASSES];
+  uint32_t btime_buckets[BTIME_BUCKETS];
+  struct trie_node *trie;  // Node 0 is the root
+  uint32_t trie_count;
+  uint32_t trie_cap;
+  uint32_t free_trie;
+  size_t names_garbage;    // Arena bytes of removed entries
+  int inotify_fd;
+  uint32_t *wd_dirs;       // inotify watch -> dir id
+  int wd_cap;
+  char *snapshot;          // Saved copy loaded on restart, NULL if none
+  char *share;             // Shared generations file, NULL if alone
+  int share_fd;            // Locked by the node maintaining the catalog, -1 if alone
+  pid_t node_pid;          // Node process - the one that removes the files last
+  void *map;               // Snapshot used in place by a following node
+  size_t map_len;
+};
+
+struct catalog catalog;
+
+/*Function: Grow an array to hold at least n elements*/
+void *grow_array(void *array, size_t *cap, size_t n, size_t elem) {
+  if (n <= *cap) {
+    return array;
+  }
+  size_t new_cap = *cap ? *cap : 64;
+  while (new_cap < n) {
+    new_cap *= 2;
+  }
+  array = realloc(array, new_cap * elem);
+  if (array == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  *cap = new_cap;
+  return array;
+}
+
+/*Function: Store a string in the arena - returns its offset*/
+uint32_t arena_add(struct string_arena *arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  arena->data = grow_array(arena->data, &arena->cap, arena->len + len, 1);
+  memcpy(arena->data + arena->len, str, len);
+  arena->len += len;
+  return (uint32_t)(arena->len - len);
+}
+
+/*Function: Name of a catalog directory*/
+const char *dir_name(uint32_t id) {
+  return catalog.names.data + catalog.dirs[id].name;
+}
+
+/*Function: Rebuild the full path of a catalog directory*/
+void dir_path(uint32_t id, char *path, size_t len) {
+  uint32_t chain[MAX_SCAN_DEPTH];
+  int depth = 0;
+  for (uint32_t d = id; d != catalog.root_dir && d != NO_ID &&
+                        depth < MAX_SCAN_DEPTH;
+       d = catalog.dirs[d].parent) {
+    chain[depth++] = d;
+  }
+  size_t used = snprintf(path, len, "%s", catalog.root);
+  while (depth > 0 && used < len) {
+    uint32_t d = chain[--depth];
+    used += snprintf(path + used, len - used, "%s%s",
+                     (used > 0 && path[used - 1] == '/') ? "" : "/",
+                     dir_name(d));
+  }
+}
+
+/*Function: Full path of an entry inside a catalog directory*/
+void entry_path(uint32_t dir, const char *name, char *path, size_t len) {
+  dir_path(dir, path, len);
+  size_t used = strlen(path);
+  snprintf(path + used, len - used, "%s%s",
+           (used > 0 && path[used - 1] == '/') ? "" : "/", name);
+}
+
+/*Function: Order by (name, path) - dirlist -a*/
+int compare_dirs_by_name(uint32_t a, uint32_t b) {
+  int diff = strcmp(dir_name(a), dir_name(b));
+  if (diff != 0 || a == b) {
+    return diff;
+  }
+  char pa[MAX_PATH_LEN], pb[MAX_PATH_LEN];
+  dir_path(a, pa, sizeof(pa));
+  dir_path(b, pb, sizeof(pb));
+  return strcmp(pa, pb);
+}
+
+/*Function: Order by (birth time, path) - dirlist -t*/
+int compare_dirs_by_time(uint32_t a, uint32_t b) {
+  int64_t ta = catalog.dirs[a].btime, tb = catalog.dirs[b].btime;
+  if (ta != tb) {
+    return (ta > tb) ? 1 : -1;
+  }
+  if (a == b) {
+    return 0;
+  }
+  char pa[MAX_PATH_LEN], pb[MAX_PATH_LEN];
+  dir_path(a, pa, sizeof(pa));
+  dir_path(b, pb, sizeof(pb));
+  return strcmp(pa, pb);
+}
+
+/*Function: Order files by (birth time, id) - query planner*/
+int compare_files_by_time(uint32_t a, uint32_t b) {
+  int64_t ta = catalog.columns.btime[a], tb = catalog.columns.btime[b];
+  if (ta != tb) {
+    return (ta > tb) ? 1 : -1;
+  }
+  return (a > b) - (a < b);
+}
+
+/*Function: Compare a catalog file with a birth time key*/
+int compare_file_time_key(uint32_t id, const void *key) {
+  return catalog.columns.btime[id] < *(const int64_t *)key ? -1 : 1;
+}
+
+/*Function: Empty skiplist*/
+void skiplist_init(struct skiplist *sl, int (*compare)(uint32_t, uint32_t)) {
+  memset(sl, 0, sizeof(*sl));
+  for (int i = 0; i < SKIP_MAX_LEVEL; i++) {
+    sl->head[i] = NO_ID;
+  }
+  sl->level = 1;
+  sl->compare = compare;
+}
+
+/*Function: Forward link of a node (or the head when node is NO_ID)*/
+uint32_t *skiplist_next(struct skiplist *sl, uint32_t node, int level) {
+  return node == NO_ID ? &sl->head[level] : &sl->links[sl->base[node] + level];
+}
+
+/*Function: Random node height - geometric, p = 1/4*/
+int skiplist_random_height() {
+  static __thread uint32_t state = 2463534242u;
+  int height = 1;
+  for (;;) {
+    state ^= state << 13; // xorshift32
+    state ^= state >> 17;
+    state ^= state << 5;
+    if ((state & 3) != 0 || height == SKIP_MAX_LEVEL) {
+      return height;
+    }
+    height++;
+  }
+}
+
+/*Function: Link a node into the skiplist*/
+void skiplist_insert(struct skiplist *sl, uint32_t id) {
+  size_t old_cap = sl->nodes_cap;
+  sl->base = grow_array(sl->base, &sl->nodes_cap, id + 1, sizeof(uint32_t));
+  if (sl->nodes_cap != old_cap) {
+    sl->height = realloc(sl->height, sl->nodes_cap);
+    if (sl->height == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    memset(sl->height + old_cap, 0, sl->nodes_cap - old_cap);
+  }
+  int height = skiplist_random_height();
+  sl->links = grow_array(sl->links, &sl->links_cap, sl->links_len + height,
+                         sizeof(uint32_t));
+  sl->base[id] = (uint32_t)sl->links_len;
+  sl->links_len += height;
+  sl->height[id] = (uint8_t)height;
+  if (height > sl->level) {
+    sl->level = height;
+  }
+  uint32_t node = NO_ID;
+  for (int l = sl->level - 1; l >= 0; l--) {
+    uint32_t next;
+    while ((next = *skiplist_next(sl, node, l)) != NO_ID &&
+           sl->compare(next, id) < 0) {
+      node = next;
+    }
+    if (l < height) {
+      sl->links[sl->base[id] + l] = next;
+      *skiplist_next(sl, node, l) = id;
+    }
+  }
+}
+
+/*Function: Unlink a node from the skiplist*/
+void skiplist_remove(struct skiplist *sl, uint32_t id) {
+  if (id >= sl->nodes_cap || sl->height[id] == 0) {
+    return;
+  }
+  uint32_t node = NO_ID;
+  for (int l = sl->level - 1; l >= 0; l--) {
+    uint32_t next;
+    while ((next = *skiplist_next(sl, node, l)) != NO_ID && next != id &&
+           sl->compare(next, id) < 0) {
+      node = next;
+    }
+    if (next == id) {
+      *skiplist_next(sl, node, l) = sl->links[sl->base[id] + l];
+    }
+  }
+  sl->height[id] = 0; // Its link slice is left unused
+}
+
+/*Function: First node ordered after a key - O(log n)
+* compare_key(id, key) < 0 when the node sorts before the key.
+*/
+uint32_t skiplist_first_after(struct skiplist *sl,
+                              int (*compare_key)(uint32_t, const void *),
+                              const void *key) {
+  uint32_t node = NO_ID;
+  for (int l = sl->level - 1; l >= 0; l--) {
+    uint32_t next;
+    while ((next = *skiplist_next(sl, node, l)) != NO_ID &&
+           compare_key(next, key) <= 0) {
+      node = next;
+    }
+  }
+  return *skiplist_next(sl, node, 0);
+}
+
+/*Function: Hand out a dir id*/
+uint32_t catalog_new_dir() {
+  uint32_t id;
+  if (catalog.free_dirs != NO_ID) {
+    id = catalog.free_dirs;
+    catalog.free_dirs = catalog.dirs[id].next_sibling;
+  } else {
+    size_t cap = catalog.dir_cap;
+    catalog.dirs = grow_array(catalog.dirs, &cap, catalog.dir_count + 1,
+                              sizeof(struct dir_record));
+    catalog.dir_cap = (uint32_t)cap;
+    id = catalog.dir_count++;
+  }
+  memset(&catalog.dirs[id], 0, sizeof(struct dir_record));
+  catalog.dirs[id].first_child = catalog.dirs[id].next_sibling = NO_ID;
+  catalog.dirs[id].first_file = NO_ID;
+  catalog.dirs[id].wd = -1;
+  return id;
+}
+
+/*Function: 64-bit FNV-1a hash of a file name*/
+uint64_t name_hash(const char *name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name; name++) {
+    hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*Function: Bloom filter bit of a name hash - double hashing*/
+uint64_t bloom_bit(uint64_t hash, int i) {
+  uint64_t bits = (uint64_t)catalog.name_slots * 8;
+  return ((uint32_t)hash + i * ((hash >> 32) | 1)) & (bits - 1);
+}
+
+/*Function: Whether a name may be in the catalog - false means surely not*/
+bool bloom_may_contain(uint64_t hash) {
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    uint64_t bit = bloom_bit(hash, i);
+    if (!(catalog.bloom[bit / 64] & (1ULL << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*Function: Add a file name to the Bloom filter*/
+void bloom_add(uint64_t hash) {
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    uint64_t bit = bloom_bit(hash, i);
+    catalog.bloom[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+/*Function: Slot of a name in the name table - or the free slot it would take*/
+uint32_t name_slot(const char *name, uint64_t hash) {
+  uint32_t mask = catalog.name_slots - 1;
+  uint32_t slot = hash & mask;
+  while (catalog.name_table[slot].name != NO_ID &&
+         strcmp(catalog.names.data + catalog.name_table[slot].name, name) != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/*Function: Resize the name table and refill the filter - also clears stale filter bits*/
+void catalog_resize_names(uint32_t slots) {
+  struct name_entry *old = catalog.name_table;
+  uint32_t old_slots = catalog.name_slots;
+  free(catalog.bloom);
+  catalog.name_table = malloc(slots * sizeof(struct name_entry));
+  catalog.bloom = calloc(slots / 8, sizeof(uint64_t));
+  if (catalog.name_table == NULL || catalog.bloom == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  catalog.name_slots = slots;
+  for (uint32_t i = 0; i < slots; i++) {
+    catalog.name_table[i].name = NO_ID;
+  }
+  for (uint32_t i = 0; i < old_slots; i++) {
+    if (old[i].name == NO_ID) {
+      continue;
+    }
+    uint64_t hash = name_hash(catalog.names.data + old[i].name);
+    uint32_t slot = hash & (slots - 1);
+    while (catalog.name_table[slot].name != NO_ID) {
+      slot = (slot + 1) & (slots - 1);
+    }
+    catalog.name_table[slot] = old[i];
+    bloom_add(hash);
+  }
+  free(old);
+}
+
+/*Function: Name table entry of a name, NULL if no file has it*/
+struct name_entry *catalog_name_entry(const char *name, uint64_t hash) {
+  struct name_entry *entry = &catalog.name_table[name_slot(name, hash)];
+  return entry->name != NO_ID ? entry : NULL;
+}
+
+/*Function: Name table entry for a file being added - valid until the next add*/
+struct name_entry *catalog_intern(const char *name) {
+  if (2 * (catalog.name_count + 1) > catalog.name_slots) {
+    catalog_resize_names(catalog.name_slots * 2);
+  }
+  struct name_entry *entry = &catalog.name_table[name_slot(name, name_hash(name))];
+  if (entry->name == NO_ID) {
+    entry->name = arena_add(&catalog.names, name);
+    entry->first_file = NO_ID;
+    catalog.name_count++;
+  }
+  return entry;
+}
+
+/*Function: Free the slot of a name no file has any more*/
+void catalog_release(struct name_entry *entry) {
+  catalog.names_garbage += strlen(catalog.names.data + entry->name) + 1;
+  catalog.name_count--;
+  // Backward shift deletion - later entries of the probe run move up
+  uint32_t mask = catalog.name_slots - 1;
+  uint32_t hole = entry - catalog.name_table;
+  for (uint32_t i = (hole + 1) & mask; catalog.name_table[i].name != NO_ID;
+       i = (i + 1) & mask) {
+    uint32_t home = name_hash(catalog.names.data + catalog.name_table[i].name) & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      catalog.name_table[hole] = catalog.name_table[i];
+      hole = i;
+    }
+  }
+  catalog.name_table[hole].name = NO_ID;
+}
+
+/*Function: Watch a directory for entries being created/removed*/
+void catalog_watch(uint32_t id, const char *path) {
+  if (catalog.inotify_fd < 0) {
+    catalog.complete = false; // Only rescans will notice changes
+    return;
+  }
+  int wd = inotify_add_watch(catalog.inotify_fd, path,
+                             IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                 IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR |
+                                 IN_DONT_FOLLOW);
+  if (wd < 0) {
+    if (errno == ENOSPC && catalog.complete) {
+      fprintf(stderr, "Catalog: inotify watch limit reached at %s - rescanning "
+                      "unwatched directories every %ds\n", path, RESCAN_INTERVAL);
+    }
+    catalog.complete = false; // Changes below here would go unnoticed
+    return;
+  }
+  size_t cap = catalog.wd_cap;
+  catalog.wd_dirs = grow_array(catalog.wd_dirs, &cap, wd + 1, sizeof(uint32_t));
+  for (size_t i = catalog.wd_cap; i < cap; i++) {
+    catalog.wd_dirs[i] = NO_ID;
+  }
+  catalog.wd_cap = (int)cap;
+  catalog.wd_dirs[wd] = id;
+  catalog.dirs[id].wd = wd;
+}
+
+/*Function: Fingerprint of a directory from its stat*/
+void fingerprint_of(const struct stat *sb, struct dir_fingerprint *fp) {
+  fp->ino = sb->st_ino;
+  fp->mtime = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+  fp->ctime = sb->st_ctim.tv_sec * 1000000000LL + sb->st_ctim.tv_nsec;
+  fp->size = sb->st_size;
+}
+
+/*Function: Add a directory under its parent and index it*/
+uint32_t catalog_add_dir(uint32_t parent, const char *name, const char *path,
+                         const struct stat *sb) {
+  uint32_t id = catalog_new_dir();
+  struct dir_record *dir = &catalog.dirs[id];
+  dir->name = arena_add(&catalog.names, name);
+  dir->parent = parent;
+  dir->uid = sb->st_uid;
+  fingerprint_of(sb, &dir->fingerprint);
+  dir->hidden = parent != NO_ID && (catalog.dirs[parent].hidden || name[0] == '.');
+  dir->live = true;
+  struct statx stx;
+  if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_BTIME, &stx) == 0 &&
+      (stx.stx_mask & STATX_BTIME)) {
+    dir->btime = stx.stx_btime.tv_sec;
+  }
+  if (parent != NO_ID) {
+    dir->next_sibling = catalog.dirs[parent].first_child;
+    catalog.dirs[parent].first_child = id;
+    if (!dir->hidden) {
+      skiplist_insert(&catalog.dirs_by_name, id);
+      skiplist_insert(&catalog.dirs_by_time, id);
+    }
+  }
+  catalog_watch(id, path);
+  return id;
+}
+
+/*Function: Name of a catalog file*/
+const char *file_name(uint32_t id) {
+  return catalog.names.data + catalog.files[id].name;
+}
+
+/*Function: Find a file of a directory by name*/
+uint32_t catalog_find_file(uint32_t dir, const char *name) {
+  struct name_entry *entry = catalog_name_entry(name, name_hash(name));
+  for (uint32_t f = entry ? entry->first_file : NO_ID; f != NO_ID;
+       f = catalog.files[f].next_same_name) {
+    if (catalog.columns.dir[f] == dir) {
+      return f;
+    }
+  }
+  return NO_ID;
+}
+
+/*Function: Edge label of a trie node*/
+const char *trie_label(uint32_t id) {
+  return catalog.names.data + catalog.trie[id].label;
+}
+
+/*Function: Hand out a trie node*/
+uint32_t trie_new_node(uint32_t label, uint32_t label_len) {
+  uint32_t id;
+  if (catalog.free_trie != NO_ID) {
+    id = catalog.free_trie;
+    catalog.free_trie = catalog.trie[id].next_sibling;
+  } else {
+    size_t cap = catalog.trie_cap;
+    catalog.trie = grow_array(catalog.trie, &cap, catalog.trie_count + 1,
+                              sizeof(struct trie_node));
+    catalog.trie_cap = (uint32_t)cap;
+    id = catalog.trie_count++;
+  }
+  catalog.trie[id] = (struct trie_node){label, label_len, NO_ID, NO_ID, 0};
+  return id;
+}
+
+/*Function: Child of a trie node starting with a byte - prev gets its predecessor*/
+uint32_t trie_child(uint32_t node, unsigned char c, uint32_t *prev) {
+  *prev = NO_ID;
+  uint32_t child = catalog.trie[node].first_child;
+  while (child != NO_ID && (unsigned char)trie_label(child)[0] < c) {
+    *prev = child;
+    child = catalog.trie[child].next_sibling;
+  }
+  return (child != NO_ID && (unsigned char)trie_label(child)[0] == c) ? child
+                                                                      : NO_ID;
+}
+
+/*Function: Point the sibling link after prev (or the first child link) at id*/
+void trie_set_link(uint32_t node, uint32_t prev, uint32_t id) {
+  if (prev == NO_ID) {
+    catalog.trie[node].first_child = id;
+  } else {
+    catalog.trie[prev].next_sibling = id;
+  }
+}
+
+/*Function: Count a file name in the trie - the name is stored at offset*/
+void trie_insert(uint32_t offset) {
+  uint32_t node = 0;
+  uint32_t pos = 0;
+  for (;;) {
+    const char *rest = catalog.names.data + offset + pos;
+    if (*rest == '\0') {
+      catalog.trie[node].files++;
+      return;
+    }
+    uint32_t prev;
+    uint32_t child = trie_child(node, (unsigned char)*rest, &prev);
+    if (child == NO_ID) {
+      uint32_t next = prev == NO_ID ? catalog.trie[node].first_child
+                                    : catalog.trie[prev].next_sibling;
+      uint32_t leaf = trie_new_node(offset + pos, (uint32_t)strlen(rest));
+      catalog.trie[leaf].next_sibling = next;
+      catalog.trie[leaf].files = 1;
+      trie_set_link(node, prev, leaf);
+      return;
+    }
+    const char *label = trie_label(child);
+    uint32_t common = 1;
+    while (common < catalog.trie[child].label_len && label[common] == rest[common]) {
+      common++;
+    }
+    if (common < catalog.trie[child].label_len) {
+      // Split the edge where the name leaves it
+      uint32_t mid = trie_new_node(catalog.trie[child].label, common);
+      catalog.trie[mid].first_child = child;
+      catalog.trie[mid].next_sibling = catalog.trie[child].next_sibling;
+      catalog.trie[child].label += common;
+      catalog.trie[child].label_len -= common;
+      catalog.trie[child].next_sibling = NO_ID;
+      trie_set_link(node, prev, mid);
+      child = mid;
+    }
+    node = child;
+    pos += common;
+  }
+}
+
+/*Function: Uncount a file name - drops nodes left without names below*/
+void trie_remove(const char *name) {
+  uint32_t path[NAME_MAX + 2];
+  int depth = 0;
+  uint32_t node = 0;
+  size_t pos = 0;
+  while (name[pos] != '\0' && depth <= NAME_MAX) {
+    uint32_t prev;
+    uint32_t child = trie_child(node, (unsigned char)name[pos], &prev);
+    if (child == NO_ID ||
+        strncmp(trie_label(child), name + pos, catalog.trie[child].label_len) != 0) {
+      return;
+    }
+    path[depth++] = node;
+    pos += catalog.trie[child].label_len;
+    node = child;
+  }
+  if (name[pos] != '\0' || catalog.trie[node].files == 0) {
+    return;
+  }
+  catalog.trie[node].files--;
+  while (node != 0 && catalog.trie[node].files == 0 &&
+         catalog.trie[node].first_child == NO_ID) {
+    uint32_t parent = path[--depth];
+    uint32_t prev;
+    trie_child(parent, (unsigned char)trie_label(node)[0], &prev);
+    trie_set_link(parent, prev, catalog.trie[node].next_sibling);
+    catalog.trie[node].next_sibling = catalog.free_trie;
+    catalog.free_trie = node;
+    node = parent;
+  }
+}
+
+/*Function: Extension of a file name (after the last dot), NULL if none*/
+const char *name_extension(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return (dot != NULL && dot[1] != '\0') ? dot + 1 : NULL;
+}
+
+/*Function: Id of an extension - added when create is set, else EXT_NONE if unknown*/
+uint16_t catalog_ext_id(const char *ext, bool create) {
+  if (create && catalog.ext_count >= EXT_NONE) {
+    create = false; // Table full - unknown extensions share EXT_OTHER
+  }
+  if (create && 2 * (catalog.ext_count + 1) > catalog.ext_slot_count) {
+    // Grow and rehash
+    uint32_t count = catalog.ext_slot_count ? catalog.ext_slot_count * 2 : 64;
+    uint32_t *slots = malloc(count * sizeof(uint32_t));
+    if (slots == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    memset(slots, 0xff, count * sizeof(uint32_t)); // NO_ID
+    for (uint32_t e = EXT_OTHER + 1; e < catalog.ext_count; e++) {
+      uint32_t slot = name_hash(catalog.names.data + catalog.exts[e].name) & (count - 1);
+      while (slots[slot] != NO_ID) {
+        slot = (slot + 1) & (count - 1);
+      }
+      slots[slot] = e;
+    }
+    free(catalog.ext_slots);
+    catalog.ext_slots = slots;
+    catalog.ext_slot_count = count;
+  }
+  if (catalog.ext_slot_count == 0) {
+    return EXT_NONE;
+  }
+  uint32_t mask = catalog.ext_slot_count - 1;
+  uint32_t slot = name_hash(ext) & mask;
+  for (; catalog.ext_slots[slot] != NO_ID; slot = (slot + 1) & mask) {
+    uint32_t e = catalog.ext_slots[slot];
+    if (strcmp(catalog.names.data + catalog.exts[e].name, ext) == 0) {
+      return e;
+    }
+  }
+  if (!create) {
+    return catalog.ext_count >= EXT_NONE ? EXT_OTHER : EXT_NONE;
+  }
+  size_t cap = catalog.ext_cap;
+  catalog.exts = grow_array(catalog.exts, &cap, catalog.ext_count + 1,
+                            sizeof(struct ext_record));
+  catalog.ext_cap = (uint32_t)cap;
+  uint16_t id = (uint16_t)catalog.ext_count++;
+  catalog.exts[id].name = arena_add(&catalog.names, ext);
+  catalog.exts[id].first_file = NO_ID;
+  catalog.exts[id].files = 0;
+  catalog.ext_slots[slot] = id;
+  return id;
+}
+
+/*Function: Empty the extension table, keeping the EXT_OTHER record*/
+void catalog_reset_exts() {
+  free(catalog.exts);
+  free(catalog.ext_slots);
+  catalog.exts = NULL;
+  catalog.ext_slots = NULL;
+  catalog.ext_count = catalog.ext_cap = catalog.ext_slot_count = 0;
+  size_t cap = 0;
+  catalog.exts = grow_array(NULL, &cap, 1, sizeof(struct ext_record));
+  catalog.ext_cap = (uint32_t)cap;
+  catalog.exts[EXT_OTHER].name = arena_add(&catalog.names, "");
+  catalog.exts[EXT_OTHER].first_file = NO_ID;
+  catalog.exts[EXT_OTHER].files = 0;
+  catalog.ext_count = 1;
+}
+
+/*Function: Size histogram class - 0 for empty, else bit length of the size*/
+int size_class(unsigned long long size) {
+  return size == 0 ? 0 : 64 - __builtin_clzll(size);
+}
+
+/*Function: Birth time histogram bucket*/
+int btime_bucket(int64_t btime) {
+  int64_t bucket = btime / BTIME_BUCKET_SECS;
+  return bucket < 0 ? 0 : (bucket >= BTIME_BUCKETS ? BTIME_BUCKETS - 1 : (int)bucket);
+}
+
+/*Function: Adjust the subtree totals of a directory and all its ancestors*/
+void catalog_roll_up(uint32_t dir, int64_t bytes, int32_t files) {
+  for (uint32_t d = dir; d != NO_ID; d = catalog.dirs[d].parent) {
+    catalog.dirs[d].bytes += bytes;
+    catalog.dirs[d].files += files;
+  }
+}
+
+/*Function: Add a file to a directory and the name index*/
+void catalog_add_file(uint32_t dir, const char *name, const char *path) {
+  uint32_t id;
+  if (catalog.free_files != NO_ID) {
+    id = catalog.free_files;
+    catalog.free_files = catalog.files[id].next_in_dir;
+  } else {
+    size_t n = catalog.file_count + 1, cap = catalog.file_cap;
+    struct file_columns *col = &catalog.columns;
+    catalog.files = grow_array(catalog.files, &cap, n, sizeof(struct file_record));
+    cap = catalog.file_cap;
+    col->size = grow_array(col->size, &cap, n, sizeof(uint64_t));
+    cap = catalog.file_cap;
+    col->btime = grow_array(col->btime, &cap, n, sizeof(int64_t));
+    cap = catalog.file_cap;
+    col->ext = grow_array(col->ext, &cap, n, sizeof(uint16_t));
+    cap = catalog.file_cap;
+    col->dir = grow_array(col->dir, &cap, n, sizeof(uint32_t));
+    catalog.file_cap = (uint32_t)cap;
+    id = catalog.file_count++;
+  }
+  struct file_record *file = &catalog.files[id];
+  struct name_entry *entry = catalog_intern(name);
+  file->name = entry->name;
+  file->next_same_name = entry->first_file;
+  entry->first_file = id;
+  bloom_add(name_hash(name));
+  catalog.columns.dir[id] = dir;
+  file->prev_in_dir = NO_ID;
+  file->next_in_dir = catalog.dirs[dir].first_file;
+  if (file->next_in_dir != NO_ID) {
+    catalog.files[file->next_in_dir].prev_in_dir = id;
+  }
+  catalog.dirs[dir].first_file = id;
+  trie_insert(file->name);
+
+  // Planner columns - birth time never changes, so it is read once here
+  struct file_columns *col = &catalog.columns;
+  struct statx stx;
+  col->btime[id] = 0;
+  col->size[id] = 0;
+  if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_BTIME | STATX_SIZE,
+            &stx) == 0) {
+    if (stx.stx_mask & STATX_BTIME) {
+      col->btime[id] = stx.stx_btime.tv_sec;
+    }
+    col->size[id] = stx.stx_size;
+  }
+  catalog.size_classes[size_class(col->size[id])]++;
+  catalog.btime_buckets[btime_bucket(col->btime[id])]++;
+  catalog_roll_up(dir, col->size[id], 1);
+  const char *ext = name_extension(name);
+  col->ext[id] = ext ? catalog_ext_id(ext, true) : EXT_NONE;
+  file->prev_same_ext = NO_ID;
+  file->next_same_ext = NO_ID;
+  if (col->ext[id] != EXT_NONE) {
+    struct ext_record *e = &catalog.exts[col->ext[id]];
+    file->next_same_ext = e->first_file;
+    if (e->first_file != NO_ID) {
+      catalog.files[e->first_file].prev_same_ext = id;
+    }
+    e->first_file = id;
+    e->files++;
+  }
+  skiplist_insert(&catalog.files_by_time, id);
+  catalog.live_files++;
+}
+
+/*Function: Remove a file from its directory and the name index*/
+void catalog_remove_file(uint32_t id) {
+  struct file_record *file = &catalog.files[id];
+  if (file->prev_in_dir != NO_ID) {
+    catalog.files[file->prev_in_dir].next_in_dir = file->next_in_dir;
+  } else {
+    catalog.dirs[catalog.columns.dir[id]].first_file = file->next_in_dir;
+  }
+  if (file->next_in_dir != NO_ID) {
+    catalog.files[file->next_in_dir].prev_in_dir = file->prev_in_dir;
+  }
+  struct name_entry *entry = catalog_name_entry(file_name(id), name_hash(file_name(id)));
+  uint32_t *link = &entry->first_file;
+  while (*link != id) {
+    link = &catalog.files[*link].next_same_name;
+  }
+  *link = file->next_same_name; // Its filter bits stay until the next resize
+  trie_remove(file_name(id));
+  struct file_columns *col = &catalog.columns;
+  if (col->ext[id] != EXT_NONE) {
+    struct ext_record *e = &catalog.exts[col->ext[id]];
+    if (file->prev_same_ext != NO_ID) {
+      catalog.files[file->prev_same_ext].next_same_ext = file->next_same_ext;
+    } else {
+      e->first_file = file->next_same_ext;
+    }
+    if (file->next_same_ext != NO_ID) {
+      catalog.files[file->next_same_ext].prev_same_ext = file->prev_same_ext;
+    }
+    e->files--;
+  }
+  skiplist_remove(&catalog.files_by_time, id);
+  catalog.size_classes[size_class(col->size[id])]--;
+  catalog.btime_buckets[btime_bucket(col->btime[id])]--;
+  catalog_roll_up(col->dir[id], -(int64_t)col->size[id], -1);
+  col->btime[id] = INT64_MIN; // Free rows fail every birth time filter
+  if (entry->first_file == NO_ID) {
+    catalog_release(entry);
+  }
+  file->next_in_dir = catalog.free_files;
+  catalog.free_files = id;
+  catalog.live_files--;
+}
+
+/*Function: Refresh the size column of a file after it was written*/
+void catalog_update_size(uint32_t id, const char *path) {
+  struct stat sb;
+  uint64_t *size = &catalog.columns.size[id];
+  if (lstat(path, &sb) != 0 || (uint64_t)sb.st_size == *size) {
+    return;
+  }
+  catalog.size_classes[size_class(*size)]--;
+  catalog_roll_up(catalog.columns.dir[id], (int64_t)(sb.st_size - *size), 0);
+  *size = sb.st_size;
+  catalog.size_classes[size_class(*size)]++;
+  catalog.size_generation++;
+}
+
+/*Function: Remove a directory and everything below it*/
+void catalog_remove_dir(uint32_t id) {
+  struct dir_record *dir = &catalog.dirs[id];
+  while (dir->first_child != NO_ID) {
+    catalog_remove_dir(dir->first_child);
+  }
+  while (dir->first_file != NO_ID) {
+    catalog_remove_file(dir->first_file);
+  }
+  // Unlink from the parent's child list
+  uint32_t *link = &catalog.dirs[dir->parent].first_child;
+  while (*link != NO_ID && *link != id) {
+    link = &catalog.dirs[*link].next_sibling;
+  }
+  if (*link == id) {
+    *link = dir->next_sibling;
+  }
+  skiplist_remove(&catalog.dirs_by_name, id);
+  skiplist_remove(&catalog.dirs_by_time, id);
+  if (dir->wd >= 0) {
+    inotify_rm_watch(catalog.inotify_fd, dir->wd);
+    catalog.wd_dirs[dir->wd] = NO_ID;
+  }
+  catalog.names_garbage += strlen(dir_name(id)) + 1;
+  dir->live = false;
+  dir->next_sibling = catalog.free_dirs;
+  catalog.free_dirs = id;
+}
+
+/*Function: Find a sub-directory by name*/
+uint32_t catalog_child(uint32_t parent, const char *name) {
+  for (uint32_t c = catalog.dirs[parent].first_child; c != NO_ID;
+       c = catalog.dirs[c].next_sibling) {
+    if (strcmp(dir_name(c), name) == 0) {
+      return c;
+    }
+  }
+  return NO_ID;
+}
+
+// Scan state - nftw() has no user argument
+static __thread uint32_t scan_stack[MAX_SCAN_DEPTH];
+static __thread int scan_base_level;
+
+/*Callback Function for NFTW: Catalog scan - index directories and files*/
+int catalog_scan_processor(const char *fpath, const struct stat *sb,
+                           int typeflag, struct FTW *ftwbuf) {
+  int level = scan_base_level + ftwbuf->level;
+  if (typeflag == FTW_F) {
+    if (level > 0) {
+      catalog_add_file(scan_stack[level - 1], fpath + ftwbuf->base, fpath);
+    }
+    return FTW_CONTINUE;
+  }
+  if (typeflag != FTW_D) {
+    return FTW_CONTINUE;
+  }
+  if (level >= MAX_SCAN_DEPTH) {
+    catalog.complete = false;
+    return FTW_SKIP_SUBTREE;
+  }
+  if (level == 0) {
+    scan_stack[0] = catalog_add_dir(NO_ID, "", fpath, sb); // ~ itself
+    catalog.root_dir = scan_stack[0];
+  } else {
+    scan_stack[level] = catalog_add_dir(scan_stack[level - 1],
+                                        fpath + ftwbuf->base, fpath, sb);
+  }
+  return FTW_CONTINUE;
+}
+
+/*Function: Index a directory subtree below a catalog directory*/
+void catalog_scan(uint32_t parent, const char *path) {
+  if (parent == NO_ID) {
+    scan_base_level = 0;
+  } else {
+    int depth = 0;
+    for (uint32_t d = parent; d != NO_ID; d = catalog.dirs[d].parent) {
+      depth++;
+    }
+    if (depth >= MAX_SCAN_DEPTH) {
+      return;
+    }
+    scan_base_level = depth;
+    scan_stack[depth - 1] = parent;
+  }
+  nftw(path, catalog_scan_processor, 20, FTW_PHYS | FTW_ACTIONRETVAL);
+}
+
+/*Structure: One entry read back from an unwatched directory*/
+struct seen_entry {
+  char *name;
+  bool is_dir;
+};
+
+/*Function: Order read back entries by name*/
+int compare_seen_entries(const void *a, const void *b) {
+  return strcmp(((const struct seen_entry *)a)->name,
+                ((const struct seen_entry *)b)->name);
+}
+
+/*Function: Whether a name was read back, as a directory or not*/
+bool entry_seen(const struct seen_entry *seen, size_t count, const char *name,
+                bool is_dir) {
+  struct seen_entry key = {(char *)name, is_dir};
+  const struct seen_entry *hit =
+      bsearch(&key, seen, count, sizeof(key), compare_seen_entries);
+  return hit != NULL && hit->is_dir == is_dir;
+}
+
+/*Function: Re-read an unwatched directory and apply the difference - true if anything changed*/
+bool catalog_reconcile_dir(uint32_t id, const char *path, const struct stat *sb) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return false; // Its parent's rescan or watch will drop it
+  }
+  struct seen_entry *seen = NULL;
+  size_t count = 0, cap = 0;
+  bool changed = false;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    struct stat st;
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+        fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        S_ISLNK(st.st_mode)) {
+      continue;
+    }
+    seen = grow_array(seen, &cap, count + 1, sizeof(struct seen_entry));
+    seen[count].name = strdup(ent->d_name);
+    seen[count++].is_dir = S_ISDIR(st.st_mode);
+    char child[MAX_PATH_LEN];
+    snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+    if (S_ISDIR(st.st_mode)) {
+      if (catalog_child(id, ent->d_name) == NO_ID) {
+        catalog_scan(id, child);
+        changed = true;
+      }
+    } else {
+      uint32_t f = catalog_find_file(id, ent->d_name);
+      if (f == NO_ID) {
+        catalog_add_file(id, ent->d_name, child);
+        changed = true;
+      } else if ((uint64_t)st.st_size != catalog.columns.size[f]) {
+        catalog_update_size(f, child);
+        changed = true;
+      }
+    }
+  }
+  closedir(dir);
+  qsort(seen, count, sizeof(struct seen_entry), compare_seen_entries);
+  // Whatever the catalog still has but the directory no longer does
+  for (uint32_t c = catalog.dirs[id].first_child, next; c != NO_ID; c = next) {
+    next = catalog.dirs[c].next_sibling;
+    if (!entry_seen(seen, count, dir_name(c), true)) {
+      catalog_remove_dir(c);
+      changed = true;
+    }
+  }
+  for (uint32_t f = catalog.dirs[id].first_file, next; f != NO_ID; f = next) {
+    next = catalog.files[f].next_in_dir;
+    if (!entry_seen(seen, count, file_name(f), false)) {
+      catalog_remove_file(f);
+      changed = true;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    free(seen[i].name);
+  }
+  free(seen);
+  fingerprint_of(sb, &catalog.dirs[id].fingerprint);
+  return changed;
+}
+
+/*Function: Re-stat every unwatched directory, re-reading those whose fingerprint changed*/
+void catalog_rescan() {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint32_t checked = 0, changed = 0;
+  uint32_t dirs = catalog.dir_count; // Dirs found by this rescan were just read
+  for (uint32_t d = 0; d < dirs; d++) {
+    if (!catalog.dirs[d].live || catalog.dirs[d].wd >= 0) {
+      continue;
+    }
+    char path[MAX_PATH_LEN];
+    dir_path(d, path, sizeof(path));
+    struct stat sb;
+    struct dir_fingerprint fp;
+    checked++;
+    if (lstat(path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+      continue;
+    }
+    fingerprint_of(&sb, &fp);
+    const struct dir_fingerprint *old = &catalog.dirs[d].fingerprint;
+    if (fp.ino == old->ino && fp.mtime == old->mtime && fp.ctime == old->ctime &&
+        fp.size == old->size) {
+      continue; // Same entries as when it was last read
+    }
+    if (catalog_reconcile_dir(d, path, &sb)) {
+      changed++;
+    }
+  }
+  if (changed > 0) {
+    catalog.dir_generation++;
+    catalog.file_generation++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Catalog: rescan of %u unwatched directories, %u changed, %.3fs\n",
+           checked, changed,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  }
+}
+
+/*Function: Drop everything and index ~ again (inotify queue overflow)
+* Marks the catalog not ready - the caller sets it again after unlocking.
+*/
+void catalog_rebuild() {
+  atomic_store(&catalog.ready, 0); // Forks meanwhile don't wait for the scan
+  if (catalog.inotify_fd >= 0) {
+    close(catalog.inotify_fd);
+  }
+  catalog.inotify_fd = inotify_init1(IN_CLOEXEC);
+  free(catalog.dirs);
+  free(catalog.names.data);
+  free(catalog.wd_dirs);
+  free(catalog.dirs_by_name.links);
+  free(catalog.dirs_by_name.base);
+  free(catalog.dirs_by_name.height);
+  free(catalog.dirs_by_time.links);
+  free(catalog.dirs_by_time.base);
+  free(catalog.dirs_by_time.height);
+  free(catalog.files);
+  free(catalog.name_table);
+  catalog.name_table = NULL;
+  catalog.name_slots = catalog.name_count = 0;
+  free(catalog.columns.size);
+  free(catalog.columns.btime);
+  free(catalog.columns.ext);
+  free(catalog.columns.dir);
+  memset(&catalog.columns, 0, sizeof(catalog.columns));
+  free(catalog.trie);
+  free(catalog.files_by_time.links);
+  free(catalog.files_by_time.base);
+  free(catalog.files_by_time.height);
+  memset(catalog.size_classes, 0, sizeof(catalog.size_classes));
+  memset(catalog.btime_buckets, 0, sizeof(catalog.btime_buckets));
+  catalog.dirs = NULL;
+  catalog.dir_count = catalog.dir_cap = 0;
+  catalog.free_dirs = NO_ID;
+  catalog.files = NULL;
+  catalog.file_count = catalog.file_cap = catalog.live_files = 0;
+  catalog.free_files = NO_ID;
+  catalog.trie = NULL;
+  catalog.trie_count = catalog.trie_cap = 0;
+  catalog.free_trie = NO_ID;
+  trie_new_node(0, 0); // Root
+  memset(&catalog.names, 0, sizeof(catalog.names));
+  catalog.names_garbage = 0;
+  catalog_reset_exts();
+  catalog.wd_dirs = NULL;
+  catalog.wd_cap = 0;
+  catalog.complete = true;
+  skiplist_init(&catalog.dirs_by_name, compare_dirs_by_name);
+  skiplist_init(&catalog.dirs_by_time, compare_dirs_by_time);
+  skiplist_init(&catalog.files_by_time, compare_files_by_time);
+  catalog_resize_names(MIN_NAME_SLOTS);
+  catalog_scan(NO_ID, catalog.root);
+  catalog.dir_generation++;
+  catalog.file_generation++;
+  catalog.size_generation++;
+}
+
+/*Function: Apply one inotify event to the catalog - false after a rebuild*/
+bool catalog_apply_event(const struct inotify_event *event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    printf("Catalog: inotify queue overflow - rebuilding\n");
+    catalog_rebuild();
+    return false; // Remaining events refer to the old watches
+  }
+  if (event->wd < 0 || event->wd >= catalog.wd_cap ||
+      catalog.wd_dirs[event->wd] == NO_ID) {
+    return true;
+  }
+  uint32_t parent = catalog.wd_dirs[event->wd];
+  if (event->mask & IN_IGNORED) {
+    catalog.wd_dirs[event->wd] = NO_ID; // Watched dir is gone
+    catalog.dirs[parent].wd = -1;
+    return true;
+  }
+  if (event->len == 0) {
+    return true;
+  }
+  char path[MAX_PATH_LEN];
+  entry_path(parent, event->name, path, sizeof(path));
+  if (event->mask & IN_CLOSE_WRITE) {
+    uint32_t file = catalog_find_file(parent, event->name);
+    if (file != NO_ID) {
+      catalog_update_size(file, path); // Only the size column may be stale
+    }
+    return true;
+  }
+  catalog.file_generation++;
+  if (!(event->mask & IN_ISDIR)) {
+    uint32_t file = catalog_find_file(parent, event->name);
+    struct stat sb;
+    if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && file == NO_ID &&
+        lstat(path, &sb) == 0 && !S_ISLNK(sb.st_mode)) {
+      catalog_add_file(parent, event->name, path);
+    } else if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) && file != NO_ID) {
+      catalog_remove_file(file);
+    }
+    return true;
+  }
+  if (!catalog.dirs[parent].hidden && event->name[0] != '.') {
+    catalog.dir_generation++; // A listed directory changes
+  }
+  if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+    if (catalog_child(parent, event->name) == NO_ID) {
+      catalog_scan(parent, path); // Also picks up anything made inside it
+    }
+  } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    uint32_t child = catalog_child(parent, event->name);
+    if (child != NO_ID) {
+      catalog_remove_dir(child);
+    }
+  }
+  return true;
+}
+
+/*Function: Make the current generations visible to connection processes*/
+void catalog_publish() {
+  atomic_store(&catalog.published->dirs, catalog.dir_generation);
+  atomic_store(&catalog.published->files, catalog.file_generation);
+  atomic_store(&catalog.published->sizes, catalog.size_generation);
+}
+
+/*Function: Whether this process's copy has every directory change*/
+bool catalog_dirs_current() {
+  return atomic_load(&catalog.ready) &&
+         catalog.dir_generation == atomic_load(&catalog.published->dirs);
+}
+
+/*Function: Whether this process's copy has every file change*/
+bool catalog_files_current() {
+  return atomic_load(&catalog.ready) && catalog.complete &&
+         catalog.file_generation == atomic_load(&catalog.published->files);
+}
+
+/*Function: Whether this process's size column has every write as well*/
+bool catalog_sizes_current() {
+  return catalog_files_current() &&
+         catalog.size_generation == atomic_load(&catalog.published->sizes);
+}
+
+/*Function: Catalog memory per file - records, columns, indexes and names*/
+double catalog_bytes_per_file() {
+  size_t bytes = (size_t)catalog.file_cap *
+                 (sizeof(struct file_record) + sizeof(uint64_t) + sizeof(int64_t) +
+                  sizeof(uint16_t) + sizeof(uint32_t));
+  bytes += catalog.name_slots * (sizeof(struct name_entry) + 1); // With the filter
+  bytes += catalog.names.cap + catalog.trie_cap * sizeof(struct trie_node);
+  bytes += catalog.files_by_time.links_cap * sizeof(uint32_t) +
+           catalog.files_by_time.nodes_cap * (sizeof(uint32_t) + 1);
+  bytes += catalog.ext_cap * sizeof(struct ext_record) + catalog.ext_slot_count * sizeof(uint32_t);
+  return catalog.live_files ? (double)bytes / catalog.live_files : 0;
+}
+
+/*Structure: Skiplist scalars of a catalog snapshot*/
+struct snapshot_skiplist {
+  uint32_t head[SKIP_MAX_LEVEL];
+  uint32_t level;
+  uint32_t links_len;
+  uint32_t nodes;          // Entries of base and height
+};
+
+/*Structure: Catalog snapshot header - the arrays follow it, each padded to 8
+* bytes, in the order of snapshot_arrays(). Only ids and offsets are stored,
+* never pointers, so the file can be mapped anywhere.
+*/
+struct catalog_snapshot {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;    // Layout checks - a snapshot of another build
+  uint32_t record_sizes[5]; // is rebuilt, not misread
+  uint64_t length;         // Whole file
+  uint64_t checksum;       // Of the arrays
+  char root[MAX_PATH_LEN];
+  bool complete;
+  int64_t generations[3];  // dirs, files, sizes - as published with this data
+  uint32_t root_dir;
+  uint32_t dir_count;
+  uint32_t free_dirs;
+  uint32_t file_count;
+  uint32_t free_files;
+  uint32_t live_files;
+  uint32_t name_slots;
+  uint32_t name_count;
+  uint32_t ext_count;
+  uint32_t ext_slot_count;
+  uint32_t trie_count;
+  uint32_t free_trie;
+  uint64_t names_len;
+  uint64_t names_garbage;
+  uint32_t size_classes[SIZE_CLASSES];
+  uint32_t btime_buckets[BTIME_BUCKETS];
+  struct snapshot_skiplist lists[3]; // dirs_by_name, dirs_by_time, files_by_time
+};
+
+/*Structure: One catalog array stored in a snapshot*/
+struct snapshot_array {
+  void **data;
+  size_t len;              // Bytes
+};
+
+static const uint32_t snapshot_record_sizes[5] = {
+    sizeof(struct dir_record), sizeof(struct file_record), sizeof(struct name_entry),
+    sizeof(struct ext_record), sizeof(struct trie_node)};
+
+/*Function: The catalog's skiplists, in snapshot order*/
+struct skiplist *snapshot_list(int i) {
+  return i == 0 ? &catalog.dirs_by_name
+                : (i == 1 ? &catalog.dirs_by_time : &catalog.files_by_time);
+}
+
+/*Function: The catalog arrays and their sizes as given by a snapshot header*/
+int snapshot_arrays(const struct catalog_snapshot *h, struct snapshot_array *a) {
+  int n = 0;
+  a[n++] = (struct snapshot_array){(void **)&catalog.dirs,
+                                   (size_t)h->dir_count * sizeof(struct dir_record)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.files,
+                                   (size_t)h->file_count * sizeof(struct file_record)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.columns.size,
+                                   (size_t)h->file_count * sizeof(uint64_t)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.columns.btime,
+                                   (size_t)h->file_count * sizeof(int64_t)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.columns.ext,
+                                   (size_t)h->file_count * sizeof(uint16_t)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.columns.dir,
+                                   (size_t)h->file_count * sizeof(uint32_t)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.name_table,
+                                   (size_t)h->name_slots * sizeof(struct name_entry)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.bloom,
+                                   (size_t)h->name_slots / 8 * sizeof(uint64_t)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.names.data, h->names_len};
+  a[n++] = (struct snapshot_array){(void **)&catalog.trie,
+                                   (size_t)h->trie_count * sizeof(struct trie_node)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.exts,
+                                   (size_t)h->ext_count * sizeof(struct ext_record)};
+  a[n++] = (struct snapshot_array){(void **)&catalog.ext_slots,
+                                   (size_t)h->ext_slot_count * sizeof(uint32_t)};
+  for (int i = 0; i < 3; i++) {
+    struct skiplist *sl = snapshot_list(i);
+    a[n++] = (struct snapshot_array){(void **)&sl->links,
+                                     (size_t)h->lists[i].links_len * sizeof(uint32_t)};
+    a[n++] = (struct snapshot_array){(void **)&sl->base,
+                                     (size_t)h->lists[i].nodes * sizeof(uint32_t)};
+    a[n++] = (struct snapshot_array){(void **)&sl->height, h->lists[i].nodes};
+  }
+  return n;
+}
+
+/*Function: Array size rounded up to the snapshot alignment*/
+size_t snapshot_padded(size_t len) {
+  return (len + 7) & ~(size_t)7;
+}
+
+/*Function: Add-rotate checksum over a padded array - runs at memory speed*/
+uint64_t snapshot_checksum(uint64_t sum, const void *data, size_t len) {
+  const unsigned char *p = data;
+  size_t words = len / 8;
+  for (size_t i = 0; i < words; i++) {
+    uint64_t w;
+    memcpy(&w, p + i * 8, 8);
+    sum = ((sum << 7) | (sum >> 57)) + w;
+  }
+  if (len % 8) {
+    uint64_t w = 0; // Padding is zero
+    memcpy(&w, p + words * 8, len % 8);
+    sum = ((sum << 7) | (sum >> 57)) + w;
+  }
+  return sum;
+}
+
+/*Function: Write the catalog to its snapshot file - a new file renamed over the old*/
+void catalog_save() {
+  if (catalog.snapshot == NULL) {
+    return;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct catalog_snapshot *h = calloc(1, sizeof(struct catalog_snapshot));
+  if (h == NULL) {
+    return;
+  }
+  memcpy(h->magic, "W24CATLG", 8);
+  h->version = SNAPSHOT_VERSION;
+  h->header_size = sizeof(struct catalog_snapshot);
+  memcpy(h->record_sizes, snapshot_record_sizes, sizeof(h->record_sizes));
+  snprintf(h->root, sizeof(h->root), "%s", catalog.root);
+  h->complete = catalog.complete;
+  h->generations[0] = catalog.dir_generation;
+  h->generations[1] = catalog.file_generation;
+  h->generations[2] = catalog.size_generation;
+  h->root_dir = catalog.root_dir;
+  h->dir_count = catalog.dir_count;
+  h->free_dirs = catalog.free_dirs;
+  h->file_count = catalog.file_count;
+  h->free_files = catalog.free_files;
+  h->live_files = catalog.live_files;
+  h->name_slots = catalog.name_slots;
+  h->name_count = catalog.name_count;
+  h->ext_count = catalog.ext_count;
+  h->ext_slot_count = catalog.ext_slot_count;
+  h->trie_count = catalog.trie_count;
+  h->free_trie = catalog.free_trie;
+  h->names_len = catalog.names.len;
+  h->names_garbage = catalog.names_garbage;
+  memcpy(h->size_classes, catalog.size_classes, sizeof(h->size_classes));
+  memcpy(h->btime_buckets, catalog.btime_buckets, sizeof(h->btime_buckets));
+  for (int i = 0; i < 3; i++) {
+    struct skiplist *sl = snapshot_list(i);
+    memcpy(h->lists[i].head, sl->head, sizeof(sl->head));
+    h->lists[i].level = sl->level;
+    h->lists[i].links_len = sl->links_len;
+    h->lists[i].nodes = sl->nodes_cap;
+  }
+  struct snapshot_array arrays[32];
+  int n = snapshot_arrays(h, arrays);
+  h->length = snapshot_padded(sizeof(struct catalog_snapshot));
+  for (int i = 0; i < n; i++) {
+    h->checksum = snapshot_checksum(h->checksum, *arrays[i].data, arrays[i].len);
+    h->length += snapshot_padded(arrays[i].len);
+  }
+
+  char tmp[MAX_PATH_LEN];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", catalog.snapshot);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror("Catalog snapshot");
+    free(h);
+    return;
+  }
+  static const char zeros[8];
+  bool ok = write_all(fd, h, sizeof(*h)) == 0 &&
+            write_all(fd, zeros, snapshot_padded(sizeof(*h)) - sizeof(*h)) == 0;
+  for (int i = 0; ok && i < n; i++) {
+    ok = write_all(fd, *arrays[i].data, arrays[i].len) == 0 &&
+         write_all(fd, zeros, snapshot_padded(arrays[i].len) - arrays[i].len) == 0;
+  }
+  close(fd);
+  if (!ok || rename(tmp, catalog.snapshot) != 0) {
+    perror("Catalog snapshot");
+    unlink(tmp);
+    free(h);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Catalog: snapshot of %llu bytes saved in %.3fs\n",
+         (unsigned long long)h->length,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  free(h);
+}
+
+/*Function: Whether id is below count or NO_ID*/
+static inline bool snapshot_id_ok(uint32_t id, uint32_t count) {
+  return id == NO_ID || id < count;
+}
+
+/*Function: Check every id and name offset a snapshot stores - the catalog
+* code indexes with them unchecked. at - start of each snapshot array.
+*/
+bool snapshot_ids_valid(const struct catalog_snapshot *h, const char *const *at) {
+  const struct dir_record *dirs = (const void *)at[0];
+  const struct file_record *files = (const void *)at[1];
+  const int64_t *btime = (const void *)at[3];
+  const uint16_t *ext = (const void *)at[4];
+  const uint32_t *dir = (const void *)at[5];
+  const struct name_entry *table = (const void *)at[6];
+  const char *names = at[8];
+  const struct trie_node *trie = (const void *)at[9];
+  const struct ext_record *exts = (const void *)at[10];
+  const uint32_t *ext_slots = (const void *)at[11];
+  uint64_t names_len = h->names_len;
+  if (names_len == 0 || names[names_len - 1] != '\0' || names_len > NO_ID ||
+      !snapshot_id_ok(h->free_dirs, h->dir_count) ||
+      !snapshot_id_ok(h->free_files, h->file_count) ||
+      !snapshot_id_ok(h->free_trie, h->trie_count) || h->ext_count > EXT_NONE) {
+    return false; // Every name ends inside the arena
+  }
+  for (uint32_t d = 0; d < h->dir_count; d++) {
+    if (dirs[d].name >= names_len || !snapshot_id_ok(dirs[d].parent, h->dir_count) ||
+        !snapshot_id_ok(dirs[d].first_child, h->dir_count) ||
+        !snapshot_id_ok(dirs[d].next_sibling, h->dir_count) ||
+        !snapshot_id_ok(dirs[d].first_file, h->file_count)) {
+      return false;
+    }
+  }
+  for (uint32_t f = 0; f < h->file_count; f++) {
+    const struct file_record *r = &files[f];
+    if (!snapshot_id_ok(r->next_in_dir, h->file_count)) {
+      return false; // Also the free list
+    }
+    if (btime[f] == INT64_MIN) {
+      continue; // Free - nothing else is followed
+    }
+    if (r->name >= names_len || !snapshot_id_ok(r->prev_in_dir, h->file_count) ||
+        !snapshot_id_ok(r->next_same_name, h->file_count) ||
+        !snapshot_id_ok(r->prev_same_ext, h->file_count) ||
+        !snapshot_id_ok(r->next_same_ext, h->file_count) ||
+        (ext[f] != EXT_NONE && ext[f] >= h->ext_count) || dir[f] >= h->dir_count) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->name_slots; i++) {
+    if (!snapshot_id_ok(table[i].name, names_len) ||
+        !snapshot_id_ok(table[i].first_file, h->file_count)) {
+      return false;
+    }
+  }
+  for (uint32_t t = 0; t < h->trie_count; t++) {
+    if (trie[t].label > names_len || trie[t].label_len > names_len - trie[t].label ||
+        !snapshot_id_ok(trie[t].first_child, h->trie_count) ||
+        !snapshot_id_ok(trie[t].next_sibling, h->trie_count)) {
+      return false;
+    }
+  }
+  for (uint32_t e = 0; e < h->ext_count; e++) {
+    if (exts[e].name >= names_len || !snapshot_id_ok(exts[e].first_file, h->file_count)) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->ext_slot_count; i++) {
+    if (!snapshot_id_ok(ext_slots[i], h->ext_count)) {
+      return false;
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    const struct snapshot_skiplist *l = &h->lists[i];
+    const uint32_t *links = (const void *)at[12 + 3 * i];
+    const uint32_t *base = (const void *)at[13 + 3 * i];
+    const uint8_t *height = (const void *)at[14 + 3 * i];
+    uint32_t ids = i < 2 ? h->dir_count : h->file_count;
+    if (l->level > SKIP_MAX_LEVEL || l->nodes < ids) {
+      return false; // Every id has a height
+    }
+    for (int level = 0; level < SKIP_MAX_LEVEL; level++) {
+      if (!snapshot_id_ok(l->head[level], ids)) {
+        return false;
+      }
+    }
+    for (uint32_t id = 0; id < l->nodes; id++) {
+      if (height[id] > SKIP_MAX_LEVEL || base[id] > l->links_len ||
+          height[id] > l->links_len - base[id]) {
+        return false;
+      }
+    }
+    for (uint32_t k = 0; k < l->links_len; k++) {
+      if (!snapshot_id_ok(links[k], ids)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*Function: Map and check a snapshot file - NULL if there is no usable one*/
+const struct catalog_snapshot *snapshot_open(const char *path, size_t *len,
+                                             ino_t *ino) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(struct catalog_snapshot)) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  const struct catalog_snapshot *h = map;
+  const char *reason = NULL;
+  if (memcmp(h->magic, "W24CATLG", 8) != 0 || h->version != SNAPSHOT_VERSION ||
+      h->header_size != sizeof(struct catalog_snapshot) ||
+      memcmp(h->record_sizes, snapshot_record_sizes, sizeof(h->record_sizes)) != 0) {
+    reason = "different format";
+  } else if (strncmp(h->root, catalog.root, sizeof(h->root)) != 0) {
+    reason = "different home directory";
+  } else if (h->length != (uint64_t)sb.st_size || h->root_dir >= h->dir_count ||
+             h->name_slots < MIN_NAME_SLOTS || (h->name_slots & (h->name_slots - 1)) ||
+             (h->ext_slot_count & (h->ext_slot_count - 1)) || h->ext_count == 0 ||
+             h->trie_count == 0) {
+    reason = "truncated or inconsistent";
+  } else {
+    struct snapshot_array arrays[32];
+    const char *at[32];
+    int n = snapshot_arrays(h, arrays);
+    uint64_t length = snapshot_padded(sizeof(struct catalog_snapshot));
+    uint64_t sum = 0;
+    for (int i = 0; i < n && length <= h->length; i++) {
+      at[i] = (const char *)map + length;
+      if (arrays[i].len <= h->length - length) {
+        sum = snapshot_checksum(sum, at[i], arrays[i].len);
+      }
+      length += snapshot_padded(arrays[i].len);
+    }
+    if (length != h->length || sum != h->checksum) {
+      reason = "checksum mismatch";
+    } else if (!snapshot_ids_valid(h, at)) {
+      reason = "ids out of range";
+    }
+  }
+  if (reason != NULL) {
+    printf("Catalog: ignoring snapshot %s - %s\n", path, reason);
+    munmap(map, sb.st_size);
+    return NULL;
+  }
+  *len = sb.st_size;
+  *ino = sb.st_ino;
+  return h;
+}
+
+/*Function: Make a checked snapshot the catalog - its arrays are copied out when
+* they must stay growable, else used in place (read only, shared with the
+* other nodes mapping the same file).
+*/
+void catalog_restore(const struct catalog_snapshot *h, bool copy) {
+  struct snapshot_array arrays[32];
+  int n = snapshot_arrays(h, arrays);
+  const char *src = (const char *)h + snapshot_padded(sizeof(struct catalog_snapshot));
+  for (int i = 0; i < n; i++) {
+    void *data = (void *)src;
+    if (copy) {
+      data = malloc(arrays[i].len ? arrays[i].len : 1);
+      if (data == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+      }
+      memcpy(data, src, arrays[i].len);
+    }
+    *arrays[i].data = data;
+    src += snapshot_padded(arrays[i].len);
+  }
+  catalog.complete = h->complete;
+  catalog.dir_generation = h->generations[0];
+  catalog.file_generation = h->generations[1];
+  catalog.size_generation = h->generations[2];
+  catalog.root_dir = h->root_dir;
+  catalog.dir_count = catalog.dir_cap = h->dir_count;
+  catalog.free_dirs = h->free_dirs;
+  catalog.file_count = catalog.file_cap = h->file_count;
+  catalog.free_files = h->free_files;
+  catalog.live_files = h->live_files;
+  catalog.name_slots = h->name_slots;
+  catalog.name_count = h->name_count;
+  catalog.ext_count = catalog.ext_cap = h->ext_count;
+  catalog.ext_slot_count = h->ext_slot_count;
+  catalog.trie_count = catalog.trie_cap = h->trie_count;
+  catalog.free_trie = h->free_trie;
+  catalog.names.len = catalog.names.cap = h->names_len;
+  catalog.names_garbage = h->names_garbage;
+  memcpy(catalog.size_classes, h->size_classes, sizeof(h->size_classes));
+  memcpy(catalog.btime_buckets, h->btime_buckets, sizeof(h->btime_buckets));
+  for (int i = 0; i < 3; i++) {
+    struct skiplist *sl = snapshot_list(i);
+    memcpy(sl->head, h->lists[i].head, sizeof(sl->head));
+    sl->level = h->lists[i].level;
+    sl->links_len = sl->links_cap = h->lists[i].links_len;
+    sl->nodes_cap = h->lists[i].nodes;
+  }
+  catalog.dirs_by_name.compare = compare_dirs_by_name;
+  catalog.dirs_by_time.compare = compare_dirs_by_time;
+  catalog.files_by_time.compare = compare_files_by_time;
+  for (uint32_t d = 0; copy && d < catalog.dir_count; d++) {
+    catalog.dirs[d].wd = -1; // Watches belong to the process that saved it
+  }
+}
+
+/*Function: Load the catalog from its snapshot file - false if there is no usable one
+* Nothing is watched yet - see catalog_validate().
+*/
+bool catalog_load() {
+  if (catalog.snapshot == NULL) {
+    return false;
+  }
+  size_t len;
+  ino_t ino;
+  const struct catalog_snapshot *h = snapshot_open(catalog.snapshot, &len, &ino);
+  if (h == NULL) {
+    return false;
+  }
+  catalog_restore(h, true);
+  munmap((void *)h, len);
+  return true;
+}
+
+/*Function: Stop using a snapshot in place - its arrays are not ours to free*/
+void catalog_detach() {
+  if (catalog.map == NULL) {
+    return;
+  }
+  static struct catalog_snapshot none;
+  struct snapshot_array arrays[32];
+  int n = snapshot_arrays(&none, arrays);
+  for (int i = 0; i < n; i++) {
+    *arrays[i].data = NULL;
+  }
+  munmap(catalog.map, catalog.map_len);
+  catalog.map = NULL;
+}
+
+/*Function: Switch to the newest snapshot of the maintaining node, if there is a new one*/
+void catalog_attach() {
+  static ino_t tried; // Checked already - only a new file is worth mapping
+  struct stat sb;
+  if (stat(catalog.snapshot, &sb) != 0 || sb.st_ino == tried) {
+    return;
+  }
+  tried = sb.st_ino;
+  size_t len;
+  ino_t ino;
+  const struct catalog_snapshot *h = snapshot_open(catalog.snapshot, &len, &ino);
+  if (h == NULL) {
+    return;
+  }
+  tried = ino;
+  pthread_rwlock_wrlock(&catalog.lock); // Only a fork may be reading
+  catalog_detach();
+  catalog_restore(h, false);
+  catalog.map = (void *)h;
+  catalog.map_len = len;
+  pthread_rwlock_unlock(&catalog.lock);
+  atomic_store(&catalog.ready, 1);
+}
+
+/*Function: Follow the node maintaining the catalog of this host until it goes away
+* The maintaining node holds a lock on the shared file; the others map every
+* snapshot it publishes. A file is never changed once renamed into place, so
+* connections forked earlier keep a consistent (if older) catalog without
+* ever waiting, and find out it is stale from the shared generations.
+*/
+void catalog_follow() {
+  printf("Catalog: following the catalog maintained by another node\n");
+  for (;;) {
+    catalog_attach();
+    if (flock(catalog.share_fd, LOCK_EX | LOCK_NB) == 0) {
+      printf("Catalog: maintaining node gone - taking over\n");
+      return;
+    }
+    usleep(FOLLOW_INTERVAL_MS * 1000);
+  }
+}
+
+/*Function: Check a loaded catalog against the disk - watch every directory,
+* re-read those whose fingerprint changed and refresh every file size. The
+* lock is dropped between chunks, so connections are forked meanwhile and
+* answer from the snapshot.
+*/
+void catalog_validate() {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint32_t changed = 0;
+  long sizes = catalog.size_generation;
+  pthread_rwlock_wrlock(&catalog.lock);
+  catalog.inotify_fd = inotify_init1(IN_CLOEXEC);
+  uint32_t dirs = catalog.dir_count; // Dirs found meanwhile were just read
+  for (uint32_t d = 0; d < dirs; d++) {
+    if (d % VALIDATE_CHUNK == 0 && d > 0) {
+      catalog_publish();
+      pthread_rwlock_unlock(&catalog.lock);
+      pthread_rwlock_wrlock(&catalog.lock);
+    }
+    if (!catalog.dirs[d].live || catalog.dirs[d].wd >= 0) {
+      continue;
+    }
+    char path[MAX_PATH_LEN];
+    dir_path(d, path, sizeof(path));
+    struct stat sb;
+    if (lstat(path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+      continue; // Its parent changed too and drops it
+    }
+    catalog_watch(d, path); // Before reading it, so no change falls in between
+    struct dir_fingerprint fp;
+    fingerprint_of(&sb, &fp);
+    const struct dir_fingerprint *old = &catalog.dirs[d].fingerprint;
+    if ((fp.ino != old->ino || fp.mtime != old->mtime || fp.ctime != old->ctime ||
+         fp.size != old->size) &&
+        catalog_reconcile_dir(d, path, &sb)) {
+      catalog.dir_generation++;
+      catalog.file_generation++;
+      changed++;
+    }
+  }
+  // Writes to existing files leave their directory's fingerprint alone
+  for (uint32_t f = 0; f < catalog.file_count; f++) {
+    if (f % VALIDATE_CHUNK == 0 && f > 0) {
+      catalog_publish();
+      pthread_rwlock_unlock(&catalog.lock);
+      pthread_rwlock_wrlock(&catalog.lock);
+    }
+    if (catalog.columns.btime[f] == INT64_MIN) {
+      continue; // Free row
+    }
+    char path[MAX_PATH_LEN];
+    entry_path(catalog.columns.dir[f], file_name(f), path, sizeof(path));
+    catalog_update_size(f, path);
+  }
+  catalog_publish();
+  pthread_rwlock_unlock(&catalog.lock);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Catalog: snapshot validated in %.3fs - %u directories changed, %ld "
+         "size updates\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         changed, catalog.size_generation - sizes);
+}
+
+/*Function: Whether an event is in ~/w24 (or below) - the archives this server
+writes there would otherwise re-save the whole snapshot after every request*/
+bool catalog_output_event(const struct inotify_event *event) {
+  if (event->wd < 0 || event->wd >= catalog.wd_cap ||
+      catalog.wd_dirs[event->wd] == NO_ID) {
+    return false;
+  }
+  uint32_t output = catalog_child(catalog.root_dir, "w24");
+  for (uint32_t d = catalog.wd_dirs[event->wd]; d != NO_ID && output != NO_ID;
+       d = catalog.dirs[d].parent) {
+    if (d == output) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*Function: Catalog thread - initial scan, then follow inotify events*/
+void *catalog_maintainer(void *arg) {
+  (void)arg;
+  if (catalog.share_fd >= 0 && flock(catalog.share_fd, LOCK_EX | LOCK_NB) != 0) {
+    catalog_follow(); // Another node on this host maintains it
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  atomic_store(&catalog.ready, 0); // Forks don't wait for the load or scan
+  pthread_rwlock_wrlock(&catalog.lock);
+  catalog_detach();
+  bool loaded = catalog_load();
+  if (!loaded) {
+    catalog_rebuild();
+  }
+  bool shared = loaded && // Exactly what the other nodes have mapped
+                catalog.dir_generation == atomic_load(&catalog.published->dirs) &&
+                catalog.file_generation == atomic_load(&catalog.published->files) &&
+                catalog.size_generation == atomic_load(&catalog.published->sizes);
+  if (!shared) {
+    // Move past every generation the other nodes saw
+    catalog.dir_generation = atomic_load(&catalog.published->dirs) + 1;
+    catalog.file_generation = atomic_load(&catalog.published->files) + 1;
+    catalog.size_generation = atomic_load(&catalog.published->sizes) + 1;
+  }
+  catalog_publish();
+  pthread_rwlock_unlock(&catalog.lock);
+  atomic_store(&catalog.ready, 1);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Catalog: %u directories, %u files %s in %.3fs, %.1f bytes/file\n",
+         catalog.dir_count, catalog.live_files,
+         loaded ? "loaded from snapshot" : "indexed",
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         catalog_bytes_per_file());
+  long saved = shared ? catalog.dir_generation + catalog.file_generation +
+                             catalog.size_generation
+                       : -1;
+  if (loaded) {
+    catalog_validate();
+  }
+  if (catalog.dir_generation + catalog.file_generation + catalog.size_generation !=
+      saved) {
+    catalog_save();
+    saved = catalog.dir_generation + catalog.file_generation + catalog.size_generation;
+  }
+  time_t saved_at = time(NULL);
+
+  char events[INOTIFY_BUFFER] __attribute__((aligned(8)));
+  for (;;) {
+    // Without a watch on every directory, changes are also found by rescans
+    long generations = catalog.dir_generation + catalog.file_generation +
+                       catalog.size_generation;
+    if (generations != saved && time(NULL) - saved_at >= SNAPSHOT_INTERVAL) {
+      catalog_save(); // Only this thread changes the catalog - no lock needed
+      saved = generations;
+      saved_at = time(NULL);
+    }
+    int timeout = catalog.complete ? -1 : RESCAN_INTERVAL * 1000;
+    if (generations != saved && (timeout < 0 || timeout > SNAPSHOT_INTERVAL * 1000)) {
+      timeout = SNAPSHOT_INTERVAL * 1000;
+    }
+    struct pollfd pfd = {.fd = catalog.inotify_fd, .events = POLLIN};
+    int ready = poll(&pfd, catalog.inotify_fd >= 0 ? 1 : 0, timeout);
+    if (ready == 0) {
+      if (!catalog.complete) {
+        pthread_rwlock_wrlock(&catalog.lock);
+        catalog_rescan();
+        catalog_publish();
+        pthread_rwlock_unlock(&catalog.lock);
+      }
+      continue;
+    }
+    ssize_t n = ready > 0 ? read(catalog.inotify_fd, events, sizeof(events)) : -1;
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      sleep(1); // Watch fd replaced by a rebuild
+      continue;
+    }
+    pthread_rwlock_wrlock(&catalog.lock);
+    for (char *ptr = events; ptr < events + n;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      long seen[3] = {catalog.dir_generation, catalog.file_generation,
+                      catalog.size_generation};
+      bool own = catalog_output_event(event);
+      if (!catalog_apply_event(event)) {
+        break;
+      }
+      if (own) {
+        // Applied, but the snapshot is not re-saved (nor others told) for it
+        catalog.dir_generation = seen[0];
+        catalog.file_generation = seen[1];
+        catalog.size_generation = seen[2];
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+    if (catalog.names_garbage > (1 << 20) &&
+        catalog.names_garbage > catalog.names.len / 2) {
+      catalog_rebuild(); // Reclaim the names of removed entries
+    }
+    catalog_publish();
+    pthread_rwlock_unlock(&catalog.lock);
+    atomic_store(&catalog.ready, 1); // After a rebuild
+  }
+  return NULL;
+}
+
+bool fork_locked; // The fork copies a catalog no one is changing
+
+/*Functions: Keep the catalog consistent across fork - never copy it mid-update
+* While the catalog is being (re)built, a fork does not wait for the scan - the
+* child just never uses its copy and falls back to find and walks.
+*/
+void catalog_prepare_fork() {
+  fork_locked = false;
+  while (atomic_load(&catalog.ready)) {
+    if (pthread_rwlock_trywrlock(&catalog.lock) == 0) {
+      fork_locked = true;
+      return;
+    }
+    usleep(FORK_LOCK_POLL_US); // Held for one batch of events at most
+  }
+}
+void catalog_parent_after_fork() {
+  if (fork_locked) {
+    pthread_rwlock_unlock(&catalog.lock);
+  }
+}
+void catalog_child_after_fork() {
+  if (!fork_locked) {
+    atomic_store(&catalog.ready, 0); // Copied mid-build
+  }
+  // The lock is held by a thread that does not exist in the child
+  pthread_rwlock_init(&catalog.lock, NULL);
+  if (catalog.share_fd >= 0) {
+    close(catalog.share_fd); // The shared catalog lock must not outlive this node
+    catalog.share_fd = -1;   // Its number is reused - forks from here must not close it
+  }
+}
+
+/*Function: Open the shared generations file and count this node among its
+users - a read lock each node holds until it exits; -1 if it can't be opened*/
+int catalog_join(const char *share) {
+  for (;;) {
+    int fd = open(share, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct flock user = {.l_type = F_RDLCK, .l_whence = SEEK_SET};
+    if (fd < 0 || fcntl(fd, F_SETLKW, &user) < 0) {
+      return fd;
+    }
+    struct stat opened, current;
+    if (fstat(fd, &opened) == 0 && stat(share, &current) == 0 &&
+        opened.st_ino == current.st_ino) {
+      return fd;
+    }
+    close(fd); // The last node left and removed it meanwhile
+  }
+}
+
+/*Function: Remove the shared catalog files if no other node uses them - so
+no snapshot of ~ stays behind in memory once every node has exited*/
+void catalog_leave() {
+  if (catalog.share == NULL || getpid() != catalog.node_pid) {
+    return; // Connection processes hold no read lock
+  }
+  struct flock last = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  if (fcntl(catalog.share_fd, F_SETLK, &last) == 0) {
+    if (catalog.snapshot != NULL) {
+      unlink(catalog.snapshot);
+    }
+    unlink(catalog.share);
+  }
+}
+
+/*Function: SIGINT/SIGTERM - leave the shared catalog, then die of the signal*/
+void catalog_leave_on_signal(int sig) {
+  catalog_leave();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/*Function: Directory of the files this user's nodes share - a 0700 one of our
+own, so no other user can plant, link or read them; false if it is not private*/
+bool shared_dir(char *dir, size_t len) {
+  snprintf(dir, len, SNAPSHOT_DIR, (int)getuid());
+  mkdir(dir, 0700); // Fails if it exists - checked below
+  struct stat sb;
+  return lstat(dir, &sb) == 0 && S_ISDIR(sb.st_mode) && sb.st_uid == getuid() &&
+         (sb.st_mode & 077) == 0;
+}
+
+/*Function: Start the catalog thread - call before accepting connections*/
+void catalog_start() {
+  pthread_rwlock_init(&catalog.lock, NULL);
+  catalog.root = getenv("HOME");
+  catalog.inotify_fd = -1;
+  catalog.share_fd = -1;
+  // Every node of this user and ~ on the host shares one catalog
+  char dir[64], share[MAX_PATH_LEN];
+  int fd = -1;
+  if (shared_dir(dir, sizeof(dir))) {
+    snprintf(share, sizeof(share), "%s/%016llx.share", dir,
+             (unsigned long long)name_hash(catalog.root));
+    if (asprintf(&catalog.snapshot, "%.*s.catalog", (int)(strlen(share) - 6),
+                 share) < 0) {
+      catalog.snapshot = NULL;
+    }
+    fd = catalog_join(share);
+  } else {
+    fprintf(stderr, "No private directory for the shared catalog - indexing alone\n");
+  }
+  catalog.published = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, sizeof(struct catalog_versions)) == 0) {
+    catalog.published = mmap(NULL, sizeof(struct catalog_versions),
+                             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (catalog.published != MAP_FAILED) {
+    catalog.share_fd = fd;
+    catalog.share = strdup(share);
+    catalog.node_pid = getpid();
+    atexit(catalog_leave);
+    signal(SIGINT, catalog_leave_on_signal);
+    signal(SIGTERM, catalog_leave_on_signal);
+  } else {
+    if (fd >= 0) {
+      close(fd);
+    }
+    catalog.published = mmap(NULL, sizeof(struct catalog_versions),
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                             -1, 0); // This node alone
+  }
+  if (catalog.published == MAP_FAILED) {
+    perror("mmap");
+    return; // dirlist keeps using find, w24fn keeps walking
+  }
+  pthread_atfork(catalog_prepare_fork, catalog_parent_after_fork,
+                 catalog_child_after_fork);
+  // Reload signals must interrupt the accept loop, not this thread
+  sigset_t reload, saved;
+  sigemptyset(&reload);
+  sigaddset(&reload, SIGHUP);
+  sigaddset(&reload, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &reload, &saved);
+  pthread_t thread;
+  int failed = pthread_create(&thread, NULL, catalog_maintainer, NULL);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (failed != 0) {
+    perror("Failed to start catalog thread");
+    return; // dirlist keeps using find, w24fn keeps walking
+  }
+  pthread_detach(thread);
+}
+
+/*
+*Command: dirlist -a | -t [-n page_size] [-c cursor]
+*
+* Results are streamed as length prefixed frames (0 ends the reply), read
+* line by line from an external sort, so server memory stays constant no
+* matter how many directories there are. With -n the reply stops after a
+* page and ends with the command that resumes after the last entry.
+*/
+
+/*Structure: Buffered writer for framed text replies*/
+struct stream_writer {
+  int sock;
+  size_t len;
+  int failed;
+  char buf[STREAM_CHUNK];
+};
+
+/*Function: Send the buffered text as one frame*/
+void stream_flush(struct stream_writer *w) {
+  if (w->len == 0 || w->failed) {
+    return;
+  }
+  uint32_t frame = htonl((uint32_t)w->len);
+  if (write_header(w->sock, &frame, sizeof(frame)) < 0 ||
+      write_all(w->sock, w->buf, w->len) < 0) {
+    w->failed = 1; // Client went away - drop the rest
+  }
+  w->len = 0;
+}
+
+/*Function: Append formatted text to a framed reply - a line longer than the
+frame goes out whole, spread over as many frames as it takes*/
+void stream_printf(struct stream_writer *w, const char *fmt, ...) {
+  char line[MAX_PATH_LEN * 2 + 64];
+  char *text = line;
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (n < 0) {
+    return;
+  }
+  if ((size_t)n >= sizeof(line)) {
+    text = arena_alloc(n + 1); // Goes with the request
+    va_start(args, fmt);
+    vsnprintf(text, n + 1, fmt, args);
+    va_end(args);
+  }
+  if (w->len + n > sizeof(w->buf)) {
+    stream_flush(w); // Lines stay within one frame when they fit in one
+  }
+  for (size_t done = 0, part; done < (size_t)n; done += part) {
+    if (w->len == sizeof(w->buf)) {
+      stream_flush(w);
+    }
+    part = sizeof(w->buf) - w->len;
+    if (part > n - done) {
+      part = n - done;
+    }
+    memcpy(w->buf + w->len, text + done, part);
+    w->len += part;
+  }
+}
+
+/*Function: Flush and send the end of reply frame*/
+void stream_end(struct stream_writer *w) {
+  transport_cork(w->sock, 1); // Last frame and end marker leave together, at once
+  stream_flush(w);
+  uint32_t frame = 0;
+  if (!w->failed) {
+    write_all(w->sock, &frame, sizeof(frame));
+  }
+  transport_cork(w->sock, 0);
+}
+
+/*Function: Send a one line framed reply (errors, busy)*/
+void send_stream_message(int sock, const char *msg) {
+  struct stream_writer w = {.sock = sock};
+  stream_printf(&w, "%s", msg);
+  stream_end(&w);
+}
+
+/*Function: Hex encode a sort key into a cursor*/
+void encode_cursor(const char *key, char *cursor, size_t len) {
+  size_t i = 0;
+  for (; key[i] != '\0' && (i + 1) * 2 < len; i++) {
+    sprintf(cursor + i * 2, "%02x", (unsigned char)key[i]);
+  }
+  cursor[i * 2] = '\0';
+}
+
+/*Function: Decode a cursor back into the sort key - false if malformed*/
+bool decode_cursor(const char *cursor, char *key, size_t len) {
+  size_t n = strlen(cursor);
+  if (n % 2 != 0 || n / 2 >= len) {
+    return false;
+  }
+  for (size_t i = 0; i < n / 2; i++) {
+    unsigned int byte;
+    if (sscanf(cursor + i * 2, "%2x", &byte) != 1) {
+      return false;
+    }
+    key[i] = (char)byte;
+  }
+  key[n / 2] = '\0';
+  return true;
+}
+
+/*Function: Compare two -t sort keys ("btime path") the way sort -n orders them*/
+int compare_time_keys(const char *a, const char *b) {
+  long ta = atol(a), tb = atol(b);
+  if (ta != tb) {
+    return (ta > tb) ? 1 : -1;
+  }
+  return strcmp(a, b);
+}
+
+/*Function: Compare a catalog dir with a dirlist -a cursor key ("name<TAB>path")*/
+int compare_dir_name_key(uint32_t id, const void *key) {
+  const char *k = key;
+  const char *tab = strchr(k, '\t');
+  size_t name_len = tab ? (size_t)(tab - k) : strlen(k);
+  const char *name = dir_name(id);
+  int diff = strncmp(name, k, name_len);
+  if (diff == 0 && name[name_len] != '\0') {
+    diff = 1; // Key name is a prefix of this name
+  }
+  if (diff != 0) {
+    return diff;
+  }
+  char path[MAX_PATH_LEN];
+  dir_path(id, path, sizeof(path));
+  return strcmp(path, tab ? tab + 1 : "");
+}
+
+/*Function: Compare a catalog dir with a dirlist -t cursor key ("btime path")*/
+int compare_dir_time_key(uint32_t id, const void *key) {
+  const char *k = key;
+  long long btime = atoll(k);
+  if (catalog.dirs[id].btime != btime) {
+    return (catalog.dirs[id].btime > btime) ? 1 : -1;
+  }
+  const char *space = strchr(k, ' ');
+  char path[MAX_PATH_LEN];
+  dir_path(id, path, sizeof(path));
+  return strcmp(path, space ? space + 1 : "");
+}
+
+/*Function: Serve dirlist from the catalog skiplists - O(log n + page)*/
+void dirlist_from_catalog(struct stream_writer *w, bool by_time,
+                          long page_size, const char *after) {
+  pthread_rwlock_rdlock(&catalog.lock);
+  struct skiplist *sl = by_time ? &catalog.dirs_by_time : &catalog.dirs_by_name;
+  uint32_t id = after[0] == '\0'
+                    ? sl->head[0]
+                    : skiplist_first_after(sl,
+                                           by_time ? compare_dir_time_key
+                                                   : compare_dir_name_key,
+                                           after);
+  uid_t uid = geteuid();
+  uint32_t last = NO_ID;
+  long sent = 0;
+  bool more = false;
+  for (; id != NO_ID && !w->failed; id = *skiplist_next(sl, id, 0)) {
+    if (catalog.dirs[id].uid != uid) {
+      continue; // find -user "$(whoami)"
+    }
+    if (page_size > 0 && sent == page_size) {
+      more = true;
+      break;
+    }
+    stream_printf(w, "%s\n", dir_name(id));
+    last = id;
+    sent++;
+  }
+  char key[CURSOR_KEY_LEN] = "";
+  if (more) {
+    char path[MAX_PATH_LEN];
+    dir_path(last, path, sizeof(path));
+    if (by_time) {
+      snprintf(key, sizeof(key), "%lld %s",
+               (long long)catalog.dirs[last].btime, path);
+    } else {
+      snprintf(key, sizeof(key), "%s\t%s", dir_name(last), path);
+    }
+  }
+  pthread_rwlock_unlock(&catalog.lock);
+
+  if (more) {
+    char next[CURSOR_KEY_LEN * 2 + 1];
+    encode_cursor(key, next, sizeof(next));
+    stream_printf(w, "More entries - next page: dirlist %s -n %ld -c %s\n",
+                  by_time ? "-t" : "-a", page_size, next);
+  }
+  stream_end(w);
+}
+
+/*Function: Stream sub-directories of ~ (not hidden, owned by user)
+* by_time - oldest first by birth time, otherwise alphabetical.
+* page_size - entries per page, 0 for all. cursor - resume point or NULL.
+*/
+void dirlist(int sock, bool by_time, long page_size, const char *cursor) {
+  struct stream_writer w = {.sock = sock};
+  char after[CURSOR_KEY_LEN] = "";
+  if (cursor != NULL && !decode_cursor(cursor, after, sizeof(after))) {
+    send_stream_message(sock, "Invalid cursor\n");
+    return;
+  }
+  if (catalog_dirs_current()) {
+    stream_printf(&w, by_time
+                          ? "List of Sub-directories in the order of creation time:\n"
+                          : "Sorted list of sub-directories:\n");
+    dirlist_from_catalog(&w, by_time, page_size, after);
+    return;
+  }
+  // Catalog still being built, or changed since this connection started -
+  // fall back to find and sort
+
+  // Sort keys: "name<TAB>path" (-a) or "btime path" (-t) - unique per entry
+  FILE *fp;
+  if (by_time) {
+    fp = popen("find ~/ -mindepth 1 -type d -not -path '*/.*' "
+               "-user \"$(whoami)\" -exec stat --format '%W %n' {} + "
+               "| LC_ALL=C sort -n 2>/dev/null",
+               "r");
+  } else {
+    fp = popen("find ~/ -mindepth 1 -type d -not -path '*/.*' "
+               "-user \"$(whoami)\" -printf '%f\\t%p\\n' | LC_ALL=C sort 2>/dev/null",
+               "r");
+  }
+  if (fp == NULL) {
+    perror("popen");
+    send_stream_message(sock, "Failed to list directories\n");
+    return;
+  }
+
+  stream_printf(&w, by_time
+                        ? "List of Sub-directories in the order of creation time:\n"
+                        : "Sorted list of sub-directories:\n");
+  char key[CURSOR_KEY_LEN];
+  char last[CURSOR_KEY_LEN] = "";
+  long sent = 0;
+  bool more = false;
+  while (fgets(key, sizeof(key), fp) != NULL && !w.failed) {
+    if (strchr(key, '\n') == NULL && !feof(fp)) {
+      // Path too long for a cursor - skipped, as the catalog does
+      for (int c = 0; c != '\n' && c != EOF; c = fgetc(fp)) {
+      }
+      continue;
+    }
+    key[strcspn(key, "\n")] = '\0'; // Remove newline character
+    if (after[0] != '\0' && (by_time ? compare_time_keys(key, after)
+                                     : strcmp(key, after)) <= 0) {
+      continue; // Already sent on an earlier page
+    }
+    if (page_size > 0 && sent == page_size) {
+      more = true;
+      break;
+    }
+    // Only the directory name is shown
+    const char *slash = strrchr(key, '/');
+    const char *name = (by_time && slash != NULL) ? slash + 1 : key;
+    int name_len = by_time ? (int)strlen(name) : (int)strcspn(key, "\t");
+    stream_printf(&w, "%.*s\n", name_len, name);
+    snprintf(last, sizeof(last), "%s", key);
+    sent++;
+  }
+  pclose(fp); // Closing early stops find/sort
+
+  if (more) {
+    char next[CURSOR_KEY_LEN * 2 + 1];
+    encode_cursor(last, next, sizeof(next));
+    stream_printf(&w, "More entries - next page: dirlist %s -n %ld -c %s\n",
+                  by_time ? "-t" : "-a", page_size, next);
+  }
+  stream_end(&w);
+}
+
+/*
+*Command: w24fn
+*/
+
+/*Function: Retrieve file permissions without use of external libs - for w24fn (filename)*/
+void extract_permissions(mode_t mode, char *permissions) {
+  permissions[0] = (S_ISDIR(mode)) ? 'd' : '-';
+  permissions[1] = (mode & S_IRUSR) ? 'r' : '-';
+  permissions[2] = (mode & S_IWUSR) ? 'w' : '-';
+  permissions[3] = (mode & S_IXUSR) ? 'x' : '-';
+  permissions[4] = (mode & S_IRGRP) ? 'r' : '-';
+  permissions[5] = (mode & S_IWGRP) ? 'w' : '-';
+  permissions[6] = (mode & S_IXGRP) ? 'x' : '-';
+  permissions[7] = (mode & S_IROTH) ? 'r' : '-';
+  permissions[8] = (mode & S_IWOTH) ? 'w' : '-';
+  permissions[9] = (mode & S_IXOTH) ? 'x' : '-';
+  permissions[10] = '\0'; // end/null term
+}
+
+/*Function: Fetches filename*/
+char *get_filename(const char *path) {
+  const char *last_slash = strrchr(path, '/');
+  if (last_slash) {
+    return (char *)(last_slash +
+                    1); // Return the substring after the last slash
+  }
+  return (char *)path; // If no slash was found, path is the filename
+}
+
+/*Function: Format the details of a found file - as w24fn prints them*/
+void describe_file(char *out, size_t len, const char *fname, long size,
+                   time_t ctime, mode_t mode) {
+  char permissions[11];
+  extract_permissions(mode, permissions);
+
+  char creation_time[30];
+  struct tm created; // localtime() would re-read the zone on every call
+  strftime(creation_time, sizeof(creation_time), "%Y-%m-%d %H:%M:%S",
+           localtime_r(&ctime, &created));
+
+  snprintf(out, len,
+           "File: %s\nSize: %ld bytes\nDate created: %s\nPermissions: %s\n",
+           fname, size, creation_time, permissions);
+}
+
+/*Structure: Filenames looked up together - one index probe or walk for all*/
+struct name_lookup {
+  char **names;
+  int count;
+  int *table;                  // Set of distinct names - index, -1 when empty
+  int table_size;              // Power of two, at least twice count
+  char (*info)[FILE_INFO_LEN]; // Details per name, empty if not found
+  bool *resolved;              // Found, or known to be missing
+  int pending;                 // Distinct names not resolved yet
+};
+
+// Lookup of the running walk - nftw() has no user argument
+static __thread struct name_lookup *walk_lookup;
+
+/*Function: Index of a name in the lookup set, -1 if it is not one of them*/
+int lookup_find(const struct name_lookup *lookup, const char *name) {
+  int mask = lookup->table_size - 1;
+  for (int slot = name_hash(name) & mask; lookup->table[slot] >= 0;
+       slot = (slot + 1) & mask) {
+    if (strcmp(lookup->names[lookup->table[slot]], name) == 0) {
+      return lookup->table[slot];
+    }
+  }
+  return -1;
+}
+
+/*Function: Set up a lookup of count names - repeated names are looked up once.
+Lives in the request arena*/
+void lookup_init(struct name_lookup *lookup, char **names, int count) {
+  lookup->names = names;
+  lookup->count = count;
+  lookup->table_size = 2;
+  while (lookup->table_size < 2 * count) {
+    lookup->table_size *= 2;
+  }
+  lookup->table = arena_alloc(lookup->table_size * sizeof(int));
+  lookup->info = arena_alloc((count + 1) * FILE_INFO_LEN);
+  lookup->resolved = arena_calloc(count + 1, sizeof(bool));
+  memset(lookup->table, -1, lookup->table_size * sizeof(int));
+  for (int i = 0; i <= count; i++) {
+    lookup->info[i][0] = '\0';
+  }
+  lookup->pending = 0;
+  int mask = lookup->table_size - 1;
+  for (int i = 0; i < count; i++) {
+    int slot = name_hash(names[i]) & mask;
+    while (lookup->table[slot] >= 0 && strcmp(names[lookup->table[slot]], names[i]) != 0) {
+      slot = (slot + 1) & mask;
+    }
+    if (lookup->table[slot] < 0) {
+      lookup->table[slot] = i;
+      lookup->pending++;
+    }
+  }
+}
+
+/* Callback Function for NFTW: Parsing directory structure -physical walks */
+int file_processor(const char *fpath, const struct stat *sb, int typeflag,
+                   struct FTW *ftwbuf) {
+  if (typeflag == FTW_F) {
+    struct name_lookup *lookup = walk_lookup; // Target files to search for
+    int i = lookup_find(lookup, fpath + ftwbuf->base);
+    if (i >= 0 && !lookup->resolved[i]) {
+      // File found, extract details
+      describe_file(lookup->info[i], FILE_INFO_LEN, get_filename(fpath),
+                    (long)sb->st_size, sb->st_ctime, sb->st_mode);
+      lookup->resolved[i] = true;
+      if (--lookup->pending == 0) {
+        return 1; // Stop the walk as every file is found
+      }
+    }
+  }
+  return 0; // Continue walking
+}
+
+/*Function: Resolve names from the catalog - what it can't tell stays pending
+* A miss is answered by the Bloom filter or one hash chain, a hit by a single
+* statx of the indexed path.
+*/
+void w24fn_from_catalog(struct name_lookup *lookup) {
+  if (!atomic_load(&catalog.ready)) {
+    return;
+  }
+  pthread_rwlock_rdlock(&catalog.lock);
+  // Not found is only final if no file changed since this copy was made
+  bool current = catalog_files_current();
+  for (int i = 0; i < lookup->count; i++) {
+    const char *filename = lookup->names[i];
+    if (lookup->resolved[i] || lookup_find(lookup, filename) != i) {
+      continue; // Done, or a repeat of an earlier name
+    }
+    uint64_t hash = name_hash(filename);
+    bool found = false;
+    struct name_entry *entry =
+        bloom_may_contain(hash) ? catalog_name_entry(filename, hash) : NULL;
+    if (entry != NULL) {
+      for (uint32_t f = entry->first_file; f != NO_ID && !found;
+           f = catalog.files[f].next_same_name) {
+        char path[MAX_PATH_LEN];
+        entry_path(catalog.columns.dir[f], filename, path, sizeof(path));
+        struct statx stx;
+        if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+                  &stx) == 0 &&
+            !S_ISDIR(stx.stx_mode) && !S_ISLNK(stx.stx_mode)) {
+          describe_file(lookup->info[i], FILE_INFO_LEN, filename,
+                        (long)stx.stx_size, stx.stx_ctime.tv_sec, stx.stx_mode);
+          found = true;
+        }
+      }
+    }
+    if (found || current) {
+      lookup->resolved[i] = true;
+      lookup->pending--;
+    }
+  }
+  pthread_rwlock_unlock(&catalog.lock);
+}
+
+/*Function: Look up every name of a lookup - catalog first, then one walk for the rest*/
+void w24fn(const char *root_path, struct name_lookup *lookup) {
+  w24fn_from_catalog(lookup);
+  if (lookup->pending == 0) {
+    return;
+  }
+  walk_lookup = lookup;
+  nftw(root_path, file_processor, 20, FTW_PHYS);
+  walk_lookup = NULL;
+}
+
+/*
+*Command: w24search -p prefix | -g glob | -f name [-d distance] [-n count]
+*
+* Served from the catalog's name trie. Globs (and prefixes, as "prefix*")
+* run as a bit-parallel NFA while walking it, so a branch is dropped on its
+* first impossible byte. Fuzzy matches carry one edit distance row per trie
+* level and drop a branch once the whole row is over the limit.
+*/
+
+/*Structure: A fuzzy match waiting to be sent*/
+struct fuzzy_hit {
+  int distance;
+  char name[NAME_MAX + 2];
+};
+
+/*Structure: A w24search in progress*/
+struct name_search {
+  int mode;
+  uint64_t glob_match[256];  // Per byte: pattern positions it can advance
+  uint64_t glob_star;        // Positions holding '*'
+  int glob_len;
+  const char *query;         // Fuzzy
+  int query_len;
+  int max_distance;
+  uint8_t rows[NAME_MAX + 2][MAX_PATTERN_LEN + 1];
+  struct fuzzy_hit *hits;    // Best names so far, by distance
+  int hit_count;
+  char name[NAME_MAX + 2];   // Name spelled by the walk so far
+  long limit;
+  long sent;
+  bool more;
+  struct stream_writer *w;
+};
+
+
+/*Function: Compile a glob (* ? [set] [!set] \x) into per-byte position masks*/
+bool glob_compile(struct name_search *s, const char *pattern) {
+  memset(s->glob_match, 0, sizeof(s->glob_match));
+  s->glob_star = 0;
+  int n = 0;
+  for (const char *p = pattern; *p != '\0'; p++) {
+    if (n == MAX_PATTERN_LEN) {
+      return false;
+    }
+    uint64_t bit = 1ULL << n;
+    if (*p == '*') {
+      if (n > 0 && (s->glob_star & (bit >> 1))) {
+        continue; // "**" is "*"
+      }
+      s->glob_star |= bit;
+    } else if (*p == '?') {
+      for (int c = 1; c < 256; c++) {
+        s->glob_match[c] |= bit;
+      }
+    } else if (*p == '[') {
+      const char *q = p + 1;
+      bool negate = (*q == '!' || *q == '^');
+      if (negate) {
+        q++;
+      }
+      bool set[256] = {false};
+      do {
+        if (*q == '\0') {
+          return false; // Unterminated set
+        }
+        unsigned char lo = *q, hi = *q;
+        if (q[1] == '-' && q[2] != ']' && q[2] != '\0') {
+          hi = q[2];
+          q += 2;
+        }
+        for (int c = lo; c <= hi; c++) {
+          set[c] = true;
+        }
+        q++;
+      } while (*q != ']');
+      for (int c = 1; c < 256; c++) {
+        if (set[c] != negate) {
+          s->glob_match[c] |= bit;
+        }
+      }
+      p = q;
+    } else {
+      if (*p == '\\' && p[1] != '\0') {
+        p++;
+      }
+      s->glob_match[(unsigned char)*p] |= bit;
+    }
+    n++;
+  }
+  s->glob_len = n;
+  s->mode = SEARCH_GLOB;
+  return true;
+}
+
+/*Function: Positions reachable without consuming a byte (through '*')*/
+uint64_t glob_closure(const struct name_search *s, uint64_t state) {
+  return state | ((state & s->glob_star) << 1);
+}
+
+/*Function: Send every file of a matched name - false once the limit is hit*/
+bool search_send_name(struct name_search *s, const char *name) {
+  struct name_entry *entry = catalog_name_entry(name, name_hash(name));
+  for (uint32_t f = entry ? entry->first_file : NO_ID; f != NO_ID && !s->w->failed;
+       f = catalog.files[f].next_same_name) {
+    char path[MAX_PATH_LEN];
+    entry_path(catalog.columns.dir[f], name, path, sizeof(path));
+    struct statx stx;
+    if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) != 0) {
+      continue; // Gone since this connection's snapshot
+    }
+    if (s->sent == s->limit) {
+      s->more = true;
+      return false;
+    }
+    char details[MAX_PATH_LEN + 128];
+    describe_file(details, sizeof(details), path, (long)stx.stx_size,
+                  stx.stx_ctime.tv_sec, stx.stx_mode);
+    stream_printf(s->w, "%s\n", details);
+    s->sent++;
+  }
+  return !s->w->failed;
+}
+
+/*Function: Keep a fuzzy match if it is among the best - returns the distance
+* still worth exploring*/
+int search_keep_hit(struct name_search *s, int distance) {
+  if (s->hit_count == s->limit && distance >= s->hits[s->hit_count - 1].distance) {
+    return s->hits[s->hit_count - 1].distance - 1;
+  }
+  int i = (s->hit_count < s->limit) ? s->hit_count++ : s->hit_count - 1;
+  while (i > 0 && s->hits[i - 1].distance > distance) {
+    s->hits[i] = s->hits[i - 1]; // Stays in name order within a distance
+    i--;
+  }
+  s->hits[i].distance = distance;
+  snprintf(s->hits[i].name, sizeof(s->hits[i].name), "%s", s->name);
+  if (s->hit_count == s->limit) {
+    return s->hits[s->hit_count - 1].distance - 1;
+  }
+  return s->max_distance;
+}
+
+/*Function: Walk the trie below a node, spelling names in s->name*/
+void search_walk(struct name_search *s, uint32_t node, int depth, uint64_t state) {
+  if (catalog.trie[node].files > 0) {
+    if (s->mode == SEARCH_GLOB && (state & (1ULL << s->glob_len))) {
+      s->name[depth] = '\0';
+      if (!search_send_name(s, s->name)) {
+        return;
+      }
+    } else if (s->mode == SEARCH_FUZZY &&
+               s->rows[depth][s->query_len] <= s->max_distance) {
+      s->name[depth] = '\0';
+      s->max_distance = search_keep_hit(s, s->rows[depth][s->query_len]);
+    }
+  }
+  for (uint32_t child = catalog.trie[node].first_child;
+       child != NO_ID && !s->more && !s->w->failed && s->max_distance >= 0;
+       child = catalog.trie[child].next_sibling) {
+    const char *label = trie_label(child);
+    uint32_t len = catalog.trie[child].label_len;
+    if (depth + len > NAME_MAX) {
+      continue;
+    }
+    uint64_t next = state;
+    bool alive = true;
+    for (uint32_t i = 0; i < len && alive; i++) {
+      unsigned char c = label[i];
+      s->name[depth + i] = c;
+      if (s->mode == SEARCH_GLOB) {
+        next = glob_closure(s, ((next & s->glob_match[c]) << 1) |
+                                   (next & s->glob_star));
+        alive = next != 0;
+      } else {
+        uint8_t *above = s->rows[depth + i], *row = s->rows[depth + i + 1];
+        row[0] = above[0] < 255 ? above[0] + 1 : 255;
+        int best = row[0];
+        for (int j = 1; j <= s->query_len; j++) {
+          int cost = above[j - 1] + (s->query[j - 1] != c);
+          if (above[j] + 1 < cost) {
+            cost = above[j] + 1;
+          }
+          if (row[j - 1] + 1 < cost) {
+            cost = row[j - 1] + 1;
+          }
+          row[j] = cost > 255 ? 255 : cost;
+          if (row[j] < best) {
+            best = row[j];
+          }
+        }
+        alive = best <= s->max_distance;
+      }
+    }
+    if (alive) {
+      search_walk(s, child, depth + len, next);
+    }
+  }
+}
+
+/*Function: Run a w24search and stream the matching files with their details*/
+void w24search(int sock, int mode, const char *query, int max_distance,
+               long limit) {
+  struct stream_writer w = {.sock = sock};
+  if (!atomic_load(&catalog.ready)) {
+    send_stream_message(sock, "Search index is still being built - try again shortly\n");
+    return;
+  }
+  struct name_search *s = arena_calloc(1, sizeof(struct name_search));
+  s->w = &w;
+  s->limit = limit;
+  s->max_distance = max_distance;
+  bool valid;
+  if (mode == SEARCH_FUZZY) {
+    s->mode = SEARCH_FUZZY;
+    s->query = query;
+    s->query_len = (int)strlen(query);
+    valid = s->query_len <= MAX_PATTERN_LEN;
+    for (int j = 0; j <= s->query_len && valid; j++) {
+      s->rows[0][j] = j;
+    }
+    s->hits = arena_alloc(limit * sizeof(struct fuzzy_hit));
+  } else {
+    valid = glob_compile(s, query);
+  }
+  if (!valid) {
+    send_stream_message(sock, "Invalid or too long search pattern\n");
+    return;
+  }
+
+  stream_printf(&w, "Search results:\n");
+  pthread_rwlock_rdlock(&catalog.lock);
+  search_walk(s, 0, 0, mode == SEARCH_FUZZY ? 0 : glob_closure(s, 1));
+  for (int i = 0; i < s->hit_count && !s->more && !w.failed; i++) {
+    search_send_name(s, s->hits[i].name);
+  }
+  pthread_rwlock_unlock(&catalog.lock);
+  if (s->sent == 0) {
+    stream_printf(&w, "No matching files\n");
+  } else if (s->more) {
+    stream_printf(&w, "More than %ld matches - refine the pattern or raise -n\n",
+                  limit);
+  }
+  stream_end(&w);
+}
+
+
+/*
+*Scheduler - admission control for light (metadata) and heavy (archive) commands
+*
+* Every connection is its own process, so the slot table lives in a shared
+* mapping created before the first fork. Each class has its own concurrency
+* limit and a bounded wait queue; requests beyond that are rejected instead of
+* piling up. Archive work runs at a lower CPU/IO priority so light commands
+* keep their latency while archives are being built.
+*/
+
+/*Structure: Limits and slots of one command class*/
+struct class_state {
+  int limit;        // Concurrent commands allowed
+  int max_queue;    // Waiters allowed before rejecting outright
+  int max_wait_ms;  // Bounded wait for a slot
+  int waiting;
+  pid_t owner[MAX_SLOTS]; // Slot holders - 0 when free
+  long admitted;
+  long rejected;
+};
+
+/*Structure: Bulk transfer registered with the egress scheduler*/
+struct egress_flow {
+  pid_t owner;    // 0 when free
+  int weight;
+  long rate_cap;  // Bytes/s, 0 - no cap
+  long share;     // Rate granted at the last chunk (bytes/s)
+  long long next_send; // CLOCK_MONOTONIC ns the next chunk may leave at
+  long bytes_sent;
+};
+
+/*Structure: Egress weight and rate cap for one client address*/
+struct client_rule {
+  struct in_addr addr;
+  int weight;
+  long rate_cap;
+};
+
+/*Structure: Scheduler state shared by all connection processes of a node*/
+struct scheduler_state {
+  pthread_mutex_t lock; // Process shared, robust
+  pthread_cond_t slot_freed;
+  struct class_state classes[2];
+  long light_latency[LATENCY_BUCKETS]; // log2(microseconds) histogram
+  long light_slo_misses;
+  struct egress_flow flows[MAX_FLOWS];  // Bulk transfers in progress
+};
+
+struct scheduler_state *scheduler;
+
+// Scheduler settings - changed via -a/-m/-w/-s
+int heavy_limit = 2;
+int light_limit = 16;
+int heavy_wait_ms = 5000;
+int light_slo_ms = 200;
+
+// Egress settings - changed via -b/-c
+long egress_rate = 0; // Node uplink budget for bulk transfers, 0 - unlimited
+struct client_rule client_rules[MAX_CLIENT_RULES];
+int client_rule_count = 0;
+
+/*Function: Create the shared scheduler state - call before forking*/
+void scheduler_init() {
+  scheduler = mmap(NULL, sizeof(struct scheduler_state),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (scheduler == MAP_FAILED) {
+    caught_error("ERROR: Failed to map scheduler state");
+  }
+  memset(scheduler, 0, sizeof(*scheduler));
+
+  pthread_mutexattr_t mattr;
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&scheduler->lock, &mattr);
+  pthread_mutexattr_destroy(&mattr);
+
+  pthread_condattr_t cattr;
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+  pthread_cond_init(&scheduler->slot_freed, &cattr);
+  pthread_condattr_destroy(&cattr);
+
+  struct class_state *light = &scheduler->classes[CLASS_LIGHT];
+  light->limit = light_limit;
+  light->max_queue = light_limit * 4;
+  light->max_wait_ms = light_slo_ms * 5;
+  struct class_state *heavy = &scheduler->classes[CLASS_HEAVY];
+  heavy->limit = heavy_limit;
+  heavy->max_queue = heavy_limit * 4;
+  heavy->max_wait_ms = heavy_wait_ms;
+}
+
+/*Function: Take the scheduler lock - recovers it if its holder died*/
+void scheduler_lock() {
+  if (pthread_mutex_lock(&scheduler->lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(&scheduler->lock);
+  }
+}
+
+/*Function: Free slots whose owning process has exited without releasing*/
+void reclaim_dead_slots(struct class_state *cls) {
+  for (int i = 0; i < cls->limit; i++) {
+    if (cls->owner[i] != 0 && kill(cls->owner[i], 0) == -1 && errno == ESRCH) {
+      cls->owner[i] = 0;
+    }
+  }
+}
+
+/*Function: Wait (bounded) for a slot of a class - returns the slot or -1*/
+int admit_command(int class_id) {
+  struct class_state *cls = &scheduler->classes[class_id];
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += cls->max_wait_ms / 1000;
+  deadline.tv_nsec += (cls->max_wait_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  scheduler_lock();
+  bool queued = false;
+  for (;;) {
+    reclaim_dead_slots(cls);
+    for (int i = 0; i < cls->limit; i++) {
+      if (cls->owner[i] == 0) {
+        cls->owner[i] = getpid();
+        cls->admitted++;
+        if (queued) {
+          cls->waiting--;
+        }
+        pthread_mutex_unlock(&scheduler->lock);
+        return i;
+      }
+    }
+    if (!queued) {
+      if (cls->waiting >= cls->max_queue) {
+        break; // Queue is full - reject right away
+      }
+      cls->waiting++;
+      queued = true;
+    }
+    int rc = pthread_cond_timedwait(&scheduler->slot_freed, &scheduler->lock,
+                                    &deadline);
+    if (rc == EOWNERDEAD) {
+      pthread_mutex_consistent(&scheduler->lock);
+    } else if (rc == ETIMEDOUT) {
+      break;
+    }
+  }
+  if (queued) {
+    cls->waiting--;
+  }
+  cls->rejected++;
+  pthread_mutex_unlock(&scheduler->lock);
+  return -1;
+}
+
+/*Function: Give a slot back and wake the waiters*/
+void release_command(int class_id, int slot) {
+  scheduler_lock();
+  scheduler->classes[class_id].owner[slot] = 0;
+  pthread_cond_broadcast(&scheduler->slot_freed);
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*Function: Whether a command's reply is a framed stream*/
+bool streamed_reply(const char *command) {
+  if (strncmp(command, "dirlist", 7) == 0 || strncmp(command, "w24search", 9) == 0 ||
+      strncmp(command, "w24q -l", 7) == 0 || strncmp(command, "w24top", 6) == 0 ||
+      strncmp(command, "w24du", 5) == 0 || strncmp(command, "w24job list", 11) == 0) {
+    return true;
+  }
+  // w24fn with more than one name
+  const char *space = strchr(command, ' ');
+  return strncmp(command, "w24fn ", 6) == 0 && space != NULL &&
+         strchr(space + 1, ' ') != NULL;
+}
+
+/*Function: Heavy or light - archive builds are heavy, everything else light*/
+int classify_command(const char *command) {
+  char copy[64];
+  snprintf(copy, sizeof(copy), "%s", command);
+  char *saveptr;
+  char *name = strtok_r(copy, " ", &saveptr);
+  if (name != NULL &&
+      (strcmp(name, "w24fz") == 0 || strcmp(name, "w24ft") == 0 ||
+       strcmp(name, "w24fdb") == 0 || strcmp(name, "w24fda") == 0 ||
+       strcmp(name, "w24shard") == 0 ||
+       (strcmp(name, "w24q") == 0 && !streamed_reply(command)))) {
+    return CLASS_HEAVY;
+  }
+  return CLASS_LIGHT; // Background jobs take their heavy slot themselves
+}
+
+/*Function: Record the latency of a light command against its SLO*/
+void record_light_latency(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long usecs = (end.tv_sec - start->tv_sec) * 1000000L +
+               (end.tv_nsec - start->tv_nsec) / 1000;
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && (1L << (bucket + 1)) <= usecs) {
+    bucket++;
+  }
+  scheduler_lock();
+  scheduler->light_latency[bucket]++;
+  if (usecs > light_slo_ms * 1000L) {
+    scheduler->light_slo_misses++;
+    printf("Light command missed its %dms SLO (%ldms)\n", light_slo_ms,
+           usecs / 1000);
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*Structure: Admission slot held by the connection's current command*/
+struct held_slot {
+  int class_id;
+  int slot; // -1 - none held
+  struct timespec started;
+};
+
+struct held_slot held = {.slot = -1};
+
+/*Function: Give back the current command's slot - early when the command goes
+on to wait for something that needs no slot (a job fetch joining its job)*/
+void release_held_slot() {
+  if (held.slot < 0) {
+    return;
+  }
+  release_command(held.class_id, held.slot);
+  if (held.class_id == CLASS_LIGHT) {
+    record_light_latency(&held.started);
+  }
+  held.slot = -1;
+}
+
+/*Function: Upper bound (microseconds) of a light latency percentile*/
+long light_latency_percentile(double pct) {
+  long total = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    total += scheduler->light_latency[i];
+  }
+  long seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += scheduler->light_latency[i];
+    if (total > 0 && seen >= total * pct) {
+      return 1L << (i + 1);
+    }
+  }
+  return 0;
+}
+
+/*Function: Archive work runs below light commands - lower CPU and IO priority*/
+void lower_stage_priority() {
+  setpriority(PRIO_PROCESS, gettid(), HEAVY_NICE);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, gettid(),
+          IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7));
+}
+
+/*
+*Egress scheduler - weighted fair sharing of the uplink between bulk transfers
+*
+* Archive transfers of all connections register a flow in the shared
+* scheduler state. Every flow is paced to its weighted max-min share of the
+* node rate (-b): flows capped below their share (-c ip=weight:cap) give the
+* rest to the others. Small replies are never paced, and since bulk traffic
+* stays under the node rate they do not queue behind it.
+*/
+
+/*Function: Parse a byte count with an optional K/M/G suffix*/
+long parse_rate(const char *text) {
+  char *end;
+  double value = strtod(text, &end);
+  if (*end == 'K' || *end == 'k') {
+    value *= 1024;
+  } else if (*end == 'M' || *end == 'm') {
+    value *= 1024 * 1024;
+  } else if (*end == 'G' || *end == 'g') {
+    value *= 1024.0 * 1024 * 1024;
+  }
+  return (long)value;
+}
+
+/*Function: Add a per-client egress rule - "ip=weight" or "ip=weight:cap"*/
+void add_client_rule(const char *spec) {
+  if (client_rule_count == MAX_CLIENT_RULES) {
+    fprintf(stderr, "Too many client rules\n");
+    exit(EXIT_FAILURE);
+  }
+  struct client_rule *rule = &client_rules[client_rule_count];
+  char ip[INET_ADDRSTRLEN];
+  const char *eq = strchr(spec, '=');
+  if (eq == NULL || eq - spec >= INET_ADDRSTRLEN) {
+    fprintf(stderr, "Client rule must be ip=weight[:cap]\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(ip, spec, eq - spec);
+  ip[eq - spec] = '\0';
+  if (inet_pton(AF_INET, ip, &rule->addr) != 1) {
+    fprintf(stderr, "Invalid client address %s\n", ip);
+    exit(EXIT_FAILURE);
+  }
+  rule->weight = atoi(eq + 1);
+  const char *colon = strchr(eq, ':');
+  rule->rate_cap = colon ? parse_rate(colon + 1) : 0;
+  if (rule->weight < 1) {
+    fprintf(stderr, "Client weight must be at least 1\n");
+    exit(EXIT_FAILURE);
+  }
+  client_rule_count++;
+}
+
+/*Function: Register a bulk transfer to a client - returns the flow or -1*/
+int egress_open(int sock) {
+  int weight = 1;
+  long rate_cap = 0;
+  struct sockaddr_in peer;
+  socklen_t len = sizeof(peer);
+  if (getpeername(sock, (struct sockaddr *)&peer, &len) == 0 &&
+      peer.sin_family == AF_INET) {
+    for (int i = 0; i < client_rule_count; i++) {
+      if (client_rules[i].addr.s_addr == peer.sin_addr.s_addr) {
+        weight = client_rules[i].weight;
+        rate_cap = client_rules[i].rate_cap;
+      }
+    }
+  }
+  if (egress_rate == 0 && rate_cap == 0) {
+    return -1; // Nothing to enforce
+  }
+  scheduler_lock();
+  int flow = -1;
+  for (int i = 0; i < MAX_FLOWS; i++) {
+    struct egress_flow *f = &scheduler->flows[i];
+    if (f->owner != 0 && kill(f->owner, 0) == -1 && errno == ESRCH) {
+      f->owner = 0; // Transfer of a process that died
+    }
+    if (flow < 0 && f->owner == 0) {
+      f->owner = getpid();
+      f->weight = weight;
+      f->rate_cap = rate_cap;
+      f->next_send = 0;
+      flow = i;
+    }
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+  return flow;
+}
+
+/*Function: Rate a flow may send at right now (bytes/s, 0 - unlimited)
+* Weighted max-min (water filling) over the active flows. Call locked.
+*/
+double flow_share(int flow) {
+  struct egress_flow *f = &scheduler->flows[flow];
+  if (egress_rate == 0) {
+    return f->rate_cap;
+  }
+  bool capped[MAX_FLOWS] = {false};
+  double remaining = egress_rate;
+  for (;;) {
+    long weights = 0;
+    for (int i = 0; i < MAX_FLOWS; i++) {
+      if (scheduler->flows[i].owner != 0 && !capped[i]) {
+        weights += scheduler->flows[i].weight;
+      }
+    }
+    bool changed = false;
+    for (int i = 0; i < MAX_FLOWS && weights > 0; i++) {
+      struct egress_flow *g = &scheduler->flows[i];
+      if (g->owner != 0 && !capped[i] && g->rate_cap > 0 &&
+          g->rate_cap < remaining * g->weight / weights) {
+        capped[i] = true; // Needs less than its share - frees the rest
+        remaining -= g->rate_cap;
+        changed = true;
+      }
+    }
+    if (!changed) {
+      if (capped[flow]) {
+        return f->rate_cap;
+      }
+      return weights > 0 ? remaining * f->weight / weights : remaining;
+    }
+  }
+}
+
+/*Function: Pace a flow - sleep until it may send the next chunk*/
+void egress_wait(int flow, size_t bytes) {
+  if (flow < 0) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+  scheduler_lock();
+  struct egress_flow *f = &scheduler->flows[flow];
+  double share = flow_share(flow);
+  f->share = (long)share;
+  long long start = f->next_send;
+  if (start < now_ns - EGRESS_BURST_NS) {
+    start = now_ns - EGRESS_BURST_NS; // Idle credit is bounded
+  }
+  if (share > 0) {
+    f->next_send = start + (long long)(bytes * 1e9 / share);
+  }
+  f->bytes_sent += bytes;
+  pthread_mutex_unlock(&scheduler->lock);
+
+  if (share > 0 && start > now_ns) {
+    struct timespec pause = {(start - now_ns) / 1000000000LL,
+                             (start - now_ns) % 1000000000LL};
+    nanosleep(&pause, NULL);
+  }
+}
+
+/*Function: Transfer finished - leave the share to the other flows*/
+void egress_close(int flow) {
+  if (flow < 0) {
+    return;
+  }
+  scheduler_lock();
+  scheduler->flows[flow].owner = 0;
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+*Command: w24stat - scheduler statistics of this node
+*/
+
+/*Function: Report slot usage, rejections and light command latency*/
+void w24stat(struct out_buffer *response) {
+  scheduler_lock();
+  int busy[2] = {0, 0};
+  for (int c = 0; c < 2; c++) {
+    for (int i = 0; i < scheduler->classes[c].limit; i++) {
+      busy[c] += scheduler->classes[c].owner[i] != 0;
+    }
+  }
+  struct class_state *light = &scheduler->classes[CLASS_LIGHT];
+  struct class_state *heavy = &scheduler->classes[CLASS_HEAVY];
+  out_printf(response,
+          "Light: %d/%d running, %d waiting, %ld admitted, %ld rejected\n"
+          "Heavy: %d/%d running, %d waiting, %ld admitted, %ld rejected\n"
+          "Light latency: p50 <= %ldus, p99 <= %ldus, SLO %dms missed %ld times\n",
+          busy[CLASS_LIGHT], light->limit, light->waiting, light->admitted,
+          light->rejected, busy[CLASS_HEAVY], heavy->limit, heavy->waiting,
+          heavy->admitted, heavy->rejected, light_latency_percentile(0.50),
+          light_latency_percentile(0.99), light_slo_ms,
+          scheduler->light_slo_misses);
+  for (int i = 0; i < MAX_FLOWS; i++) {
+    struct egress_flow *f = &scheduler->flows[i];
+    if (f->owner != 0 && response->len < REPLY_LEN - 64) { // Client reads REPLY_LEN
+      out_printf(response,
+              "Transfer %d: weight %d, cap %ld B/s, share %ld B/s, %ld bytes sent\n",
+              (int)f->owner, f->weight, f->rate_cap, f->share, f->bytes_sent);
+    }
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+*Suffix matching - w24ft extension sets of any size
+*
+* Every suffix (".ext") is stored right aligned and zero padded in a 16-byte
+* block, so the last 16 bytes of a name are checked against a suffix with a
+* single vector compare - AVX2 checks two suffixes per compare. The matcher
+* is picked at runtime from what the CPU supports and the size of the set,
+* with a scalar one for everything else.
+*/
+
+/*Structure: Set of file name suffixes, packed for vector compares*/
+struct suffix_set {
+  int count;
+  size_t cap;
+  uint8_t (*blocks)[SUFFIX_BLOCK]; // Padded to an even count for AVX2
+  uint32_t *masks;                 // Per block: bytes that must be equal
+  uint8_t *lengths;
+  bool (*match)(const struct suffix_set *set, const char *name, size_t len);
+};
+
+int suffix_vector_bytes = -1; // Widest usable vector, 0 for none, -1 unknown
+
+/*Function: Last 16 bytes of a name, right aligned and zero padded*/
+static inline void name_tail(const char *name, size_t len,
+                             uint8_t tail[SUFFIX_BLOCK]) {
+  if (len >= SUFFIX_BLOCK) {
+    memcpy(tail, name + len - SUFFIX_BLOCK, SUFFIX_BLOCK);
+  } else {
+    memset(tail, 0, SUFFIX_BLOCK - len);
+    memcpy(tail + SUFFIX_BLOCK - len, name, len);
+  }
+}
+
+/*Function: Suffix match - one memcmp per suffix*/
+bool suffix_match_scalar(const struct suffix_set *set, const char *name,
+                         size_t len) {
+  for (int i = 0; i < set->count; i++) {
+    size_t n = set->lengths[i];
+    if (n <= len &&
+        memcmp(name + len - n, set->blocks[i] + SUFFIX_BLOCK - n, n) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*Function: Suffix match - one 16-byte compare per suffix*/
+__attribute__((target("sse2")))
+bool suffix_match_sse2(const struct suffix_set *set, const char *name,
+                       size_t len) {
+  uint8_t tail[SUFFIX_BLOCK];
+  name_tail(name, len, tail);
+  __m128i t = _mm_loadu_si128((const __m128i *)tail);
+  for (int i = 0; i < set->count; i++) {
+    __m128i block = _mm_loadu_si128((const __m128i *)set->blocks[i]);
+    uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(t, block));
+    if ((equal & set->masks[i]) == set->masks[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*Function: Suffix match - one 32-byte compare per two suffixes*/
+__attribute__((target("avx2")))
+bool suffix_match_avx2(const struct suffix_set *set, const char *name,
+                       size_t len) {
+  uint8_t tail[SUFFIX_BLOCK];
+  name_tail(name, len, tail);
+  __m256i t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tail));
+  for (int i = 0; i < set->count; i += 2) {
+    __m256i blocks = _mm256_loadu_si256((const __m256i *)set->blocks[i]);
+    uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(t, blocks));
+    if ((equal & set->masks[i]) == set->masks[i] ||
+        ((equal >> 16) & set->masks[i + 1]) == set->masks[i + 1]) {
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+/*Function: Pick the fastest suffix matcher for a set on this CPU*/
+void select_suffix_matcher(struct suffix_set *set) {
+  if (suffix_vector_bytes < 0) {
+    suffix_vector_bytes = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      suffix_vector_bytes = 32;
+    } else if (__builtin_cpu_supports("sse2")) {
+      suffix_vector_bytes = 16;
+    }
+#endif
+  }
+  set->match = suffix_match_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (suffix_vector_bytes == 32 && set->count >= 8) {
+    set->match = suffix_match_avx2; // Small sets lose more to padding than they gain
+  } else if (suffix_vector_bytes >= 16) {
+    set->match = suffix_match_sse2;
+  }
+#endif
+}
+
+/*Function: Add an extension (no dot) to a set - false if empty or too long*/
+bool suffix_set_add(struct suffix_set *set, const char *extension) {
+  size_t n = strlen(extension) + 1; // With the dot
+  if (n < 2 || n > SUFFIX_BLOCK) {
+    return false;
+  }
+  size_t cap = set->cap;
+  set->blocks = grow_array(set->blocks, &cap, set->count + 2, SUFFIX_BLOCK);
+  set->masks = grow_array(set->masks, &set->cap, set->count + 2, sizeof(uint32_t));
+  set->lengths = realloc(set->lengths, set->cap);
+  if (set->lengths == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  int i = set->count++;
+  memset(set->blocks[i], 0, SUFFIX_BLOCK);
+  set->blocks[i][SUFFIX_BLOCK - n] = '.';
+  memcpy(set->blocks[i] + SUFFIX_BLOCK - n + 1, extension, n - 1);
+  set->masks[i] = ((1u << n) - 1) << (SUFFIX_BLOCK - n);
+  set->lengths[i] = (uint8_t)n;
+  // Padding block - wants a NUL as last byte, which no name ends with
+  memset(set->blocks[i + 1], 0, SUFFIX_BLOCK);
+  set->masks[i + 1] = 1u << (SUFFIX_BLOCK - 1);
+  set->lengths[i + 1] = 0;
+  select_suffix_matcher(set);
+  return true;
+}
+
+/*Function: Free a suffix set*/
+void suffix_set_free(struct suffix_set *set) {
+  free(set->blocks);
+  free(set->masks);
+  free(set->lengths);
+  memset(set, 0, sizeof(*set));
+}
+
+/*
+*Archive engine - staged pipeline shared by w24fz, w24ft, w24fdb and w24fda
+*
+* walker -> filter -> reader -> archiver (tar + gzip) -> sender
+*
+* Stages are connected by bounded lock-free queues so they all run at once -
+* end to end time follows the slowest stage instead of the sum of all stages.
+*/
+
+/*Structure: Predicates a file must satisfy to become an archive member*/
+struct archive_query {
+  long min_size;    // Exclusive lower size bound, -1 when unused
+  long max_size;    // Exclusive upper size bound, -1 when unused
+  struct suffix_set extensions; // Accepted name suffixes, none when unused
+  char before[11];  // YYYY-MM-DD - birth date on/before, empty when unused
+  char after[11];   // YYYY-MM-DD - birth date on/after, empty when unused
+  int shard_count;  // Subtree shards ~ is split into, 0 for all of ~
+  uint64_t shards;  // ... and the ones to archive, one bit each
+  bool partial;     // Shard asked for by another node - members only
+  dev_t skip_dev;   // That node's archive file - never archived
+  ino_t skip_ino;
+};
+
+/*Structure: One file travelling through the pipeline*/
+struct pipeline_item {
+  char *path;
+  struct stat st;
+  unsigned long long physical; // First physical extent in bytes, 0 if unknown
+  int fd;                      // Opened by the reader stage
+  char *chunk;                 // First chunk read ahead by the reader stage
+  size_t chunk_len;
+};
+
+/*Structure: Slot of a bounded MPMC queue (sequence numbers - Vyukov)*/
+struct queue_cell {
+  atomic_size_t sequence;
+  void *data;
+};
+
+/*Structure: Bounded lock-free queue between two stages plus depth metrics*/
+struct stage_queue {
+  const char *name;
+  struct queue_cell *cells;
+  size_t mask;
+  atomic_size_t enqueue_pos;
+  atomic_size_t dequeue_pos;
+  atomic_int producers;       // Producer threads still running - 0 closes it
+  atomic_size_t pushes;       // Items that went through the queue
+  atomic_size_t depth_sum;    // Sum of depths seen at push - for the average
+  atomic_size_t max_depth;    // High water mark
+  atomic_size_t full_waits;   // Producer stalls (downstream too slow)
+  atomic_size_t empty_waits;  // Consumer stalls (upstream too slow)
+};
+
+/*Structure: Thread counts and queue sizes of the stages*/
+struct pipeline_config {
+  int filter_threads;
+  int reader_threads;
+  int queue_depth; // Rounded up to a power of two
+};
+
+struct pipeline_config pipeline_cfg = {2, 2, 1024}; // Changed via -f/-r/-q
+
+int shard_ports[MAX_SHARD_NODES]; // Nodes sharing the archive work, in shard order
+int shard_nodes = 0;              // Changed via -g, 0 - this node archives all of ~
+int node_port;                    // This node's port - its place in shard_ports
+
+/*Structure: Cancellation flag and progress counters of an archive run*/
+struct archive_control {
+  atomic_int cancelled;
+  atomic_long files_done; // Members archived
+  atomic_long bytes_done; // Member bytes archived
+};
+
+/*Structure: State of one archive run*/
+struct archive_pipeline {
+  const struct archive_query *query;
+  const struct query_plan *plan; // How the walker stage finds candidates
+  const char *root;
+  int sink_fd;  // Socket or archive file
+  int framed;   // Socket sink - send as length prefixed chunks
+  dev_t skip_dev; // Archive file being written - never archive it
+  ino_t skip_ino;
+  struct stage_queue walked;  // walker -> filter
+  struct stage_queue matched; // filter -> reader
+  struct stage_queue loaded;  // reader -> archiver
+  int gzip_in;  // archiver writes tar stream here
+  int gzip_out; // sender reads the compressed stream here
+  pid_t gzip_pid;
+  int peers[MAX_SHARD_NODES]; // Member streams of the other shards, sent first
+  int peer_count;
+  struct archive_control *ctl; // Cancellation and progress - owned by caller
+};
+
+/*Function: Allocate the ring of a stage queue*/
+void queue_init(struct stage_queue *q, const char *name, int capacity,
+                int producers) {
+  size_t size = 2;
+  while (size < (size_t)capacity) {
+    size <<= 1;
+  }
+  memset(q, 0, sizeof(*q));
+  q->name = name;
+  q->cells = calloc(size, sizeof(struct queue_cell));
+  if (q->cells == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&q->cells[i].sequence, i);
+  }
+  q->mask = size - 1;
+  atomic_init(&q->producers, producers);
+}
+
+/*Function: Non blocking push - returns 0 when the queue is full*/
+int queue_try_push(struct stage_queue *q, void *data) {
+  size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+  for (;;) {
+    struct queue_cell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->data = data;
+        atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0; // Full
+    } else {
+      pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+/*Function: Non blocking pop - returns NULL when the queue is empty*/
+void *queue_try_pop(struct stage_queue *q) {
+  size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+  for (;;) {
+    struct queue_cell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        void *data = cell->data;
+        atomic_store_explicit(&cell->sequence, pos + q->mask + 1,
+                              memory_order_release);
+        return data;
+      }
+    } else if (diff < 0) {
+      return NULL; // Empty
+    } else {
+      pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+/*Function: Back off while a queue is full/empty - spin briefly, then sleep*/
+void stage_backoff(int *spins) {
+  if ((*spins)++ < 64) {
+    sched_yield();
+  } else {
+    struct timespec pause = {0, 50000}; // 50us
+    nanosleep(&pause, NULL);
+  }
+}
+
+/*Function: Blocking push - returns 0 if the pipeline got cancelled*/
+int queue_push(struct archive_pipeline *p, struct stage_queue *q, void *data) {
+  int spins = 0;
+  while (!queue_try_push(q, data)) {
+    if (atomic_load(&p->ctl->cancelled)) {
+      return 0;
+    }
+    if (spins == 0) {
+      atomic_fetch_add(&q->full_waits, 1);
+    }
+    stage_backoff(&spins);
+  }
+  // Depth metrics
+  size_t depth = atomic_load(&q->enqueue_pos) - atomic_load(&q->dequeue_pos);
+  size_t max = atomic_load(&q->max_depth);
+  while (depth > max &&
+         !atomic_compare_exchange_weak(&q->max_depth, &max, depth)) {
+  }
+  atomic_fetch_add(&q->depth_sum, depth);
+  atomic_fetch_add(&q->pushes, 1);
+  return 1;
+}
+
+/*Function: Blocking pop - returns NULL once producers are done (or cancelled)*/
+void *queue_pop(struct archive_pipeline *p, struct stage_queue *q) {
+  int spins = 0;
+  for (;;) {
+    void *data = queue_try_pop(q);
+    if (data != NULL) {
+      return data;
+    }
+    if (atomic_load(&p->ctl->cancelled)) {
+      return NULL;
+    }
+    if (atomic_load(&q->producers) == 0) {
+      return queue_try_pop(q); // Last look - a producer may have just pushed
+    }
+    if (spins == 0) {
+      atomic_fetch_add(&q->empty_waits, 1);
+    }
+    stage_backoff(&spins);
+  }
+}
+
+/*Function: Producer thread is done with a queue*/
+void queue_producer_done(struct stage_queue *q) {
+  atomic_fetch_sub(&q->producers, 1);
+}
+
+/*Function: Print queue depth metrics of a stage to the server log*/
+void queue_report(struct stage_queue *q) {
+  size_t pushes = atomic_load(&q->pushes);
+  printf("  %-8s items %zu, max depth %zu, avg depth %.1f, "
+         "producer stalls %zu, consumer stalls %zu\n",
+         q->name, pushes, atomic_load(&q->max_depth),
+         pushes ? (double)atomic_load(&q->depth_sum) / pushes : 0.0,
+         atomic_load(&q->full_waits), atomic_load(&q->empty_waits));
+}
+
+/*Function: Release a pipeline item*/
+void free_item(struct pipeline_item *item) {
+  if (item->fd >= 0) {
+    close(item->fd);
+  }
+  free(item->chunk);
+  free(item->path);
+  free(item);
+}
+
+/*Function: Free whatever is left in a queue (cancelled runs)*/
+void queue_destroy(struct stage_queue *q) {
+  struct pipeline_item *item;
+  while ((item = queue_try_pop(q)) != NULL) {
+    free_item(item);
+  }
+  free(q->cells);
+}
+
+/*Function: Fetch the physical offset of the first extent of a file (FIEMAP)*/
+unsigned long long first_physical_extent(int fd) {
+  // Room for the request header plus a single extent
+  char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+  struct fiemap *fm = (struct fiemap *)request;
+  memset(request, 0, sizeof(request));
+  fm->fm_start = 0;
+  fm->fm_length = ~0ULL;
+  fm->fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents > 0) {
+    return fm->fm_extents[0].fe_physical;
+  }
+  return 0;
+}
+
+/*Function: Comparison for Qsort - inode order*/
+int compareInodes(const void *a, const void *b) {
+  const struct pipeline_item *x = *(struct pipeline_item *const *)a;
+  const struct pipeline_item *y = *(struct pipeline_item *const *)b;
+  return (x->st.st_ino > y->st.st_ino) - (x->st.st_ino < y->st.st_ino);
+}
+
+/*Function: Comparison for Qsort - physical extent order, inode on ties*/
+int compareExtents(const void *a, const void *b) {
+  const struct pipeline_item *x = *(struct pipeline_item *const *)a;
+  const struct pipeline_item *y = *(struct pipeline_item *const *)b;
+  if (x->physical != y->physical) {
+    return (x->physical > y->physical) ? 1 : -1;
+  }
+  return compareInodes(a, b);
+}
+
+/*Function: Birth date of a file as YYYY-MM-DD - false if the fs has no btime*/
+bool birth_date(const char *path, char *date) {
+  struct statx stx;
+  if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_BTIME, &stx) != 0 ||
+      !(stx.stx_mask & STATX_BTIME) || stx.stx_btime.tv_sec == 0) {
+    return false;
+  }
+  time_t btime = stx.stx_btime.tv_sec;
+  struct tm tm_buf;
+  strftime(date, 11, "%Y-%m-%d", localtime_r(&btime, &tm_buf));
+  return true;
+}
+
+/*Function: Evaluate the query predicates for one file*/
+bool query_matches(const struct archive_query *query,
+                   const struct pipeline_item *item) {
+  long size = (long)item->st.st_size;
+  if (query->min_size >= 0 && size <= query->min_size) {
+    return false;
+  }
+  if (query->max_size >= 0 && size >= query->max_size) {
+    return false;
+  }
+  if (query->extensions.count > 0) {
+    const char *name = get_filename(item->path);
+    if (!query->extensions.match(&query->extensions, name, strlen(name))) {
+      return false;
+    }
+  }
+  if (query->before[0] != '\0' || query->after[0] != '\0') {
+    char date[11];
+    if (!birth_date(item->path, date)) {
+      return false; // No valid birth time
+    }
+    if (query->before[0] != '\0' && strcmp(date, query->before) > 0) {
+      return false;
+    }
+    if (query->after[0] != '\0' && strcmp(date, query->after) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+*Query planner - how archive commands and w24q find their candidate files
+*
+* With a current catalog the predicates are first evaluated on the file
+* metadata columns. A column scan runs them over every row as a vector
+* filter kernel into a selection bitmap; the extension chains (exact counts)
+* and the birth time ordered file list (estimated from its histogram) check
+* only their own rows. The planner picks whichever touches the least, a
+* kernel row costing 1/COLUMN_SCAN_SPEEDUP of an index candidate. Rows that
+* pass are lstat()ed and query_matches() has the last word, so sizes are
+* only filtered on while the size column has every write. Without a
+* current catalog ~ is walked.
+*/
+
+/*Structure: Query predicates in column form - bounds are inclusive*/
+struct column_filter {
+  uint64_t min_size;
+  uint64_t max_size;
+  int64_t min_btime;         // INT64_MIN + 1 when unused - free rows never pass
+  int64_t max_btime;
+  const uint64_t *ext_bits;  // Accepted extension ids, NULL when unused
+};
+
+/*Function: Filter kernel - set the selection bit of each row in [0, count) that passes*/
+typedef void (*column_kernel)(const struct column_filter *filter,
+                              const struct file_columns *col, uint32_t count,
+                              uint64_t *selection);
+
+/*Structure: Chosen access path of a query*/
+struct query_plan {
+  int access;          // PLAN_*
+  long candidates;     // Rows the access path checks
+  long estimate;       // Matches expected
+  long total;          // Files in the catalog
+  int64_t from, to;    // Birth time range [from, to)
+  uint16_t *exts;      // Extension ids to visit (PLAN_EXT)
+  int ext_count;
+  uint64_t *ext_bits;  // Bitmap of the extension ids
+  struct column_filter filter;
+  int shard_count;     // As in the query
+  uint64_t shards;
+};
+
+const char *plan_names[] = {"walk of ~", "column scan", "extension index",
+                            "birth time index"};
+
+/*Function: Visitor of candidate files - false stops the enumeration*/
+typedef bool (*candidate_visitor)(const char *path, const struct stat *sb,
+                                  void *arg);
+
+// Walk visitor - nftw() has no user argument
+static __thread candidate_visitor walk_visit;
+static __thread void *walk_visit_arg;
+static __thread const struct query_plan *walk_plan;
+
+/*Function: Subtree shard of a top level entry of ~*/
+int shard_of(const char *name, int count) {
+  return (int)(name_hash(name) % (uint64_t)count);
+}
+
+/*Function: Whether a plan covers the top level entry of ~ a file is under*/
+bool plan_owns(const struct query_plan *plan, const char *top) {
+  return plan->shard_count == 0 ||
+         ((plan->shards >> shard_of(top, plan->shard_count)) & 1);
+}
+
+/*Function: Local midnight starting a YYYY-MM-DD date plus days, -1 if malformed*/
+int64_t date_start(const char *date, int days) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  char *end = strptime(date, "%Y-%m-%d", &tm);
+  if (end == NULL || *end != '\0') {
+    return -1;
+  }
+  tm.tm_mday += days;
+  tm.tm_isdst = -1;
+  return (int64_t)mktime(&tm);
+}
+
+/*Function: Share of [lo, hi] in the range [range_lo, range_hi]*/
+double range_overlap(double lo, double hi, double range_lo, double range_hi) {
+  double a = lo > range_lo ? lo : range_lo;
+  double b = hi < range_hi ? hi : range_hi;
+  return b < a ? 0 : (b - a + 1) / (range_hi - range_lo + 1);
+}
+
+/*Function: Estimated files within the query's (exclusive) size bounds*/
+long estimate_size(const struct archive_query *query) {
+  double lo = query->min_size >= 0 ? query->min_size + 1 : 0;
+  double hi = query->max_size >= 0 ? query->max_size - 1 : 1e19;
+  double files = catalog.size_classes[0] * range_overlap(lo, hi, 0, 0);
+  for (int c = 1; c < SIZE_CLASSES; c++) {
+    double class_lo = (double)(1ULL << (c - 1));
+    files += catalog.size_classes[c] * range_overlap(lo, hi, class_lo, 2 * class_lo - 1);
+  }
+  return (long)(files + 0.5);
+}
+
+/*Function: Estimated files born in [from, to)*/
+long estimate_btime(int64_t from, int64_t to) {
+  double files = 0;
+  for (int b = 0; b < BTIME_BUCKETS; b++) {
+    double lo = (double)b * BTIME_BUCKET_SECS;
+    double hi = (b == BTIME_BUCKETS - 1) ? 1e19 : lo + BTIME_BUCKET_SECS - 1;
+    files += catalog.btime_buckets[b] * range_overlap(from, to - 1.0, lo, hi);
+  }
+  return (long)(files + 0.5);
+}
+
+/*Function: Whether one row passes the column filter*/
+bool column_row_matches(const struct column_filter *filter,
+                        const struct file_columns *col, uint32_t row) {
+  uint16_t ext = col->ext[row];
+  return col->size[row] >= filter->min_size && col->size[row] <= filter->max_size &&
+         col->btime[row] >= filter->min_btime && col->btime[row] <= filter->max_btime &&
+         (filter->ext_bits == NULL || ((filter->ext_bits[ext >> 6] >> (ext & 63)) & 1));
+}
+
+/*Function: Size and birth time filter over rows [first, count) - first is a multiple of 64*/
+void column_filter_rows(const struct column_filter *filter,
+                        const struct file_columns *col, uint32_t first,
+                        uint32_t count, uint64_t *selection) {
+  for (uint32_t word = first / 64; word * 64 < count; word++) {
+    uint64_t bits = 0;
+    uint32_t rows = (count - word * 64 < 64) ? count - word * 64 : 64;
+    for (uint32_t i = 0; i < rows; i++) {
+      uint32_t row = word * 64 + i;
+      bits |= (uint64_t)((col->size[row] >= filter->min_size) &
+                         (col->size[row] <= filter->max_size) &
+                         (col->btime[row] >= filter->min_btime) &
+                         (col->btime[row] <= filter->max_btime))
+              << i;
+    }
+    selection[word] = bits;
+  }
+}
+
+/*Function: Scalar filter kernel*/
+void column_filter_scalar(const struct column_filter *filter,
+                          const struct file_columns *col, uint32_t count,
+                          uint64_t *selection) {
+  column_filter_rows(filter, col, 0, count, selection);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*Function: AVX2 filter kernel - 4 rows per compare, unsigned sizes compared
+* as signed after flipping their sign bit*/
+__attribute__((target("avx2"))) void
+column_filter_avx2(const struct column_filter *filter,
+                   const struct file_columns *col, uint32_t count,
+                   uint64_t *selection) {
+  const __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i size_lo = _mm256_set1_epi64x((int64_t)(filter->min_size ^ (1ULL << 63)));
+  const __m256i size_hi = _mm256_set1_epi64x((int64_t)(filter->max_size ^ (1ULL << 63)));
+  const __m256i time_lo = _mm256_set1_epi64x(filter->min_btime);
+  const __m256i time_hi = _mm256_set1_epi64x(filter->max_btime);
+  uint32_t words = count / 64;
+  for (uint32_t word = 0; word < words; word++) {
+    uint64_t bits = 0;
+    for (int lane = 0; lane < 64; lane += 4) {
+      uint32_t row = word * 64 + lane;
+      __m256i size = _mm256_xor_si256(
+          _mm256_loadu_si256((const __m256i *)(col->size + row)), flip);
+      __m256i btime = _mm256_loadu_si256((const __m256i *)(col->btime + row));
+      __m256i out = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpgt_epi64(size_lo, size),
+                          _mm256_cmpgt_epi64(size, size_hi)),
+          _mm256_or_si256(_mm256_cmpgt_epi64(time_lo, btime),
+                          _mm256_cmpgt_epi64(btime, time_hi)));
+      bits |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0xf) << lane;
+    }
+    selection[word] = bits;
+  }
+  column_filter_rows(filter, col, words * 64, count, selection);
+}
+#endif
+
+/*Function: Run the filter over every catalog row into a selection bitmap*/
+void column_filter(const struct column_filter *filter, uint64_t *selection) {
+  static column_kernel kernel;
+  if (kernel == NULL) {
+    kernel = column_filter_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      kernel = column_filter_avx2;
+    }
+#endif
+  }
+  const struct file_columns *col = &catalog.columns;
+  kernel(filter, col, catalog.file_count, selection);
+  if (filter->ext_bits == NULL) {
+    return;
+  }
+  // Extension ids are looked up only for the rows still selected
+  for (uint32_t word = 0; word * 64 < catalog.file_count; word++) {
+    for (uint64_t bits = selection[word]; bits != 0; bits &= bits - 1) {
+      int bit = __builtin_ctzll(bits);
+      uint16_t ext = col->ext[word * 64 + bit];
+      if (!((filter->ext_bits[ext >> 6] >> (ext & 63)) & 1)) {
+        selection[word] &= ~(1ULL << bit);
+      }
+    }
+  }
+}
+
+/*Function: Pick the access path touching the fewest rows*/
+void plan_query(const struct archive_query *query, struct query_plan *plan) {
+  memset(plan, 0, sizeof(*plan));
+  plan->access = PLAN_WALK;
+  plan->from = query->after[0] ? date_start(query->after, 0) : 1;
+  plan->to = query->before[0] ? date_start(query->before, 1) : INT64_MAX;
+  plan->shard_count = query->shard_count;
+  plan->shards = query->shards;
+  if (!catalog_files_current()) {
+    return; // Only a walk sees everything
+  }
+  bool dated = query->before[0] || query->after[0];
+  struct column_filter *filter = &plan->filter;
+  filter->max_size = UINT64_MAX;
+  filter->min_btime = dated ? plan->from : INT64_MIN + 1;
+  filter->max_btime = dated ? plan->to - 1 : INT64_MAX;
+  if (catalog_sizes_current()) {
+    if (query->min_size >= 0) {
+      filter->min_size = query->min_size + 1;
+    }
+    if (query->max_size == 0) {
+      filter->min_size = 1; // Nothing is smaller than 0 bytes
+      filter->max_size = 0;
+    } else if (query->max_size > 0) {
+      filter->max_size = query->max_size - 1;
+    }
+  }
+
+  pthread_rwlock_rdlock(&catalog.lock);
+  plan->access = PLAN_SCAN;
+  plan->total = plan->candidates = catalog.live_files;
+  double total = plan->total > 0 ? plan->total : 1;
+  double share = 1; // Of the files expected to match, predicates independent
+  double cost = plan->total / (double)COLUMN_SCAN_SPEEDUP;
+  if (query->min_size >= 0 || query->max_size >= 0) {
+    share *= estimate_size(query) / total;
+  }
+  if (dated) {
+    long files = estimate_btime(plan->from, plan->to);
+    share *= files / total;
+    if (files < cost) {
+      plan->access = PLAN_BTIME;
+      plan->candidates = files;
+      cost = files;
+    }
+  }
+  if (query->extensions.count > 0) {
+    // Index keys: the text after the last dot of each suffix - "gz" for tar.gz
+    plan->exts = malloc(query->extensions.count * sizeof(uint16_t));
+    plan->ext_bits = calloc(EXT_NONE / 64 + 1, sizeof(uint64_t));
+    if (plan->exts == NULL || plan->ext_bits == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    long files = 0;
+    for (int i = 0; i < query->extensions.count; i++) {
+      const struct suffix_set *set = &query->extensions;
+      char suffix[SUFFIX_BLOCK + 1];
+      int n = set->lengths[i];
+      memcpy(suffix, set->blocks[i] + SUFFIX_BLOCK - n, n);
+      suffix[n] = '\0';
+      uint16_t ext = catalog_ext_id(strrchr(suffix, '.') + 1, false);
+      if (ext == EXT_NONE || ((plan->ext_bits[ext >> 6] >> (ext & 63)) & 1)) {
+        continue; // No such files, or already counted
+      }
+      plan->ext_bits[ext >> 6] |= 1ULL << (ext & 63);
+      plan->exts[plan->ext_count++] = ext;
+      files += catalog.exts[ext].files;
+    }
+    filter->ext_bits = plan->ext_bits;
+    share *= files / total;
+    if (files <= cost) {
+      plan->access = PLAN_EXT; // Exact - wins ties with an estimate
+      plan->candidates = files;
+    }
+  }
+  plan->estimate = (long)(plan->total * share + 0.5);
+  pthread_rwlock_unlock(&catalog.lock);
+}
+
+/*Function: Free a plan*/
+void plan_free(struct query_plan *plan) {
+  free(plan->exts);
+  free(plan->ext_bits);
+  plan->exts = NULL;
+  plan->ext_bits = NULL;
+}
+
+/*Function: One line summary of a plan*/
+void describe_plan(const struct query_plan *plan, char *line, size_t len) {
+  if (plan->access == PLAN_WALK) {
+    snprintf(line, len, "Plan: %s (catalog not current)\n", plan_names[PLAN_WALK]);
+    return;
+  }
+  snprintf(line, len, "Plan: %s of %ld/%ld files, ~%ld matches\n",
+           plan_names[plan->access], plan->candidates, plan->total, plan->estimate);
+}
+
+/*Function: Hand a catalog file to a visitor if it could be archived - false to stop*/
+bool visit_catalog_file(const struct query_plan *plan, uint32_t f,
+                        candidate_visitor visit, void *arg) {
+  if (catalog.dirs[catalog.columns.dir[f]].hidden || file_name(f)[0] == '.') {
+    return true; // Hidden entries are never archived
+  }
+  if (plan->shard_count > 0) {
+    const char *top = file_name(f);
+    for (uint32_t d = catalog.columns.dir[f]; d != catalog.root_dir && d != NO_ID;
+         d = catalog.dirs[d].parent) {
+      top = dir_name(d);
+    }
+    if (!plan_owns(plan, top)) {
+      return true; // Another node's shard
+    }
+  }
+  char path[MAX_PATH_LEN];
+  entry_path(catalog.columns.dir[f], file_name(f), path, sizeof(path));
+  struct stat sb;
+  if (lstat(path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    return true;
+  }
+  return visit(path, &sb, arg);
+}
+
+/*Callback Function for NFTW: Plan walk - skip hidden entries, visit files*/
+int walk_processor(const char *fpath, const struct stat *sb, int typeflag,
+                   struct FTW *ftwbuf) {
+  if (ftwbuf->level > 0 && fpath[ftwbuf->base] == '.') {
+    return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+  }
+  if (ftwbuf->level == 1 && !plan_owns(walk_plan, fpath + ftwbuf->base)) {
+    return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE; // Another node's shard
+  }
+  if (typeflag != FTW_F || !S_ISREG(sb->st_mode)) {
+    return FTW_CONTINUE;
+  }
+  return walk_visit(fpath, sb, walk_visit_arg) ? FTW_CONTINUE : FTW_STOP;
+}
+
+/*Function: Hand every candidate of a plan to a visitor*/
+void plan_for_each(const struct query_plan *plan, const char *root,
+                   candidate_visitor visit, void *arg) {
+  if (plan->access == PLAN_WALK) {
+    walk_visit = visit;
+    walk_visit_arg = arg;
+    walk_plan = plan;
+    nftw(root, walk_processor, 20, FTW_PHYS | FTW_ACTIONRETVAL);
+    return;
+  }
+  pthread_rwlock_rdlock(&catalog.lock);
+  bool more = true;
+  if (plan->access == PLAN_EXT) {
+    for (int i = 0; i < plan->ext_count && more; i++) {
+      for (uint32_t f = catalog.exts[plan->exts[i]].first_file; f != NO_ID && more;
+           f = catalog.files[f].next_same_ext) {
+        if (column_row_matches(&plan->filter, &catalog.columns, f)) {
+          more = visit_catalog_file(plan, f, visit, arg);
+        }
+      }
+    }
+  } else if (plan->access == PLAN_BTIME) {
+    struct skiplist *sl = &catalog.files_by_time;
+    for (uint32_t f = skiplist_first_after(sl, compare_file_time_key, &plan->from);
+         f != NO_ID && catalog.columns.btime[f] < plan->to && more;
+         f = *skiplist_next(sl, f, 0)) {
+      if (column_row_matches(&plan->filter, &catalog.columns, f)) {
+        more = visit_catalog_file(plan, f, visit, arg);
+      }
+    }
+  } else {
+    uint32_t words = (catalog.file_count + 63) / 64;
+    uint64_t *selection = malloc((words + 1) * sizeof(uint64_t));
+    if (selection == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    column_filter(&plan->filter, selection);
+    for (uint32_t word = 0; word < words && more; word++) {
+      for (uint64_t bits = selection[word]; bits != 0 && more; bits &= bits - 1) {
+        more = visit_catalog_file(plan, word * 64 + __builtin_ctzll(bits), visit,
+                                  arg);
+      }
+    }
+    free(selection);
+  }
+  pthread_rwlock_unlock(&catalog.lock);
+}
+
+/*Function: Walker stage visitor - queue a candidate for the filter stage*/
+bool walker_visit(const char *path, const struct stat *sb, void *arg) {
+  struct archive_pipeline *p = arg;
+  if (atomic_load(&p->ctl->cancelled)) {
+    return false;
+  }
+  if (sb->st_dev == p->skip_dev && sb->st_ino == p->skip_ino) {
+    return true; // The archive being written
+  }
+  struct pipeline_item *item = calloc(1, sizeof(struct pipeline_item));
+  item->path = strdup(path);
+  item->st = *sb;
+  item->fd = -1;
+  if (!queue_push(p, &p->walked, item)) {
+    free_item(item);
+    return false;
+  }
+  return true;
+}
+
+/*Function: Walker stage thread*/
+void *walker_stage(void *arg) {
+  struct archive_pipeline *p = arg;
+  lower_stage_priority();
+  plan_for_each(p->plan, p->root, walker_visit, p);
+  queue_producer_done(&p->walked);
+  return NULL;
+}
+
+/*Function: Filter stage thread - evaluates the query predicates*/
+void *filter_stage(void *arg) {
+  struct archive_pipeline *p = arg;
+  lower_stage_priority();
+  struct pipeline_item *item;
+  while ((item = queue_pop(p, &p->walked)) != NULL) {
+    if (!query_matches(p->query, item) || !queue_push(p, &p->matched, item)) {
+      free_item(item);
+    }
+  }
+  queue_producer_done(&p->matched);
+  return NULL;
+}
+
+/*Function: Reader stage thread - opens members and reads their first chunk
+* Items are taken a window at a time and (unless -p) sorted by on-disk
+* placement, with readahead issued for the whole window up front.
+*/
+void *reader_stage(void *arg) {
+  struct archive_pipeline *p = arg;
+  lower_stage_priority();
+  struct pipeline_item *window[READAHEAD_WINDOW];
+  struct pipeline_item *item;
+  while ((item = queue_pop(p, &p->matched)) != NULL) { // NULL - upstream finished
+    int count = 0;
+    while (item != NULL) {
+      item->fd = open(item->path, O_RDONLY);
+      if (item->fd < 0) {
+        free_item(item); // Vanished, unreadable, or out of fds - skip it
+      } else {
+        posix_fadvise(item->fd, 0, 0, POSIX_FADV_WILLNEED);
+        if (archive_order == ORDER_EXTENT) {
+          item->physical = first_physical_extent(item->fd);
+        }
+        window[count++] = item;
+      }
+      item = (count < READAHEAD_WINDOW) ? queue_try_pop(&p->matched) : NULL;
+    }
+    if (count == 0) {
+      continue; // Every open of the batch failed - upstream may have more
+    }
+    if (archive_order == ORDER_INODE) {
+      qsort(window, count, sizeof(window[0]), compareInodes);
+    } else if (archive_order == ORDER_EXTENT) {
+      qsort(window, count, sizeof(window[0]), compareExtents);
+    }
+    for (int i = 0; i < count; i++) {
+      item = window[i];
+      size_t want = item->st.st_size < READ_CHUNK ? item->st.st_size
+                                                  : READ_CHUNK;
+      item->chunk = malloc(want ? want : 1);
+      ssize_t got = want ? pread(item->fd, item->chunk, want, 0) : 0;
+      item->chunk_len = got > 0 ? got : 0;
+      if (!queue_push(p, &p->loaded, item)) {
+        free_item(item);
+      }
+    }
+  }
+  queue_producer_done(&p->loaded);
+  return NULL;
+}
+
+/*Function: Fill a numeric tar header field - octal, base-256 if too large*/
+void tar_number(char *field, int width, unsigned long long value) {
+  if (value < (1ULL << (3 * (width - 1)))) {
+    snprintf(field, width, "%0*llo", width - 1, value);
+  } else {
+    // GNU base-256: high bit set, big endian value in the remaining bytes
+    memset(field, 0, width);
+    for (int i = width - 1; i > 0 && value; i--, value >>= 8) {
+      field[i] = (char)(value & 0xff);
+    }
+    field[0] = (char)0x80;
+  }
+}
+
+/*Function: Build a 512 byte ustar header*/
+void tar_header(char *block, const char *name, const struct stat *st,
+                char type, unsigned long long size) {
+  memset(block, 0, TAR_BLOCK);
+  strncpy(block, name, 100);
+  tar_number(block + 100, 8, st->st_mode & 07777);
+  tar_number(block + 108, 8, st->st_uid);
+  tar_number(block + 116, 8, st->st_gid);
+  tar_number(block + 124, 12, size);
+  tar_number(block + 136, 12, st->st_mtime);
+  block[156] = type;
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+  struct passwd *pw = getpwuid(st->st_uid);
+  if (pw != NULL) {
+    strncpy(block + 265, pw->pw_name, 31);
+  }
+  struct group *gr = getgrgid(st->st_gid);
+  if (gr != NULL) {
+    strncpy(block + 297, gr->gr_name, 31);
+  }
+  // Checksum is computed with the checksum field filled with spaces
+  memset(block + 148, ' ', 8);
+  unsigned int sum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++) {
+    sum += (unsigned char)block[i];
+  }
+  snprintf(block + 148, 8, "%06o", sum);
+}
+
+/*Function: Archiver stage - write one member (header, data, padding) to gzip*/
+int archive_member(struct archive_pipeline *p, struct pipeline_item *item) {
+  char block[TAR_BLOCK];
+  const char *name = item->path;
+  while (*name == '/') {
+    name++; // Member names are relative, like tar does
+  }
+  size_t name_len = strlen(name);
+  if (name_len > 100) {
+    // GNU long name entry carrying the full path
+    tar_header(block, "././@LongLink", &item->st, 'L', name_len + 1);
+    if (write_all(p->gzip_in, block, TAR_BLOCK) < 0 ||
+        write_all(p->gzip_in, name, name_len + 1) < 0) {
+      return -1;
+    }
+    size_t pad = (TAR_BLOCK - (name_len + 1) % TAR_BLOCK) % TAR_BLOCK;
+    memset(block, 0, TAR_BLOCK);
+    if (pad && write_all(p->gzip_in, block, pad) < 0) {
+      return -1;
+    }
+  }
+  unsigned long long size = item->st.st_size;
+  tar_header(block, name, &item->st, '0', size);
+  if (write_all(p->gzip_in, block, TAR_BLOCK) < 0 ||
+      write_all(p->gzip_in, item->chunk, item->chunk_len) < 0) {
+    return -1;
+  }
+  // Rest of the file - exactly st_size bytes, zero filled if it shrank
+  unsigned long long written = item->chunk_len;
+  char buffer[READ_CHUNK];
+  while (written < size) {
+    if (atomic_load(&p->ctl->cancelled)) {
+      return -1;
+    }
+    size_t want = (size - written) < sizeof(buffer) ? size - written
+                                                    : sizeof(buffer);
+    ssize_t got = pread(item->fd, buffer, want, written);
+    if (got <= 0) {
+      memset(buffer, 0, want);
+      got = want;
+    }
+    if (write_all(p->gzip_in, buffer, got) < 0) {
+      return -1;
+    }
+    written += got;
+  }
+  size_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+  memset(block, 0, TAR_BLOCK);
+  if (pad && write_all(p->gzip_in, block, pad) < 0) {
+    return -1;
+  }
+  atomic_fetch_add(&p->ctl->files_done, 1);
+  atomic_fetch_add(&p->ctl->bytes_done, (long)size);
+  return 0;
+}
+
+/*Function: Archiver stage thread - tar framing into the gzip compressor*/
+void *archiver_stage(void *arg) {
+  struct archive_pipeline *p = arg;
+  lower_stage_priority();
+  struct pipeline_item *item;
+  while ((item = queue_pop(p, &p->loaded)) != NULL) {
+    if (archive_member(p, item) < 0) {
+      atomic_store(&p->ctl->cancelled, 1);
+    }
+    free_item(item);
+  }
+  if (!atomic_load(&p->ctl->cancelled) && !p->query->partial) {
+    char end[2 * TAR_BLOCK] = {0}; // End of archive marker
+    write_all(p->gzip_in, end, sizeof(end));
+  }
+  close(p->gzip_in); // gzip sees EOF and flushes
+  return NULL;
 }
 
-/*Function: If w24 folder doesnot exist - create it*/
-void create_w24_directory() {
-    // Get the home directory path
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        perror("getenv");
-        exit(EXIT_FAILURE);
+/*Function: Copy the member stream of another node's shard to the sink*/
+int forward_shard(struct archive_pipeline *p, int peer, int flow) {
+  char buffer[READ_CHUNK];
+  for (;;) {
+    uint32_t frame;
+    if (read_all(peer, &frame, sizeof(frame)) < 0) {
+      return -1; // Truncated - the archive would be corrupt
     }
+    frame = ntohl(frame);
+    if (frame == 0) {
+      return 0;
+    }
+    while (frame > 0) {
+      uint32_t n = frame < sizeof(buffer) ? frame : sizeof(buffer);
+      if (read_all(peer, buffer, n) < 0) {
+        return -1;
+      }
+      egress_wait(flow, n);
+      uint32_t out = htonl(n);
+      if ((p->framed && write_header(p->sink_fd, &out, sizeof(out)) < 0) ||
+          write_all(p->sink_fd, buffer, n) < 0) {
+        return -1;
+      }
+      frame -= n;
+    }
+  }
+}
 
-    // Concatenate the home directory path with the w24 directory name
-    char w24_dir[1024];
-    snprintf(w24_dir, sizeof(w24_dir), "%s/w24", home_dir);
-
-    // Check if the w24 directory exists
-    struct stat st;
-    if (stat(w24_dir, &st) == -1) {
-        // If the directory doesn't exist, create it
-        if (mkdir(w24_dir, 0700) == -1) {
-            perror("mkdir");
-            exit(EXIT_FAILURE);
-        }
+/*Function: Move the compressed bytes gzip has ready to an AF_UNIX client as
+one frame without copying them through user space - returns the frame's size,
+0 at the end of the stream or -1 if the client is gone*/
+ssize_t splice_frame(struct archive_pipeline *p, int flow) {
+  struct pollfd pfd = {.fd = p->gzip_out, .events = POLLIN};
+  int ready = 0;
+  while (ready == 0) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      return 0;
+    }
+    if (ioctl(p->gzip_out, FIONREAD, &ready) < 0 ||
+        (ready == 0 && (pfd.revents & (POLLHUP | POLLERR)))) {
+      return 0; // gzip finished
+    }
+  }
+  if (ready > READ_CHUNK) {
+    ready = READ_CHUNK;
+  }
+  egress_wait(flow, ready); // Fair share of the uplink
+  uint32_t frame = htonl((uint32_t)ready);
+  if (write_header(p->sink_fd, &frame, sizeof(frame)) < 0) {
+    return -1;
+  }
+  for (ssize_t left = ready, n; left > 0; left -= n) {
+    n = splice(p->gzip_out, NULL, p->sink_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      return -1; // The frame is cut short - the client cannot resync
     }
+  }
+  return ready;
 }
 
-/*
-*Command: dirlist -a
+/*Function: Sender stage thread - compressed stream to the socket or file
+* With shards, each other node's stream comes first. Every stream is a whole
+* gzip member and gzip members may be concatenated, so the archive is
+* complete once this node's stream, carrying the end marker, follows.
 */
-
-/*Function: Returns list of folders(only) under ~ directory in the alphabetical order */
-void dirlistA(char *response) {
-  FILE *fp;
-  char path[MAX_DIR_NAME_LEN];
-  char *directories[MAX_DIRS];
-  int count = 0;
-  // Open the pipe to run the find command - fetch only folders belonging to user and not hidden files
-  fp = popen("find ~/ -type d -not "
-             "-path '*/.*' -user \"$(whoami)\"",
-             "r");
-  if (fp == NULL) {
-    perror("popen");
-    exit(EXIT_FAILURE);
+void *sender_stage(void *arg) {
+  struct archive_pipeline *p = arg;
+  lower_stage_priority();
+  char buffer[READ_CHUNK];
+  ssize_t n;
+  int flow = p->framed ? egress_open(p->sink_fd) : -1;
+  bool spliced = p->framed && local_socket(p->sink_fd);
+  for (int i = 0; i < p->peer_count && !atomic_load(&p->ctl->cancelled); i++) {
+    if (forward_shard(p, p->peers[i], flow) < 0) {
+      printf("Shard stream %d failed - aborting archive\n", i);
+      atomic_store(&p->ctl->cancelled, 1);
+    }
   }
-  // Read directory names from the pipe and store them in an array
-  while (fgets(path, sizeof(path), fp) != NULL && count < MAX_DIRS) {
-    // Remove newline character from directory name
-    path[strcspn(path, "\n")] = '\0';
-    // Extract only the directory name from the path
-    char *directory_name = strrchr(path, '/');
-    if (directory_name != NULL) {
-      directory_name++; // Move past the '/'
-      // Store the directory name if it's not empty
-      if (*directory_name != '\0') {
-        directories[count] = strdup(directory_name);
-        count++;
-      }
-    }
-  }
-  // Close the pipe
-  pclose(fp);
-  // Sort the directory names alphabetically
-  qsort(directories, count, sizeof(char *), compareStrings);
-  // Prepare the response string
-  sprintf(response, "Sorted list of sub-directories:\n");
-  for (int i = 0; i < count; i++) {
-    strcat(response, directories[i]);
-    strcat(response, "\n");
-    free(directories[i]); // Free the allocated memory
+  while (spliced && !atomic_load(&p->ctl->cancelled) &&
+         (n = splice_frame(p, flow)) != 0) {
+    if (n < 0) {
+      atomic_store(&p->ctl->cancelled, 1); // Peer is gone - stop all stages
+    }
+  }
+  while (!spliced && !atomic_load(&p->ctl->cancelled) &&
+         (n = read(p->gzip_out, buffer, sizeof(buffer))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    egress_wait(flow, n); // Fair share of the uplink
+    if (p->framed) {
+      uint32_t frame = htonl((uint32_t)n);
+      if (write_header(p->sink_fd, &frame, sizeof(frame)) < 0) {
+        atomic_store(&p->ctl->cancelled, 1); // Peer is gone - stop all stages
+        break;
+      }
+    }
+    if (write_all(p->sink_fd, buffer, n) < 0) {
+      atomic_store(&p->ctl->cancelled, 1);
+      break;
+    }
   }
+  egress_close(flow);
+  if (atomic_load(&p->ctl->cancelled)) {
+    kill(p->gzip_pid, SIGTERM);
+  } else if (p->framed) {
+    uint32_t frame = 0; // End of stream - uncorking sends it without waiting for ACKs
+    transport_cork(p->sink_fd, 1);
+    write_all(p->sink_fd, &frame, sizeof(frame));
+    transport_cork(p->sink_fd, 0);
+  }
+  close(p->gzip_out);
+  return NULL;
 }
 
-/*
-*Command: dirlist -t
-*/
+/*Function: Check (without blocking) whether the client hung up*/
+bool peer_hung_up(int sock) {
+  struct pollfd pfd = {.fd = sock, .events = POLLRDHUP};
+  return poll(&pfd, 1, 0) > 0 &&
+         (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
 
-/* Function: Returns list folders(only) in the order of creation time -- oldest first (Wait -Die :)) */
-void dirlistT(char *response) {
-  FILE *fp;
-  char path[MAX_DIR_NAME_LEN];
-  char *directories[MAX_DIRS];
-  int count = 0;
-  // Run the find command - fetch folders belonging to user and not hidden files - sort based on bdate
-  fp = popen("find ~/ -type d -not "
-             "-path '*/.*' -user \"$(whoami)\" -exec stat "
-             "--format '%W %n' {} + | sort -n | cut -d ' ' -f 2-",
-             "r");
-  if (fp == NULL) {
-    perror("popen");
-    exit(EXIT_FAILURE);
+/*Function: Start the gzip compressor with pipes on both ends*/
+int start_compressor(struct archive_pipeline *p) {
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) < 0) {
+    return -1;
   }
-  // Read directory paths from the pipe and extract directory names
-  while (fgets(path, sizeof(path), fp) != NULL && count < MAX_DIRS) {
-    // Remove newline character from directory path
-    path[strcspn(path, "\n")] = '\0';
-    // Extract only the directory name from the path
-    char *directory_name = strrchr(path, '/');
-    if (directory_name != NULL) {
-      directory_name++; // Move past the '/'
-      // Store the directory name if it's not empty
-      if (*directory_name != '\0') {
-        directories[count] = strdup(directory_name);
-        count++;
-      }
-    }
-  }
-  // Close the pipe
-  pclose(fp);
-  // Prepare the response string
-  sprintf(response,
-          "List of Sub-directories in the order of creation time:\n");
-  for (int i = 0; i < count; i++) {
-    strcat(response, directories[i]);
-    strcat(response, "\n");
-    free(directories[i]); // Free allocated memory
+  if (pipe2(out, O_CLOEXEC) < 0) {
+    close(in[0]);
+    close(in[1]);
+    return -1;
   }
+  p->gzip_pid = fork();
+  if (p->gzip_pid < 0) {
+    return -1;
+  }
+  if (p->gzip_pid == 0) {
+    lower_stage_priority();
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    execlp("gzip", "gzip", "-c", (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  p->gzip_in = in[1];
+  p->gzip_out = out[0];
+  return 0;
 }
 
-/*
-*Command: w24fn
-*/
+/*Function: A query as w24q predicates (with a leading space each)*/
+void format_query_predicates(const struct archive_query *query, char *out,
+                             size_t len) {
+  size_t used = 0;
+  out[0] = '\0';
+  if (query->max_size == 0) {
+    used += snprintf(out + used, len - used, " size:1..0"); // Nothing
+  } else if (query->min_size >= 0 || query->max_size > 0) {
+    used += snprintf(out + used, len - used, " size:");
+    if (query->min_size >= 0 && used < len) {
+      used += snprintf(out + used, len - used, "%ld", query->min_size + 1);
+    }
+    if (used < len) {
+      used += snprintf(out + used, len - used, "..");
+    }
+    if (query->max_size > 0 && used < len) {
+      used += snprintf(out + used, len - used, "%ld", query->max_size - 1);
+    }
+  }
+  const struct suffix_set *set = &query->extensions;
+  for (int i = 0; i < set->count && used < len; i++) {
+    int n = set->lengths[i];
+    used += snprintf(out + used, len - used, "%s%.*s", i == 0 ? " ext:" : ",",
+                     n - 1, (const char *)set->blocks[i] + SUFFIX_BLOCK - n + 1);
+  }
+  if (query->before[0] && used < len) {
+    used += snprintf(out + used, len - used, " before:%s", query->before);
+  }
+  if (query->after[0] && used < len) {
+    snprintf(out + used, len - used, " after:%s", query->after);
+  }
+}
 
-/*Function: Retrieve file permissions without use of external libs - for w24fn (filename)*/
-void extract_permissions(mode_t mode, char *permissions) {
-  permissions[0] = (S_ISDIR(mode)) ? 'd' : '-';
-  permissions[1] = (mode & S_IRUSR) ? 'r' : '-';
-  permissions[2] = (mode & S_IWUSR) ? 'w' : '-';
-  permissions[3] = (mode & S_IXUSR) ? 'x' : '-';
-  permissions[4] = (mode & S_IRGRP) ? 'r' : '-';
-  permissions[5] = (mode & S_IWGRP) ? 'w' : '-';
-  permissions[6] = (mode & S_IXGRP) ? 'x' : '-';
-  permissions[7] = (mode & S_IROTH) ? 'r' : '-';
-  permissions[8] = (mode & S_IWOTH) ? 'w' : '-';
-  permissions[9] = (mode & S_IXOTH) ? 'x' : '-';
-  permissions[10] = '\0'; // end/null term
+/*Function: Connect to another node of this host, -1 if it is down*/
+int shard_connect(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
 }
 
-/*Function: Fetches filename*/
-char *get_filename(const char *path) {
-  const char *last_slash = strrchr(path, '/');
-  if (last_slash) {
-    return (char *)(last_slash +
-                    1); // Return the substring after the last slash
+/*Function: Ask the other nodes for their shards of a query
+* Requests go out to all of them before any reply is awaited, so they walk
+* and compress at the same time. The query is left with the shards of this
+* node and of any node that is down or too busy to answer.
+*/
+void shard_fan_out(struct archive_pipeline *p, struct archive_query *query) {
+  char predicates[MAX_COMMAND_LEN - 64];
+  format_query_predicates(query, predicates, sizeof(predicates));
+  query->shard_count = shard_nodes;
+  query->shards = 0;
+  int asked[MAX_SHARD_NODES];
+  for (int i = 0; i < shard_nodes; i++) {
+    asked[i] = shard_ports[i] != node_port ? shard_connect(shard_ports[i]) : -1;
+    char request[MAX_COMMAND_LEN];
+    snprintf(request, sizeof(request), "w24shard %d/%d %llu:%llu%s", i, shard_nodes,
+             (unsigned long long)p->skip_dev, (unsigned long long)p->skip_ino,
+             predicates);
+    if (asked[i] >= 0 && write_all(asked[i], request, strlen(request)) < 0) {
+      close(asked[i]);
+      asked[i] = -1;
+    }
+  }
+  for (int i = 0; i < shard_nodes; i++) {
+    long size_header = 0;
+    if (asked[i] >= 0) {
+      // A busy node answers within its admission wait
+      struct timeval wait = {heavy_wait_ms / 1000 + 1, 0};
+      setsockopt(asked[i], SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+      if (read_all(asked[i], &size_header, sizeof(long)) < 0) {
+        size_header = 0;
+      }
+      wait.tv_sec = 0; // Matches can be far apart - no timeout on the stream
+      setsockopt(asked[i], SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    }
+    if (size_header == -1) {
+      p->peers[p->peer_count++] = asked[i];
+      continue;
+    }
+    if (asked[i] >= 0) {
+      close(asked[i]);
+    }
+    query->shards |= 1ULL << i;
   }
-  return (char *)path; // If no slash was found, path is the filename
 }
 
-/* Callback Function for NFTW: Parsing directory structure -physical walks */
-int file_processor(const char *fpath, const struct stat *sb, int typeflag,
-                   struct FTW *ftwbuf) {
-  if (typeflag == FTW_F) {
-    char *target_filename = inputFileName; // Target file to search for
-    if (strcmp(target_filename, fpath + ftwbuf->base) == 0) {
-      // File found, extract details
-      char permissions[11];
-      extract_permissions(sb->st_mode, permissions);
+/*Function: Run the archive pipeline for a query
+* sink_fd - archive file, or client socket when framed is set (the stream is
+* then sent as a -1 size header followed by length prefixed chunks, as the
+* archive size is not known up front).
+* watch_fd - client socket to watch for disconnects (-1 for none).
+* ctl - cancellation/progress shared with the caller, NULL if not needed.
+* Returns 0 on success, -1 if a stage failed, the run was cancelled or the
+* peer went away.
+*/
+int run_archive_pipeline(const struct archive_query *query, int sink_fd,
+                         int framed, int watch_fd,
+                         struct archive_control *ctl) {
+  struct archive_control local_ctl;
+  if (ctl == NULL) {
+    memset(&local_ctl, 0, sizeof(local_ctl));
+    ctl = &local_ctl;
+  }
+  struct archive_pipeline p;
+  memset(&p, 0, sizeof(p));
+  p.ctl = ctl;
+  p.root = getenv("HOME");
+  p.sink_fd = sink_fd;
+  p.framed = framed;
+  struct stat sink_st;
+  if (query->partial) {
+    p.skip_dev = query->skip_dev;
+    p.skip_ino = query->skip_ino;
+  } else if (!framed && fstat(sink_fd, &sink_st) == 0) {
+    p.skip_dev = sink_st.st_dev;
+    p.skip_ino = sink_st.st_ino;
+  }
+  struct archive_query sharded;
+  if (shard_nodes > 1 && query->shard_count == 0) {
+    sharded = *query;
+    shard_fan_out(&p, &sharded);
+    query = &sharded;
+    printf("Archive shards: %d of %d here, %d streamed by other nodes\n",
+           __builtin_popcountll(sharded.shards), shard_nodes, p.peer_count);
+  }
+  p.query = query;
+  struct query_plan plan;
+  plan_query(query, &plan);
+  p.plan = &plan;
+  char plan_line[160];
+  describe_plan(&plan, plan_line, sizeof(plan_line));
+  printf("Archive %s", plan_line);
 
-      char creation_time[30];
-      strftime(creation_time, sizeof(creation_time), "%Y-%m-%d %H:%M:%S",
-               localtime(&sb->st_ctime));
+  // Deterministic member order needs one thread per stage
+  int filters = (archive_order == ORDER_PATH) ? 1 : pipeline_cfg.filter_threads;
+  int readers = (archive_order == ORDER_PATH) ? 1 : pipeline_cfg.reader_threads;
+  queue_init(&p.walked, "walk", pipeline_cfg.queue_depth, 1);
+  queue_init(&p.matched, "filter", pipeline_cfg.queue_depth, filters);
+  // Not -q: every loaded item holds an open fd and a chunk
+  queue_init(&p.loaded, "read", LOADED_DEPTH, readers);
 
-      char *fname = get_filename(fpath);
+  if (start_compressor(&p) < 0) {
+    perror("Failed to start compressor");
+    queue_destroy(&p.walked);
+    queue_destroy(&p.matched);
+    queue_destroy(&p.loaded);
+    plan_free(&plan);
+    for (int i = 0; i < p.peer_count; i++) {
+      close(p.peers[i]);
+    }
+    return -1;
+  }
 
-      sprintf(file_info,
-              "File: %s\nSize: %ld bytes\nDate created: %s\nPermissions: %s\n",
-              fname, (long)sb->st_size, creation_time, permissions);
-      return 1; // Stop the walk as file is found
+  if (framed) {
+    long size_header = -1; // Streamed - size follows as chunk frames
+    if (write_header(sink_fd, &size_header, sizeof(long)) < 0) {
+      atomic_store(&p.ctl->cancelled, 1);
     }
   }
-  return 0; // Continue walking
-}
 
-/*Function: recursive callback (nftw) to search directory tree for filename*/
-void w24fn(const char *root_path) { // Clear previous results
-  memset(file_info, 0, sizeof(file_info));
-  nftw(root_path, file_processor, 20, FTW_PHYS);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_t walker, archiver, sender;
+  pthread_t filter_threads[MAX_STAGE_THREADS], reader_threads[MAX_STAGE_THREADS];
+  pthread_create(&walker, NULL, walker_stage, &p);
+  for (int i = 0; i < filters; i++) {
+    pthread_create(&filter_threads[i], NULL, filter_stage, &p);
+  }
+  for (int i = 0; i < readers; i++) {
+    pthread_create(&reader_threads[i], NULL, reader_stage, &p);
+  }
+  pthread_create(&archiver, NULL, archiver_stage, &p);
+  pthread_create(&sender, NULL, sender_stage, &p);
+
+  // Supervise until the sender drains gzip - a hang up or cancellation kills
+  // the compressor so stages blocked on its pipes wake up at once
+  bool killed = false;
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000; // 100ms
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    if (pthread_timedjoin_np(sender, NULL, &deadline) == 0) {
+      break;
+    }
+    if (watch_fd >= 0 && !atomic_load(&ctl->cancelled) &&
+        peer_hung_up(watch_fd)) {
+      printf("Client disconnected - aborting archive\n");
+      atomic_store(&ctl->cancelled, 1);
+    }
+    if (atomic_load(&ctl->cancelled) && !killed) {
+      kill(p.gzip_pid, SIGTERM);
+      for (int i = 0; i < p.peer_count; i++) {
+        shutdown(p.peers[i], SHUT_RDWR); // Their nodes see the hang up and stop
+      }
+      killed = true;
+    }
+  }
+
+  pthread_join(walker, NULL);
+  for (int i = 0; i < filters; i++) {
+    pthread_join(filter_threads[i], NULL);
+  }
+  for (int i = 0; i < readers; i++) {
+    pthread_join(reader_threads[i], NULL);
+  }
+  pthread_join(archiver, NULL);
+  int status;
+  waitpid(p.gzip_pid, &status, 0);
+  for (int i = 0; i < p.peer_count; i++) {
+    close(p.peers[i]);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Archive pipeline: %ld files, %ld bytes in %.3fs%s\n",
+         atomic_load(&p.ctl->files_done), atomic_load(&p.ctl->bytes_done),
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         atomic_load(&p.ctl->cancelled) ? " (aborted)" : "");
+  queue_report(&p.walked);
+  queue_report(&p.matched);
+  queue_report(&p.loaded);
+
+  queue_destroy(&p.walked);
+  queue_destroy(&p.matched);
+  queue_destroy(&p.loaded);
+  plan_free(&plan);
+  return atomic_load(&p.ctl->cancelled) ? -1 : 0;
 }
 
+/*Function: Run the pipeline into an archive file*/
+int build_archive_file(const struct archive_query *query,
+                       const char *archive_path, int watch_fd,
+                       struct archive_control *ctl) {
+  int fd = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("Error creating archive");
+    return -1;
+  }
+  int status = run_archive_pipeline(query, fd, 0, watch_fd, ctl);
+  close(fd);
+  return status;
+}
 
 /*
 *Command: w24fdb - created before or on the user specified date
 */
 
-/*Function: Create a gzip compressed file with files created on/before user i/p date*/
-void create_tar_archive_before(const char *dateString) {
-    char command[2048];
-    FILE *fp;
-
-    // Construct the find command with the user-provided date, then use it to create a tar archive , used awt for date wise elimination
-    snprintf(command, sizeof(command),
-        "find ~/ -type f ! -path '*/.*' -exec stat --format '%%W %%n' {} + | "
-        "awk -v date='%s' '"
-        "{ "
-        "   if ($1 != 0) { " // Check if the file has a valid birth time
-        "       cmd = \"date -d @\" $1 \" '+%%Y-%%m-%%d'\"; "
-        "       cmd | getline bdate; " // Get formatted birth date
-        "       close(cmd); "
-        "       if (bdate <= date) print $2; " // Print the file path if it meets the date criteria
-        "   } "
-        "}' | xargs tar -cvzf ~/temp.tar.gz 2>/dev/null", // Archive the files that match the criteria
-        dateString);
-
-    // Execute the find and tar command using popen
-    fp = popen(command, "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to execute command\n");
-        exit(EXIT_FAILURE);
-    }
+/*Function: Stream a gzip compressed archive of files created on/before user i/p date*/
+void create_tar_archive_before(const char *dateString, int client_sock) {
+    struct archive_query query = {.min_size = -1, .max_size = -1};
+    snprintf(query.before, sizeof(query.before), "%s", dateString);
 
-    // To ensure that the command has finished executing and to capture its output
-    int status = pclose(fp);
-    if (status == -1) {
-        fprintf(stderr, "Failed to close command stream\n");
+    if (run_archive_pipeline(&query, client_sock, 1, client_sock, NULL) < 0) {
+        fprintf(stderr, "Failed to stream archive\n");
     } else {
-            printf("Archive created successfully at ~/temp.tar.gz\n", dateString);
+        printf("Archive streamed successfully (files on/before %s)\n", dateString);
     }
 }
 
@@ -277,38 +5243,15 @@ void create_tar_archive_before(const char *dateString) {
 *Command: w24fda - created after or on the user specified date
 */
 
-/*Function: Create a gzip compressed file with files created on/after user i/p date*/
-void create_tar_archive_after(const char *dateString) {
-    char command[2048];
-    FILE *fp;
-
-    // Construct the find command with the user-provided date, then use it to create a tar archive , used awt for date wise elimination
-    snprintf(command, sizeof(command),
-        "find ~/ -type f ! -path '*/.*' -exec stat --format '%%W %%n' {} + | "
-        "awk -v date='%s' '"
-        "{ "
-        "   if ($1 != 0) { " // Check if the file has a valid birth time
-        "       cmd = \"date -d @\" $1 \" '+%%Y-%%m-%%d'\"; "
-        "       cmd | getline bdate; " // Get formatted birth date
-        "       close(cmd); "
-        "       if (bdate >= date) print $2; " // Print the file path if it meets the date criteria (after)
-        "   } "
-        "}' | xargs tar -cvzf ~/temp.tar.gz 2>/dev/null", // Archive the files that match the criteria
-        dateString);
-
-    // Execute the find and tar command using popen
-    fp = popen(command, "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to execute command\n");
-        exit(EXIT_FAILURE);
-    }
+/*Function: Stream a gzip compressed archive of files created on/after user i/p date*/
+void create_tar_archive_after(const char *dateString, int client_sock) {
+    struct archive_query query = {.min_size = -1, .max_size = -1};
+    snprintf(query.after, sizeof(query.after), "%s", dateString);
 
-    // To ensure that the command has finished executing and to capture its output
-    int status = pclose(fp);
-    if (status == -1) {
-        fprintf(stderr, "Failed to close command stream\n");
+    if (run_archive_pipeline(&query, client_sock, 1, client_sock, NULL) < 0) {
+        fprintf(stderr, "Failed to stream archive\n");
     } else {
-            printf("Archive created successfully at ~/temp.tar.gz\n", dateString);
+        printf("Archive streamed successfully (files on/after %s)\n", dateString);
     }
 }
 
@@ -328,6 +5271,9 @@ void send_file(int client_socket, const char *filename) {
     char size_buffer[sizeof(long)];
     memcpy(size_buffer, &file_size, sizeof(long));
 
+    // Size and contents leave in full segments
+    transport_cork(client_socket, 1);
+
     // Send the size of the file to the client
     if (send(client_socket, size_buffer, sizeof(long), 0) != sizeof(long)) {
         perror("Error sending file size");
@@ -338,12 +5284,16 @@ void send_file(int client_socket, const char *filename) {
     char buffer[1024];
     size_t bytes_read;
 
+    int flow = egress_open(client_socket);
     while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        egress_wait(flow, bytes_read); // Fair share of the uplink
         if (send(client_socket, buffer, bytes_read, 0) != bytes_read) {
             perror("Error sending file");
             exit(EXIT_FAILURE);
         }
     }
+    egress_close(flow);
+    transport_cork(client_socket, 0); // Flush the last partial segment
     printf("Bytes send by server: %zu\n",bytes_read); 
     fclose(file);
 }
@@ -353,211 +5303,1126 @@ void send_file(int client_socket, const char *filename) {
 */
 
 /*Function: Fetch files based file sizes provided and add to temp.tar.gz */
-void w24fz(char *response, long size1, long size2) {
+void w24fz(struct out_buffer *response, long size1, long size2, int client_sock) {
 // Create the ~/w24 directory if it doesn't exist
     create_w24_directory();
 
-  // Construct the command using snprintf
-  char command[1024];
-const char *homePath = getenv("HOME");
-  snprintf(command, sizeof(command),
-           "find %s -type f -not -path '*/.*' -size +%ldc -size -%ldc -print0 "
-           "| xargs -0 tar -czf ~/w24/temp.tar.gz",
-           homePath, size1, size2);
+  // Size bounds are exclusive, as with find -size +Nc -size -Nc
+  struct archive_query query = {.min_size = size1, .max_size = size2};
+  char tar_filename[1024];
+  snprintf(tar_filename, sizeof(tar_filename), "%s/w24/temp.tar.gz",
+           getenv("HOME"));
+  build_archive_file(&query, tar_filename, client_sock, NULL);
+  //Response to client
+  out_printf(response, "Archive created: temp.tar.gz\n");
+}
 
-  // Open a pipe to execute the command
-  FILE *fp = popen(command, "r");
-  if (fp == NULL) {
-    perror("popen");
-    exit(EXIT_FAILURE);
+/*
+*Command: w24q [-l] [size:MIN..MAX] [ext:E1,E2,...] [before:DATE] [after:DATE]
+*
+* All predicates are checked in one pass over the candidates the planner
+* picked. -l lists the matching files, otherwise they are streamed back as
+* an archive. Size bounds are inclusive, either end may be left out.
+*/
+
+/*Function: Parse w24q predicates into a query - false if one is malformed*/
+bool parse_query_predicates(char **args, int nargs, struct archive_query *query) {
+  memset(query, 0, sizeof(*query));
+  query->min_size = query->max_size = -1;
+  for (int i = 0; i < nargs; i++) {
+    char *value = strchr(args[i], ':');
+    bool valid = value != NULL;
+    if (valid) {
+      *value++ = '\0';
+    }
+    if (!valid) {
+      // Not a predicate
+    } else if (strcmp(args[i], "size") == 0) {
+      char *dots = strstr(value, "..");
+      valid = dots != NULL;
+      if (valid) {
+        char *end;
+        if (dots > value) {
+          long lo = strtol(value, &end, 10);
+          valid = end == dots && lo >= 0;
+          query->min_size = lo > 0 ? lo - 1 : -1;
+        }
+        if (valid && dots[2] != '\0') {
+          long hi = strtol(dots + 2, &end, 10);
+          valid = *end == '\0' && hi >= 0 && hi < LONG_MAX;
+          query->max_size = hi + 1;
+        }
+      }
+    } else if (strcmp(args[i], "ext") == 0) {
+      for (char *ext = strtok_r(value, ",", &value); ext != NULL && valid;
+           ext = strtok_r(NULL, ",", &value)) {
+        valid = suffix_set_add(&query->extensions, ext);
+      }
+    } else if (strcmp(args[i], "before") == 0 || strcmp(args[i], "after") == 0) {
+      valid = strlen(value) == 10 && date_start(value, 0) != -1;
+      snprintf(args[i][0] == 'b' ? query->before : query->after,
+               sizeof(query->before), "%s", value);
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      suffix_set_free(&query->extensions);
+      return false;
+    }
   }
-  // Close the pipe
-  pclose(fp);
-  //Response to client
-  sprintf(response, "Archive created: temp.tar.gz\n");
+  return true;
+}
+
+/*Structure: w24q -l in progress*/
+struct query_listing {
+  const struct archive_query *query;
+  struct stream_writer *w;
+  long matched;
+};
+
+/*Function: Listing visitor - print candidates that satisfy every predicate*/
+bool list_visit(const char *path, const struct stat *sb, void *arg) {
+  struct query_listing *listing = arg;
+  struct pipeline_item item = {.path = (char *)path, .st = *sb};
+  if (query_matches(listing->query, &item)) {
+    char date[11] = "-";
+    birth_date(path, date);
+    stream_printf(listing->w, "%s  %ld bytes  created %s\n", path,
+                  (long)sb->st_size, date);
+    listing->matched++;
+  }
+  return !listing->w->failed;
+}
+
+/*Function: Run a composite query - list the matches or stream them as an archive*/
+void w24q(int client_sock, char **args, int nargs) {
+  bool listing = nargs > 0 && strcmp(args[0], "-l") == 0;
+  if (listing) {
+    args++;
+    nargs--;
+  }
+  struct archive_query query;
+  if (!parse_query_predicates(args, nargs, &query)) {
+    if (listing) {
+      send_stream_message(client_sock,
+                          "Usage: w24q [-l] [size:MIN..MAX] [ext:E1,E2] "
+                          "[before:YYYY-MM-DD] [after:YYYY-MM-DD]\n");
+    } else {
+      long size_header = NO_ARCHIVE_SIZE; // Client is waiting for a file
+      write_all(client_sock, &size_header, sizeof(long));
+    }
+    return;
+  }
+  if (listing) {
+    struct stream_writer w = {.sock = client_sock};
+    struct query_plan plan;
+    plan_query(&query, &plan);
+    char line[160];
+    describe_plan(&plan, line, sizeof(line));
+    stream_printf(&w, "%s", line);
+    struct query_listing state = {.query = &query, .w = &w};
+    plan_for_each(&plan, getenv("HOME"), list_visit, &state);
+    stream_printf(&w, "%ld matching files\n", state.matched);
+    stream_end(&w);
+    plan_free(&plan);
+  } else {
+    // Archive is streamed to the client while it is being built
+    run_archive_pipeline(&query, client_sock, 1, client_sock, NULL);
+  }
+  suffix_set_free(&query.extensions);
+}
+
+/*
+*Command: w24shard INDEX/COUNT DEV:INO [predicates] - one shard of an archive
+*
+* Sent by a node that splits an archive command across the nodes given
+* with -g (see shard_fan_out). The reply is a streamed archive as usual, but
+* holds only the members below the top level entries of ~ in this shard,
+* without the end marker - the asking node forwards it ahead of its own.
+* DEV:INO is the archive file that node is writing, if any.
+*/
+
+/*Function: Stream the members of one shard of ~ to the node that asked*/
+void w24shard(int client_sock, char **args, int nargs) {
+  struct archive_query query;
+  int index, count;
+  unsigned long long dev, ino;
+  if (nargs < 2 || sscanf(args[0], "%d/%d", &index, &count) != 2 || count < 1 ||
+      count > MAX_SHARD_NODES || index < 0 || index >= count ||
+      sscanf(args[1], "%llu:%llu", &dev, &ino) != 2 ||
+      !parse_query_predicates(args + 2, nargs - 2, &query)) {
+    long size_header = NO_ARCHIVE_SIZE;
+    write_all(client_sock, &size_header, sizeof(long));
+    return;
+  }
+  query.shard_count = count;
+  query.shards = 1ULL << index;
+  query.partial = true;
+  query.skip_dev = (dev_t)dev;
+  query.skip_ino = (ino_t)ino;
+  run_archive_pipeline(&query, client_sock, 1, client_sock, NULL);
+  suffix_set_free(&query.extensions);
+}
+
+/*
+*Command: w24top -s | -n [count] - largest or newest files
+*
+* One pass over the catalog columns keeps the best count rows in a min-heap
+* whose root is the weakest one kept. Without a current catalog (or size
+* column, for -s) ~ is walked through the same heap.
+*/
+
+/*Structure: One kept file - a catalog row, or a path when walking*/
+struct top_entry {
+  uint64_t key;   // Size, or birth time with its sign bit flipped
+  uint32_t file;
+  char *path;
+};
+
+/*Structure: Top-k selection heap*/
+struct top_heap {
+  struct top_entry *entries;
+  int count;
+  int k;
+  bool newest;
+};
+
+/*Function: Restore the heap below a position*/
+void top_sift_down(struct top_heap *heap, int i) {
+  for (;;) {
+    int least = i;
+    int l = 2 * i + 1, r = 2 * i + 2;
+    if (l < heap->count && heap->entries[l].key < heap->entries[least].key) {
+      least = l;
+    }
+    if (r < heap->count && heap->entries[r].key < heap->entries[least].key) {
+      least = r;
+    }
+    if (least == i) {
+      return;
+    }
+    struct top_entry tmp = heap->entries[i];
+    heap->entries[i] = heap->entries[least];
+    heap->entries[least] = tmp;
+    i = least;
+  }
+}
+
+/*Function: Offer a file to the heap - the path is copied (to the request
+arena) only when it is kept*/
+void top_offer(struct top_heap *heap, uint64_t key, uint32_t file, const char *path) {
+  if (heap->count == heap->k) {
+    if (key <= heap->entries[0].key) {
+      return;
+    }
+    heap->entries[0] = (struct top_entry){key, file, path ? arena_strdup(path) : NULL};
+    top_sift_down(heap, 0);
+    return;
+  }
+  int i = heap->count++;
+  heap->entries[i] = (struct top_entry){key, file, path ? arena_strdup(path) : NULL};
+  while (i > 0 && heap->entries[(i - 1) / 2].key > heap->entries[i].key) {
+    struct top_entry tmp = heap->entries[i];
+    heap->entries[i] = heap->entries[(i - 1) / 2];
+    heap->entries[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+/*Function: Birth time as an unsigned heap key that keeps its order*/
+uint64_t btime_key(int64_t btime) {
+  return (uint64_t)btime ^ (1ULL << 63);
+}
+
+/*Function: Walk visitor - offer every file to the heap*/
+bool top_visit(const char *path, const struct stat *sb, void *arg) {
+  struct top_heap *heap = arg;
+  if (!heap->newest) {
+    top_offer(heap, sb->st_size, NO_ID, path);
+    return true;
+  }
+  struct statx stx;
+  if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_BTIME, &stx) == 0 &&
+      (stx.stx_mask & STATX_BTIME)) {
+    top_offer(heap, btime_key(stx.stx_btime.tv_sec), NO_ID, path);
+  }
+  return true;
+}
+
+/*Function: Order kept entries best first*/
+int compare_top_entries(const void *a, const void *b) {
+  uint64_t x = ((const struct top_entry *)a)->key;
+  uint64_t y = ((const struct top_entry *)b)->key;
+  return (x < y) - (x > y);
+}
+
+/*Function: Stream the count largest (or newest) files of ~*/
+void w24top(int client_sock, bool newest, int count) {
+  struct top_heap heap = {.k = count, .newest = newest};
+  heap.entries = arena_alloc(count * sizeof(struct top_entry));
+  bool from_catalog = newest ? catalog_files_current() : catalog_sizes_current();
+  if (from_catalog) {
+    pthread_rwlock_rdlock(&catalog.lock);
+    const struct file_columns *col = &catalog.columns;
+    for (uint32_t f = 0; f < catalog.file_count; f++) {
+      if (col->btime[f] == INT64_MIN || catalog.dirs[col->dir[f]].hidden ||
+          file_name(f)[0] == '.' || (newest && col->btime[f] == 0)) {
+        continue; // Free row, hidden, or no birth time to rank by
+      }
+      top_offer(&heap, newest ? btime_key(col->btime[f]) : col->size[f], f, NULL);
+    }
+    for (int i = 0; i < heap.count; i++) {
+      char path[MAX_PATH_LEN];
+      entry_path(col->dir[heap.entries[i].file], file_name(heap.entries[i].file),
+                 path, sizeof(path));
+      heap.entries[i].path = arena_strdup(path);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+  } else {
+    struct query_plan plan = {.access = PLAN_WALK};
+    plan_for_each(&plan, getenv("HOME"), top_visit, &heap);
+  }
+  qsort(heap.entries, heap.count, sizeof(struct top_entry), compare_top_entries);
+
+  struct stream_writer w = {.sock = client_sock};
+  stream_printf(&w, "%s %d files%s:\n", newest ? "Newest" : "Largest", heap.count,
+                from_catalog ? "" : " (walk of ~)");
+  for (int i = 0; i < heap.count; i++) {
+    struct stat sb;
+    char date[11] = "-";
+    if (heap.entries[i].path != NULL && lstat(heap.entries[i].path, &sb) == 0) {
+      birth_date(heap.entries[i].path, date);
+      stream_printf(&w, "%s  %ld bytes  created %s\n", heap.entries[i].path,
+                    (long)sb.st_size, date);
+    }
+  }
+  stream_end(&w);
+}
+
+/*
+*Command: w24du [dir] [-d depth] - recursive size and file count of a directory
+*
+* Every catalog directory carries the totals of its subtree, adjusted along
+* the parent chain whenever a file is added, removed or rewritten, so the
+* answer never walks the tree. Hidden entries are counted, like du does.
+*/
+
+/*Function: Catalog dir id of a path under ~ (absolute, ~/... or relative) - NO_ID if unknown*/
+uint32_t catalog_lookup_dir(const char *path) {
+  size_t root_len = strlen(catalog.root);
+  if (strncmp(path, catalog.root, root_len) == 0 &&
+      (path[root_len] == '\0' || path[root_len] == '/')) {
+    path += root_len;
+  } else if (path[0] == '~') {
+    path++;
+  } else if (path[0] == '/') {
+    return NO_ID; // Outside ~
+  }
+  char copy[MAX_PATH_LEN];
+  snprintf(copy, sizeof(copy), "%s", path);
+  uint32_t dir = catalog.root_dir;
+  char *saveptr;
+  for (char *part = strtok_r(copy, "/", &saveptr); part != NULL && dir != NO_ID;
+       part = strtok_r(NULL, "/", &saveptr)) {
+    if (strcmp(part, ".") != 0) {
+      dir = strcmp(part, "..") == 0 ? NO_ID : catalog_child(dir, part);
+    }
+  }
+  return dir;
+}
+
+/*Function: Order sub-directories by total size, largest first*/
+int compare_dirs_by_usage(const void *a, const void *b) {
+  uint64_t x = catalog.dirs[*(const uint32_t *)a].bytes;
+  uint64_t y = catalog.dirs[*(const uint32_t *)b].bytes;
+  return (x < y) - (x > y);
+}
+
+/*Function: Stream the totals of a directory, then of its sub-directories down to depth*/
+void du_send(struct stream_writer *w, uint32_t dir, int depth, int level) {
+  char path[MAX_PATH_LEN];
+  dir_path(dir, path, sizeof(path));
+  stream_printf(w, "%*s%llu bytes  %u files  %s\n", 2 * level, "",
+                (unsigned long long)catalog.dirs[dir].bytes, catalog.dirs[dir].files, path);
+  if (level == depth) {
+    return;
+  }
+  uint32_t count = 0;
+  for (uint32_t c = catalog.dirs[dir].first_child; c != NO_ID; c = catalog.dirs[c].next_sibling) {
+    count++;
+  }
+  uint32_t *children = arena_alloc((count + 1) * sizeof(uint32_t));
+  count = 0;
+  for (uint32_t c = catalog.dirs[dir].first_child; c != NO_ID; c = catalog.dirs[c].next_sibling) {
+    children[count++] = c;
+  }
+  qsort(children, count, sizeof(uint32_t), compare_dirs_by_usage);
+  for (uint32_t i = 0; i < count && !w->failed; i++) {
+    du_send(w, children[i], depth, level + 1);
+  }
+}
+
+/*Function: Stream the disk usage of a directory under ~*/
+void w24du(int client_sock, const char *path, int depth) {
+  struct stream_writer w = {.sock = client_sock};
+  if (!atomic_load(&catalog.ready)) {
+    send_stream_message(client_sock, "Catalog is still being built - try again shortly\n");
+    return;
+  }
+  pthread_rwlock_rdlock(&catalog.lock);
+  uint32_t dir = catalog_lookup_dir(path);
+  if (dir == NO_ID || !catalog.dirs[dir].live) {
+    stream_printf(&w, "No such directory under ~: %s\n", path);
+  } else {
+    if (!catalog_sizes_current()) {
+      stream_printf(&w, "(Totals as of this connection's start)\n");
+    }
+    du_send(&w, dir, depth, 0);
+  }
+  pthread_rwlock_unlock(&catalog.lock);
+  stream_end(&w);
+}
+
+/*
+*Command: w24ft - file extensions based tar.gz
+*/
+
+/*Function: Build an archive query from an archive command and its arguments*/
+int parse_archive_query(const char *command, char **args, int nargs,
+                        struct archive_query *query) {
+  memset(query, 0, sizeof(*query));
+  query->min_size = query->max_size = -1;
+  if (strcmp(command, "w24fz") == 0 && nargs == 2) {
+    query->min_size = atol(args[0]);
+    query->max_size = atol(args[1]);
+  } else if (strcmp(command, "w24ft") == 0 && nargs >= 1) {
+    for (int i = 0; i < nargs; i++) {
+      if (!suffix_set_add(&query->extensions, args[i])) {
+        suffix_set_free(&query->extensions);
+        return -1;
+      }
+    }
+  } else if (strcmp(command, "w24fdb") == 0 && nargs == 1) {
+    snprintf(query->before, sizeof(query->before), "%s", args[0]);
+  } else if (strcmp(command, "w24fda") == 0 && nargs == 1) {
+    snprintf(query->after, sizeof(query->after), "%s", args[0]);
+  } else if (strcmp(command, "w24q") == 0) {
+    return parse_query_predicates(args, nargs, query) ? 0 : -1;
+  } else {
+    return -1;
+  }
+  return 0;
 }
 
-/*
-*Command: w24ft - file extensions based tar.gz
-*/
-
-/*Function: Fetch files based on 3 extensions(limit) provided and generate temp.tar.gz and send to client*/
-void w24ft(char *response, const char *extension1, const char *extension2,
-           const char *extension3) {
+/*Function: Fetch files with any of the extensions provided and generate temp.tar.gz and send to client*/
+void w24ft(struct out_buffer *response, char **extensions, int count, int client_sock) {
   // Check if at least one extension is provided
-  if (extension1 == NULL && extension2 == NULL && extension3 == NULL) {
-    strcpy(response, "No file type provided.\n");
+  if (count == 0) {
+    out_printf(response, "No file type provided.\n");
     return;
   }
 
 // Create the ~/w24 directory if it doesn't exist
     create_w24_directory();
 
-  // Open a temporary file to store the list of filenames
-  FILE *file_list = fopen("file_list.txt", "w");
-  if (file_list == NULL) {
-    perror("fopen");
-    exit(EXIT_FAILURE);
+  // Collect the requested extensions
+  struct archive_query query;
+  if (parse_archive_query("w24ft", extensions, count, &query) < 0) {
+    out_printf(response, "Invalid file type provided.\n");
+    return;
   }
 
-  // Construct find command
-  char command[MAX_PATH_LEN * 2]; // Double the length for safety
-  sprintf(command, "find %s -type f", getenv("HOME"));
+  // Archive the matching files
+  char tar_filename[1024];
+  snprintf(tar_filename, sizeof(tar_filename), "%s/w24/temp.tar.gz",
+           getenv("HOME"));
+  build_archive_file(&query, tar_filename, client_sock, NULL);
+  suffix_set_free(&query.extensions);
 
-  // Append search conditions for each extension
-  for (int i = 1; i <= 3; ++i) {
-    const char *ext = NULL;
-    switch (i) {
-    case 1:
-      ext = extension1;
-      break;
-    case 2:
-      ext = extension2;
-      break;
-    case 3:
-      ext = extension3;
-      break;
-    default:
-      break;
-    }
+  // Check if any files were found and added to the archive
+  FILE *test_tar = fopen("~/w24/temp.tar.gz", "r");
+  // if (test_tar == NULL) {
+  //   strcpy(response, "No files found with the specified extensions.\n");
+  // } else {
+    //fclose(test_tar);
+    out_printf(response, "Archive created: temp.tar.gz\n");
+  //}
 
-    if (ext != NULL) {
-      sprintf(command + strlen(command), " -name '*.%s' -o", ext);
-    }
-  }
+}
 
-  // Remove the last '-o'
-  if (extension1 != NULL || extension2 != NULL || extension3 != NULL) {
-    command[strlen(command) - 3] = '\0';
-  }
+/*
+*Command: w24job - asynchronous archive jobs
+*
+* w24job submit <w24fz|w24ft|w24fdb|w24fda> <args>  - returns a job id
+* w24job status <id> | list                          - progress
+* w24job fetch <id>   - waits for the job and sends its archive
+* w24job cancel <id>
+*
+* Jobs belong to the connection - they are cancelled when the client leaves.
+*/
 
-  // Append the rest of the find command with the filter for files and
-  // directories starting with "."
-  sprintf(command + strlen(command), " -not -path '*/\\.*'");
+/*Structure: One archive job running in the background*/
+struct archive_job {
+  int id;           // 0 - free slot
+  atomic_int state;
+  bool joined;      // Runner thread has been joined
+  char request[256];                       // Submitted command, for listings
+  struct archive_query query;
+  struct archive_control ctl;
+  char archive_path[MAX_PATH_LEN];
+  pthread_t thread;
+};
 
-  // Open a pipe to execute the command
-  FILE *fp = popen(command, "r");
-  if (fp == NULL) {
-    perror("popen");
-    exit(EXIT_FAILURE);
-  }
+struct archive_job jobs[MAX_JOBS];
+int next_job_id = 1;
+
+const char *job_state_names[] = {"running", "done",    "failed",
+                                 "cancelled", "fetched", "rejected"};
 
-  // Read file paths from the find command output and write them to the file list
-  char file_path[MAX_PATH_LEN];
-  while (fgets(file_path, sizeof(file_path), fp) != NULL) {
-    // Remove the newline character
-    file_path[strcspn(file_path, "\n")] = '\0';
-    // Write file path to file list
-    fprintf(file_list, "%s\n", file_path);
+/*Function: Job runner thread - builds the archive into the job's file*/
+void *job_runner(void *arg) {
+  struct archive_job *job = arg;
+  int slot = admit_command(CLASS_HEAVY);
+  if (slot < 0) {
+    atomic_store(&job->state, JOB_REJECTED); // Archive capacity saturated
+    return NULL;
   }
+  int status = build_archive_file(&job->query, job->archive_path, -1,
+                                  &job->ctl);
+  release_command(CLASS_HEAVY, slot);
+  if (atomic_load(&job->ctl.cancelled)) {
+    atomic_store(&job->state, JOB_CANCELLED);
+  } else {
+    atomic_store(&job->state, status == 0 ? JOB_DONE : JOB_FAILED);
+  }
+  return NULL;
+}
 
-  // Close the find command pipe
-  pclose(fp);
+/*Function: Look up a job by its id*/
+struct archive_job *find_job(const char *id) {
+  int job_id = id ? atoi(id) : 0;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (job_id > 0 && jobs[i].id == job_id) {
+      return &jobs[i];
+    }
+  }
+  return NULL;
+}
 
-  // Close the file list
-  fclose(file_list);
+/*Function: Wait for a job's runner thread*/
+void join_job(struct archive_job *job) {
+  if (!job->joined) {
+    pthread_join(job->thread, NULL);
+    job->joined = true;
+  }
+}
 
-  // Open tar process using the file list
-  FILE *tar_process =
-      popen("tar -czf ~/w24/temp.tar.gz -T file_list.txt", "w");
-  if (tar_process == NULL) {
-    perror("popen");
-    exit(EXIT_FAILURE);
+/*Function: Start a job for an archive command*/
+void submit_job(struct out_buffer *response) {
+  struct archive_job *job = NULL;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].id == 0) {
+      job = &jobs[i];
+      break;
+    }
+  }
+  if (job == NULL) {
+    out_printf(response, "Too many jobs - fetch or cancel one first\n");
+    return;
+  }
+  char *command = strtok(NULL, " ");
+  char *args[MAX_COMMAND_ARGS];
+  int nargs = 0;
+  char *arg;
+  while (command != NULL && nargs < MAX_COMMAND_ARGS &&
+         (arg = strtok(NULL, " ")) != NULL) {
+    args[nargs++] = arg;
+  }
+  if (command == NULL ||
+      parse_archive_query(command, args, nargs, &job->query) < 0) {
+    out_printf(response, "Invalid job. Usage: w24job submit <w24fz|w24ft|w24fdb|w24fda> <args>\n");
+    return;
+  }
+  create_w24_directory();
+  job->id = next_job_id++;
+  job->joined = false;
+  memset(&job->ctl, 0, sizeof(job->ctl));
+  atomic_store(&job->state, JOB_RUNNING);
+  snprintf(job->request, sizeof(job->request), "%s", command);
+  for (int i = 0; i < nargs; i++) {
+    snprintf(job->request + strlen(job->request),
+             sizeof(job->request) - strlen(job->request), " %s", args[i]);
+  }
+  snprintf(job->archive_path, sizeof(job->archive_path),
+           "%s/w24/job-%d-%d.tar.gz", getenv("HOME"), (int)getpid(), job->id);
+  if (pthread_create(&job->thread, NULL, job_runner, job) != 0) {
+    job->id = 0;
+    suffix_set_free(&job->query.extensions);
+    out_printf(response, "Failed to start job\n");
+    return;
   }
+  out_printf(response, "Job %d submitted: %s\n", job->id, job->request);
+}
 
-  // Close the tar process
-  pclose(tar_process);
+/*Function: Describe a job's state and progress*/
+void describe_job(struct archive_job *job, char *line, size_t len) {
+  snprintf(line, len, "Job %d [%s] %s: %ld files, %ld bytes\n", job->id,
+           job_state_names[atomic_load(&job->state)], job->request,
+           atomic_load(&job->ctl.files_done), atomic_load(&job->ctl.bytes_done));
+}
 
-  // Check if any files were found and added to the archive
-  FILE *test_tar = fopen("~/w24/temp.tar.gz", "r");
-  // if (test_tar == NULL) {
-  //   strcpy(response, "No files found with the specified extensions.\n");
-  // } else {
-    //fclose(test_tar);
-    sprintf(response, "Archive created: temp.tar.gz\n");
-  //}
+/*Function: Drop a job - its archive file and its slot*/
+void release_job(struct archive_job *job) {
+  join_job(job);
+  remove(job->archive_path);
+  suffix_set_free(&job->query.extensions);
+  job->id = 0;
+}
+
+/*Function: Cancel all jobs of the connection (client left)*/
+void cancel_all_jobs() {
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].id != 0) {
+      atomic_store(&jobs[i].ctl.cancelled, 1);
+      release_job(&jobs[i]);
+    }
+  }
+}
 
-  // Remove the temporary file list
-  remove("file_list.txt");
+/*Function: Dispatch w24job sub commands*/
+void w24job(struct out_buffer *response, int *valid_command, int client_sock) {
+  char *action = strtok(NULL, " ");
+  if (action == NULL) {
+    *valid_command = 0;
+    return;
+  }
+  if (strcmp(action, "submit") == 0) {
+    submit_job(response);
+    return;
+  }
+  if (strcmp(action, "list") == 0) {
+    // Reply is streamed - MAX_JOBS lines don't fit in one REPLY_LEN read
+    struct stream_writer w = {.sock = client_sock};
+    stream_printf(&w, "Jobs:\n");
+    for (int i = 0; i < MAX_JOBS; i++) {
+      if (jobs[i].id != 0) {
+        char line[REPLY_LEN];
+        describe_job(&jobs[i], line, sizeof(line));
+        stream_printf(&w, "%s", line);
+      }
+    }
+    stream_end(&w);
+    return;
+  }
+  struct archive_job *job = find_job(strtok(NULL, " "));
+  if (strcmp(action, "status") == 0) {
+    if (job == NULL) {
+      out_printf(response, "No such job\n");
+    } else {
+      char line[REPLY_LEN];
+      describe_job(job, line, sizeof(line));
+      out_printf(response, "%s", line);
+    }
+  } else if (strcmp(action, "cancel") == 0) {
+    if (job == NULL) {
+      out_printf(response, "No such job\n");
+    } else {
+      bool running = atomic_load(&job->state) == JOB_RUNNING;
+      atomic_store(&job->ctl.cancelled, 1);
+      out_printf(response, "Job %d %s\n", job->id,
+              running ? "cancelled" : "discarded");
+      release_job(job);
+    }
+  } else if (strcmp(action, "fetch") == 0) {
+    // Reply is a file transfer - the client always expects a size header
+    if (job != NULL) {
+      release_held_slot(); // The job's runner holds the heavy slot
+      join_job(job);
+    }
+    if (job == NULL || atomic_load(&job->state) != JOB_DONE) {
+      long size_header = NO_ARCHIVE_SIZE;
+      write_all(client_sock, &size_header, sizeof(long));
+    } else {
+      send_file(client_sock, job->archive_path);
+      atomic_store(&job->state, JOB_FETCHED);
+      release_job(job);
+    }
+  } else {
+    *valid_command = 0;
+  }
 }
 
 /*Function: Processes all Client Commands and redirects accordingly */
-void processCommands(char *tokenizer, char *response, int *valid_command,
+void processCommands(char *tokenizer, struct out_buffer *response, int *valid_command,
                      int client_sock) {
   *valid_command = 1; // Assume response is valid until proven otherwise
   if (strcmp(tokenizer, "dirlist") == 0) {
+    // Reply is streamed - the client always expects frames here
+    out_reset(response);
     char *arg = strtok(NULL, " ");
-    if (arg != NULL && strcmp(arg, "-a") == 0) {
-      dirlistA(response); //response to client
-    } else if (arg != NULL && strcmp(arg, "-t") == 0) {
-      dirlistT(response); //response to client
-    } else
-      *valid_command = 0; //invalid request
+    long page_size = 0;
+    char *cursor = NULL;
+    char *opt;
+    bool valid = arg != NULL && (strcmp(arg, "-a") == 0 || strcmp(arg, "-t") == 0);
+    while (valid && (opt = strtok(NULL, " ")) != NULL) {
+      char *value = strtok(NULL, " ");
+      if (value != NULL && strcmp(opt, "-n") == 0 && atol(value) > 0) {
+        page_size = atol(value);
+      } else if (value != NULL && strcmp(opt, "-c") == 0) {
+        cursor = value;
+      } else {
+        valid = false;
+      }
+    }
+    if (valid) {
+      dirlist(client_sock, strcmp(arg, "-t") == 0, page_size, cursor);
+    } else {
+      send_stream_message(client_sock,
+                          "Usage: dirlist -a|-t [-n page_size] [-c cursor]\n");
+    }
   } else if (strcmp(tokenizer, "w24fn") == 0) {
-    char *filename = strtok(NULL, " ");
-    inputFileName = filename;
-    w24fn(getenv("HOME")); //Get path of home dir
-    memset(response, 0, 1048); // Clear the response buffer
-    strcat(response, file_info);
-
-    if (strlen(response) == 0) {
-      sprintf(response, "File not found\n"); //If filename provided doesnot exist
+    char *names[MAX_BATCH_NAMES + 1];
+    int count = 0;
+    char *filename;
+    while (count <= MAX_BATCH_NAMES && (filename = strtok(NULL, " ")) != NULL) {
+      names[count++] = filename;
+    }
+    out_reset(response); // Clear the response buffer
+    if (count > MAX_BATCH_NAMES) {
+      char msg[64];
+      snprintf(msg, sizeof(msg), "Too many names - at most %d per request\n",
+               MAX_BATCH_NAMES);
+      send_stream_message(client_sock, msg);
+      return;
+    }
+    struct name_lookup lookup;
+    lookup_init(&lookup, names, count);
+    w24fn(getenv("HOME"), &lookup); //Get path of home dir
+    if (count <= 1) {
+      out_printf(response, "%s", lookup.info[0]);
+      if (response->len == 0) {
+        out_printf(response, "File not found\n"); //If filename provided doesnot exist
+      }
+    } else {
+      // Batch - one record per requested name, streamed
+      struct stream_writer w = {.sock = client_sock};
+      for (int i = 0; i < count; i++) {
+        const char *info = lookup.info[lookup_find(&lookup, names[i])];
+        if (info[0] != '\0') {
+          stream_printf(&w, "%s\n", info);
+        } else {
+          stream_printf(&w, "File: %s\nFile not found\n\n", names[i]);
+        }
+      }
+      stream_end(&w);
+    }
+  } else if (strcmp(tokenizer, "w24search") == 0) {
+    // Reply is streamed - the client always expects frames here
+    out_reset(response);
+    char *flag = strtok(NULL, " ");
+    char *query = strtok(NULL, " ");
+    int distance = 1;
+    long limit = DEFAULT_SEARCH_RESULTS;
+    char *opt;
+    bool valid = flag != NULL && query != NULL &&
+                 (strcmp(flag, "-p") == 0 || strcmp(flag, "-g") == 0 ||
+                  strcmp(flag, "-f") == 0);
+    while (valid && (opt = strtok(NULL, " ")) != NULL) {
+      char *value = strtok(NULL, " ");
+      if (value != NULL && strcmp(opt, "-n") == 0 && atol(value) > 0 &&
+          atol(value) <= MAX_SEARCH_RESULTS) {
+        limit = atol(value);
+      } else if (value != NULL && strcmp(opt, "-d") == 0 && atoi(value) >= 0 &&
+                 atoi(value) <= MAX_EDIT_DISTANCE) {
+        distance = atoi(value);
+      } else {
+        valid = false;
+      }
+    }
+    if (!valid) {
+      send_stream_message(client_sock,
+                          "Usage: w24search -p prefix | -g glob | -f name "
+                          "[-d distance] [-n count]\n");
+    } else if (strcmp(flag, "-f") == 0) {
+      w24search(client_sock, SEARCH_FUZZY, query, distance, limit);
+    } else if (strcmp(flag, "-g") == 0) {
+      w24search(client_sock, SEARCH_GLOB, query, 0, limit);
+    } else {
+      // A prefix is a glob ending in '*' - escape what would be special
+      char pattern[2 * MAX_PATTERN_LEN + 2];
+      size_t n = 0;
+      for (const char *p = query; *p != '\0' && n + 3 < sizeof(pattern); p++) {
+        if (strchr("*?[\\", *p) != NULL) {
+          pattern[n++] = '\\';
+        }
+        pattern[n++] = *p;
+      }
+      pattern[n++] = '*';
+      pattern[n] = '\0';
+      w24search(client_sock, SEARCH_GLOB, pattern, 0, limit);
+    }
+  } else if (strcmp(tokenizer, "w24q") == 0) {
+    // Reply is a listing stream (-l) or an archive - never a text response
+    out_reset(response);
+    char *args[MAX_COMMAND_ARGS];
+    int nargs = 0;
+    char *arg;
+    while (nargs < MAX_COMMAND_ARGS && (arg = strtok(NULL, " ")) != NULL) {
+      args[nargs++] = arg;
+    }
+    w24q(client_sock, args, nargs);
+  } else if (strcmp(tokenizer, "w24shard") == 0) {
+    // Asked for by another node - the reply is a member stream
+    out_reset(response);
+    char *args[MAX_COMMAND_ARGS];
+    int nargs = 0;
+    char *arg;
+    while (nargs < MAX_COMMAND_ARGS && (arg = strtok(NULL, " ")) != NULL) {
+      args[nargs++] = arg;
+    }
+    w24shard(client_sock, args, nargs);
+  } else if (strcmp(tokenizer, "w24top") == 0) {
+    // Reply is streamed - the client always expects frames here
+    out_reset(response);
+    char *flag = strtok(NULL, " ");
+    char *count = strtok(NULL, " ");
+    int k = count ? atoi(count) : DEFAULT_TOP_RESULTS;
+    if (flag == NULL || (strcmp(flag, "-s") != 0 && strcmp(flag, "-n") != 0) ||
+        k <= 0 || k > MAX_TOP_RESULTS || strtok(NULL, " ") != NULL) {
+      send_stream_message(client_sock, "Usage: w24top -s | -n [count]\n");
+    } else {
+      w24top(client_sock, strcmp(flag, "-n") == 0, k);
+    }
+  } else if (strcmp(tokenizer, "w24du") == 0) {
+    // Reply is streamed - the client always expects frames here
+    out_reset(response);
+    const char *path = "~";
+    int depth = 1;
+    bool valid = true;
+    char *arg;
+    while (valid && (arg = strtok(NULL, " ")) != NULL) {
+      if (strcmp(arg, "-d") == 0) {
+        char *value = strtok(NULL, " ");
+        depth = value ? atoi(value) : -1;
+        valid = depth >= 0 && depth <= MAX_DU_DEPTH;
+      } else {
+        path = arg;
+      }
+    }
+    if (!valid) {
+      send_stream_message(client_sock, "Usage: w24du [dir] [-d depth]\n");
+    } else {
+      w24du(client_sock, path, depth);
     }
   } else if (strcmp(tokenizer, "w24fz") == 0) {
-    memset(response, 0, 1048);
+    out_reset(response);
     char *size1 = strtok(NULL, " "); //fetch size 1 via tokenization
     char *size2 = strtok(NULL, " "); //fetch size2 via tokenization
-    w24fz(response, atol(size1), atol(size2));
+    w24fz(response, atol(size1), atol(size2), client_sock);
   } else if (strcmp(tokenizer, "w24ft") == 0) {
-    memset(response, 0, 1048);
-    char *extension1 = strtok(NULL, " "); //fetch extensions based on i/p
-    char *extension2 = strtok(NULL, " ");
-    char *extension3 = strtok(NULL, " ");
-    printf("Extensions are : %s %s %s\n", extension1, extension2, extension3);
-    if (extension1 == NULL) {
+    out_reset(response);
+    char *extensions[MAX_COMMAND_ARGS]; //fetch extensions based on i/p
+    int count = 0;
+    char *extension;
+    printf("Extensions are :");
+    while (count < MAX_COMMAND_ARGS && (extension = strtok(NULL, " ")) != NULL) {
+      extensions[count++] = extension;
+      printf(" %s", extension);
+    }
+    printf("\n");
+    if (count == 0) {
       *valid_command = 0;
     } else {
-      w24ft(response, extension1, extension2, extension3);
+      w24ft(response, extensions, count, client_sock);
     }
   }
 
   /*tar file based on creation date*/
   else if (strcmp(tokenizer, "w24fdb") == 0) {
     char *date = strtok(NULL, " ");
-    memset(response, 0, 1048);
-    create_tar_archive_before(date);
-    char *homePath = getenv("HOME");
-    // Concatenate the home directory with the rest of the file path
-    char tar_filename[1024];
-    snprintf(tar_filename, sizeof(tar_filename), "%s/temp.tar.gz", homePath);
-    sleep(11);
-    send_file(client_sock, tar_filename);
+    out_reset(response);
+    // Archive is streamed to the client while it is being built
+    create_tar_archive_before(date, client_sock);
   } else if (strcmp(tokenizer, "w24fda") == 0) {
     char *date = strtok(NULL, " ");
-    memset(response, 0, 1048);
-    create_tar_archive_after(date);
-    char *homePath = getenv("HOME");
-    // Concatenate the home directory with the rest of the file path
-    char tar_filename[1024];
-    snprintf(tar_filename, sizeof(tar_filename), "%s/temp.tar.gz", homePath);
-    // Send tar.gz file to client
-    send_file(client_sock, tar_filename);
+    out_reset(response);
+    // Archive is streamed to the client while it is being built
+    create_tar_archive_after(date, client_sock);
+  } else if (strcmp(tokenizer, "w24stat") == 0) {
+    w24stat(response);
+  } else if (strcmp(tokenizer, "w24job") == 0) {
+    out_reset(response);
+    w24job(response, valid_command, client_sock);
   } else {
     *valid_command = 0; //Invalid request -- No response
   }
 }
 
+/*
+*Affinity routing - the main server sends each query to the node that served
+*it last, so that node's page cache and catalog stay warm for it
+*/
+
+/*Structure: Load of one node - shared by every node of this user on the host*/
+struct node_load {
+  atomic_int port;            // 0 - free entry
+  atomic_int pid;             // Node's listening process, entries of dead nodes are skipped
+  atomic_int active;          // Connections being served
+  atomic_int pending;         // Redirected here, not connected yet
+  atomic_llong pending_since; // CLOCK_MONOTONIC ms of the oldest pending redirect
+};
+
+/*Structure: Point of a node on the consistent hash ring*/
+struct ring_point {
+  uint64_t hash;
+  int port;
+};
+
+struct node_load *node_table; // MAX_LOAD_NODES entries, NULL - no load sharing
+struct node_load *node_self;
+pid_t connection_pid; // Process counted in node_self->active
+struct ring_point route_ring[ROUTE_NODES * RING_POINTS];
+int route_ports[ROUTE_NODES] = {SERVER_PORT, MIRROR1_PORT, MIRROR2_PORT};
+double route_load_factor = 0; // Changed via -R, 0 - rotate connections between nodes
+
+/*Function: CLOCK_MONOTONIC in milliseconds - comparable across processes*/
+long long monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/*Function: Publish this node's load to the other nodes - call before forking*/
+void node_register(int port) {
+  char dir[64], path[MAX_PATH_LEN];
+  if (!shared_dir(dir, sizeof(dir))) {
+    fprintf(stderr, "No private directory for the node table - load not shared\n");
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/nodes", dir);
+  size_t len = MAX_LOAD_NODES * sizeof(struct node_load);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0 || ftruncate(fd, len) < 0) {
+    perror("node table");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return; // Routed to as if idle
+  }
+  node_table = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (node_table == MAP_FAILED) {
+    perror("mmap");
+    node_table = NULL;
+    return;
+  }
+  // Reuse this port's entry from an earlier run, else claim one of a dead node
+  for (int pass = 0; pass < 2 && node_self == NULL; pass++) {
+    for (int i = 0; i < MAX_LOAD_NODES && node_self == NULL; i++) {
+      int owner = atomic_load(&node_table[i].port);
+      int dead = owner == 0 || kill(atomic_load(&node_table[i].pid), 0) < 0;
+      if ((pass == 0 && owner == port) ||
+          (pass == 1 && dead &&
+           atomic_compare_exchange_strong(&node_table[i].port, &owner, port))) {
+        node_self = &node_table[i];
+      }
+    }
+  }
+  if (node_self == NULL) {
+    fprintf(stderr, "Node table full - load not shared\n");
+    return;
+  }
+  if (atomic_load(&node_self->pid) != getpid()) {
+    atomic_store(&node_self->active, 0);
+    atomic_store(&node_self->pending, 0);
+  } // Else reloaded - the connections counted are still being served
+  atomic_store(&node_self->pid, getpid());
+}
+
+/*Function: Count a connection this node finished serving - at exit, as
+caught_error ends connections too*/
+void node_connection_end() {
+  if (node_self != NULL && getpid() == connection_pid) {
+    atomic_fetch_sub(&node_self->active, 1);
+    connection_pid = 0;
+  }
+}
+
+/*Function: Count a connection this node started serving*/
+void node_connection_start() {
+  if (node_self == NULL) {
+    return;
+  }
+  connection_pid = getpid(); // Not the gzip fork
+  atexit(node_connection_end);
+  // It may be one the main server redirected here
+  int pending = atomic_load(&node_self->pending);
+  while (pending > 0 &&
+         !atomic_compare_exchange_weak(&node_self->pending, &pending, pending - 1)) {
+  }
+  atomic_fetch_add(&node_self->active, 1);
+}
+
+/*Function: Shared entry of a running node - NULL if it is not running*/
+struct node_load *node_lookup(int port) {
+  for (int i = 0; node_table != NULL && i < MAX_LOAD_NODES; i++) {
+    if (atomic_load(&node_table[i].port) == port) {
+      int pid = atomic_load(&node_table[i].pid);
+      return pid > 0 && kill(pid, 0) == 0 ? &node_table[i] : NULL;
+    }
+  }
+  return NULL;
+}
+
+/*Function: Connections a node serves or is about to*/
+int node_load(struct node_load *node) {
+  int pending = atomic_load(&node->pending);
+  if (pending > 0 &&
+      monotonic_ms() - atomic_load(&node->pending_since) > PENDING_EXPIRY_MS) {
+    atomic_store(&node->pending, 0); // Those clients never came
+    pending = 0;
+  }
+  return atomic_load(&node->active) + pending;
+}
+
+int compare_ring_points(const void *a, const void *b) {
+  uint64_t x = ((const struct ring_point *)a)->hash;
+  uint64_t y = ((const struct ring_point *)b)->hash;
+  return (x > y) - (x < y);
+}
+
+/*Function: Place RING_POINTS points per node on the hash ring*/
+void route_init() {
+  char key[32];
+  for (int n = 0; n < ROUTE_NODES; n++) {
+    for (int i = 0; i < RING_POINTS; i++) {
+      snprintf(key, sizeof(key), "%d#%d", route_ports[n], i);
+      route_ring[n * RING_POINTS + i].hash = name_hash(key);
+      route_ring[n * RING_POINTS + i].port = route_ports[n];
+    }
+  }
+  qsort(route_ring, ROUTE_NODES * RING_POINTS, sizeof(struct ring_point),
+        compare_ring_points);
+}
+
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*Function: Canonical form of a command - affinity must not depend on spacing
+or on the order of a set*/
+void normalize_command(const char *command, char *out, size_t size) {
+  char copy[MAX_COMMAND_LEN];
+  char *args[MAX_COMMAND_ARGS];
+  int count = 0;
+  snprintf(copy, sizeof(copy), "%.*s", (int)strcspn(command, "\n"), command);
+  for (char *saveptr, *token = strtok_r(copy, " \t\r", &saveptr);
+       token != NULL && count < MAX_COMMAND_ARGS;
+       token = strtok_r(NULL, " \t\r", &saveptr)) {
+    args[count++] = token;
+  }
+  // Extensions, names and w24q predicates are sets
+  if (count > 2 && (strcmp(args[0], "w24ft") == 0 || strcmp(args[0], "w24fn") == 0 ||
+                    strcmp(args[0], "w24q") == 0)) {
+    qsort(args + 1, count - 1, sizeof(char *), compare_strings);
+  }
+  size_t len = 0;
+  out[0] = '\0';
+  for (int i = 0; i < count && len < size; i++) {
+    len += snprintf(out + len, size - len, i == 0 ? "%s" : " %s", args[i]);
+  }
+}
+
+/*Function: Wait for the first command of a connection and peek at it - left
+to be read by crequest; its length, 0 if the client left without one*/
+ssize_t peek_first_command(int sock, char *command, size_t size) {
+  struct pollfd pfd = {.fd = sock, .events = POLLIN};
+  while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+  }
+  ssize_t n = recv(sock, command, size - 1, MSG_PEEK);
+  if (n < 0) {
+    n = 0;
+  }
+  command[n] = '\0';
+  return n;
+}
+
+/*Function: Node to serve a connection - the first node clockwise from the hash
+of its first command whose load stays within route_load_factor of the average*/
+int route_connection(const char *command) {
+  char normalized[MAX_COMMAND_LEN];
+  normalize_command(command, normalized, sizeof(normalized));
+  uint64_t hash = name_hash(normalized);
+
+  // Bounded loads - capacity is the factor times the average, this connection included
+  struct node_load *nodes[ROUTE_NODES];
+  int total = 1, live = 0;
+  for (int i = 0; i < ROUTE_NODES; i++) {
+    nodes[i] = node_lookup(route_ports[i]);
+    if (nodes[i] != NULL) {
+      total += node_load(nodes[i]);
+      live++;
+    }
+  }
+  if (live == 0) {
+    return node_port; // No load shared - serve it here
+  }
+  int capacity = (int)(route_load_factor * total / live + 0.999999);
+  if (capacity < ROUTE_MIN_CAPACITY) {
+    capacity = ROUTE_MIN_CAPACITY; // Too little load for hotspots
+  }
+
+  int points = ROUTE_NODES * RING_POINTS;
+  int first = 0;
+  while (first < points && route_ring[first].hash < hash) {
+    first++;
+  }
+  int chosen = 0, preferred = 0;
+  for (int i = 0; i < points && chosen == 0; i++) {
+    int port = route_ring[(first + i) % points].port;
+    struct node_load *node = NULL;
+    for (int j = 0; j < ROUTE_NODES; j++) {
+      if (route_ports[j] == port) {
+        node = nodes[j];
+      }
+    }
+    if (node == NULL) {
+      continue; // Not running
+    }
+    if (preferred == 0) {
+      preferred = port;
+    }
+    if (node_load(node) < capacity) {
+      chosen = port;
+      if (port != node_port) {
+        // Counted until the client reconnects there
+        if (atomic_fetch_add(&node->pending, 1) == 0) {
+          atomic_store(&node->pending_since, monotonic_ms());
+        }
+      }
+    }
+  }
+  if (chosen == 0) {
+    chosen = preferred; // Capacity is at least the average, so unreachable
+  }
+  printf("Routed \"%s\" to %d%s\n", normalized, chosen,
+         chosen == preferred ? "" : " (spillover)");
+  return chosen;
+}
+
 /*Function: Processes client/s incoming requests based on Sec II*/
 void crequest(int sock) {
   // sock - socket descriptor for client conn.
-  char buffer[1024];     // store data fetched from client
+  char buffer[MAX_COMMAND_LEN]; // store data fetched from client
   int valid_command = 1; // Validating if recieved response is correct/not
-  char response[1048];   // store response response
+  struct out_buffer response; // store response response - in the request arena
 
+  node_connection_start();
+  arena_reset(); // Allocates the connection's arena
   while (1) {
     memset(buffer, 0,
-           1024); // clear buffer, prevent leftover data from previous request
-    int n = read(sock, buffer, sizeof(buffer));
+           sizeof(buffer)); // clear buffer, prevent leftover data from previous request
+    int n = read(sock, buffer, sizeof(buffer) - 1);
 
     if (n < 0)
       caught_error("ERROR: Issue while reading from socket");
@@ -567,40 +6432,131 @@ void crequest(int sock) {
 
     if (n == 0) { // Check if the client closed the connection
       printf("Client closed the connection.\n");
+      cancel_all_jobs(); // Nobody is left to fetch them
       break;
     }
 
     /* Check if client wants to QUIT */
     if (strncmp("quitc", buffer, 5) == 0) {
-      sprintf(response, "Client has requested to end the session. Server "
-                        "Ending session!\n");
-      write(sock, response, strlen(response));
+      char *bye_msg = "Client has requested to end the session. Server "
+                      "Ending session!\n";
+      write(sock, bye_msg, strlen(bye_msg));
       printf("Client has ended the session.\n");
+      cancel_all_jobs();
       break;
     }
 
+    // Admission control - wait (bounded) for a slot of the command's class
+    clock_gettime(CLOCK_MONOTONIC, &held.started);
+    held.class_id = classify_command(buffer);
+    held.slot = admit_command(held.class_id);
+    if (held.slot < 0) {
+      if (strncmp(buffer, "w24fd", 5) == 0 || strncmp(buffer, "w24shard", 8) == 0 ||
+          strncmp(buffer, "w24job fetch", 12) == 0 ||
+          (strncmp(buffer, "w24q", 4) == 0 && !streamed_reply(buffer))) {
+        long size_header = BUSY_SIZE; // Client is waiting for a file
+        write(sock, &size_header, sizeof(long));
+      } else if (streamed_reply(buffer)) {
+        send_stream_message(sock, "Server busy - please try again later\n");
+      } else {
+        char *busy_msg = "Server busy - please try again later\n";
+        write(sock, busy_msg, strlen(busy_msg));
+      }
+      continue;
+    }
+
+#ifdef COUNT_ALLOCATIONS
+    long heap_calls_before = atomic_load(&heap_calls);
+#endif
+    out_init(&response, REPLY_LEN);
     char *tokenizer = strtok(buffer, " "); // Parse CLient commands
     if (tokenizer == NULL) {
       caught_error("Error: Syntax is not valid. Please resend response.\n");
     } else {
-      processCommands(tokenizer, response, &valid_command, sock);
+      processCommands(tokenizer, &response, &valid_command, sock);
     }
 
     if (valid_command) {
-      write(sock, response,
-            strlen(response)); // Send the processed response back to the client
+      write(sock, response.data,
+            response.len); // Send the processed response back to the client
     } else {
       char *error_msg = "Invalid response. Please try again!";
       write(sock, error_msg, strlen(error_msg));
     }
+
+    release_held_slot();
+    arena_reset(); // Everything the request allocated
+#ifdef COUNT_ALLOCATIONS
+    printf("Heap calls: %ld for %.40s\n", atomic_load(&heap_calls) - heap_calls_before,
+           tokenizer ? tokenizer : "");
+#endif
   }
+  node_connection_end();
   close(sock);
 }
 
+/*
+*Reload - SIGHUP/SIGUSR2 re-executes the node's binary (argv[0], so a
+*redeployed one) in place. The listeners survive the exec and never stop
+*accepting. Connections in progress run in their own processes and finish
+*there. The new image loads the shared catalog snapshot - changes since it
+*was saved are found by the validation after loading.
+*/
+
+volatile sig_atomic_t reload_requested = 0;
+char **node_argv; // Command line the node re-executes on reload
+
+/*Function: Signal handler - the accept loop reloads once poll is interrupted*/
+void request_reload(int sig) {
+  (void)sig;
+  reload_requested = 1;
+}
+
+/*Function: Listener passed on by the image this one replaced - -1 if none*/
+int inherited_listener(const char *name) {
+  char *value = getenv(name);
+  if (value == NULL) {
+    return -1;
+  }
+  int sockfd = atoi(value);
+  unsetenv(name); // Not for the processes this node starts
+  int type;
+  socklen_t len = sizeof(type);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+      type != SOCK_STREAM) {
+    return -1;
+  }
+  return sockfd;
+}
+
+/*Function: Replace this node's image, keeping its listeners - returns only if
+the exec failed, and the old image goes on serving*/
+void reload_node(int sockfd, int localfd) {
+  reload_requested = 0;
+  char value[16];
+  snprintf(value, sizeof(value), "%d", sockfd);
+  setenv(RELOAD_TCP_FD, value, 1);
+  if (localfd >= 0) {
+    snprintf(value, sizeof(value), "%d", localfd);
+    setenv(RELOAD_LOCAL_FD, value, 1);
+  }
+  printf("Reloading %s - connections in progress finish in their processes\n",
+         node_argv[0]);
+  fflush(stdout);
+  execvp(node_argv[0], node_argv);
+  perror("ERROR: Reload failed - still serving");
+  unsetenv(RELOAD_TCP_FD);
+  unsetenv(RELOAD_LOCAL_FD);
+}
+
 /*Function: Create Socket Connection: bind and connect to client*/
 int setup_and_bind_socket(int portno) {
   struct sockaddr_in serv_addr;
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  int sockfd = inherited_listener(RELOAD_TCP_FD);
+  if (sockfd >= 0) {
+    return sockfd; // Bound and tuned by the image before the reload
+  }
+  sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) {
     caught_error("ERROR opening socket");
   }
@@ -614,10 +6570,89 @@ int setup_and_bind_socket(int portno) {
     close(sockfd); // Ensure to close the socket on error
     caught_error("ERROR on binding");
   }
+  transport_tune_listener(sockfd);
+
+  return sockfd;
+}
+
+/*Function: Path of a port's AF_UNIX listener - in $XDG_RUNTIME_DIR or a 0700
+directory of our own, so no other user can put a socket there; false if the
+directory is not private (someone else made it)*/
+bool local_socket_path(int portno, char *path, size_t len) {
+  char dir[MAX_PATH_LEN];
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime != NULL && runtime[0] == '/') {
+    snprintf(dir, sizeof(dir), "%s", runtime);
+  } else {
+    snprintf(dir, sizeof(dir), LOCAL_SOCKET_DIR, (int)getuid());
+    mkdir(dir, 0700); // Fails if it exists - checked below
+  }
+  struct stat sb;
+  if (lstat(dir, &sb) != 0 || !S_ISDIR(sb.st_mode) || sb.st_uid != getuid() ||
+      (sb.st_mode & 077) != 0) {
+    return false;
+  }
+  return snprintf(path, len, LOCAL_SOCKET_NAME, dir, portno) < (int)len;
+}
 
+/*Function: Create the AF_UNIX listener for same-host clients - -1 if there is none*/
+int setup_local_socket(int portno) {
+  int inherited = inherited_listener(RELOAD_LOCAL_FD);
+  if (inherited >= 0) {
+    return inherited;
+  }
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (!local_socket_path(portno, addr.sun_path, sizeof(addr.sun_path))) {
+    fprintf(stderr, "No private directory for the local socket - serving TCP only\n");
+    return -1;
+  }
+  int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    perror("ERROR opening local socket");
+    return -1;
+  }
+  unlink(addr.sun_path); // Left behind by an earlier run - only we can put one there
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sockfd, 5) < 0) {
+    perror("ERROR on binding local socket"); // Clients fall back to TCP
+    close(sockfd);
+    return -1;
+  }
   return sockfd;
 }
 
+/*Function: Accept the next connection from whichever listener has one
+* Reload signals are only delivered inside ppoll, so one that came while the
+* last connection was accepted and forked is seen before waiting again.
+*/
+int accept_connection(int sockfd, int localfd) {
+  struct pollfd pfd[2] = {{.fd = sockfd, .events = POLLIN},
+                          {.fd = localfd, .events = POLLIN}};
+  sigset_t reload, waiting;
+  sigemptyset(&reload);
+  sigaddset(&reload, SIGHUP);
+  sigaddset(&reload, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &reload, &waiting);
+  sigdelset(&waiting, SIGHUP); // Still blocked after a reload's exec
+  sigdelset(&waiting, SIGUSR2);
+  int ready;
+  do {
+    if (reload_requested) {
+      reload_node(sockfd, localfd);
+    }
+    ready = ppoll(pfd, localfd >= 0 ? 2 : 1, NULL, &waiting);
+  } while (ready < 0 && errno == EINTR);
+  pthread_sigmask(SIG_SETMASK, &waiting, NULL);
+  if (ready < 0) {
+    return -1;
+  }
+  int sock = accept(pfd[1].revents & POLLIN ? localfd : sockfd, NULL, NULL);
+  if (sock >= 0) {
+    transport_tune_connection(sock);
+  }
+  return sock;
+}
+
 /*Function: Redirect to Mirror after every 3 and then alternating after 9 connections*/
 void redirect_to_mirror(int client_fd, int mirror_port) {
   //printf("Mirror Port: %d, Client FD: %d\n", mirror_port, client_fd);
@@ -628,24 +6663,129 @@ void redirect_to_mirror(int client_fd, int mirror_port) {
   close(client_fd);
 }
 
+/*Function: Parse command line options
+*  -p  keep archive members in path order (deterministic archives)
+*  -i  order archive members by inode instead of physical extent
+*  -f  filter stage threads, -r  reader stage threads
+*  -q  depth of the queues between archive pipeline stages
+*  -a  concurrent archive (heavy) commands, -m  concurrent light commands
+*  -w  max wait in ms for an archive slot, -s  light command latency SLO in ms
+*  -b  egress budget for bulk transfers in bytes/s (K/M/G suffix)
+*  -c  per-client egress rule ip=weight[:cap] (repeatable)
+*  -g  ports of the nodes sharing archive work, e.g. 6999,7000,7001 - each
+*      archives a subtree shard of ~ and the node asked merges the streams
+*/
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "pif:r:q:a:m:w:s:b:c:g:R:t:")) != -1) {
+    switch (opt) {
+    case 'f':
+      pipeline_cfg.filter_threads = atoi(optarg);
+      break;
+    case 'r':
+      pipeline_cfg.reader_threads = atoi(optarg);
+      break;
+    case 'q':
+      pipeline_cfg.queue_depth = atoi(optarg);
+      break;
+    case 'a':
+      heavy_limit = atoi(optarg);
+      break;
+    case 'm':
+      light_limit = atoi(optarg);
+      break;
+    case 'w':
+      heavy_wait_ms = atoi(optarg);
+      break;
+    case 's':
+      light_slo_ms = atoi(optarg);
+      break;
+    case 'b':
+      egress_rate = parse_rate(optarg);
+      break;
+    case 'c':
+      add_client_rule(optarg);
+      break;
+    case 'g':
+      shard_nodes = 0;
+      for (char *saveptr, *port = strtok_r(optarg, ",", &saveptr); port != NULL;
+           port = strtok_r(NULL, ",", &saveptr)) {
+        if (shard_nodes == MAX_SHARD_NODES || atoi(port) <= 0) {
+          fprintf(stderr, "-g takes 1-%d ports\n", MAX_SHARD_NODES);
+          exit(EXIT_FAILURE);
+        }
+        shard_ports[shard_nodes++] = atoi(port);
+      }
+      break;
+    case 'R':
+      route_load_factor = atof(optarg);
+      if (route_load_factor < 1) {
+        fprintf(stderr, "-R takes a load factor of at least 1\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      if (!set_transport_profile(optarg)) {
+        fprintf(stderr, "-t takes interactive, bulk or kernel\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'p':
+      archive_order = ORDER_PATH;
+      break;
+    case 'i':
+      archive_order = ORDER_INODE;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-p | -i] [-f threads] [-r threads] [-q depth] "
+              "[-a slots] [-m slots] [-w ms] [-s ms] [-b rate] [-c ip=weight[:cap]] "
+              "[-g port,port,...] [-R factor] [-t profile]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (pipeline_cfg.filter_threads < 1 || pipeline_cfg.filter_threads > MAX_STAGE_THREADS ||
+      pipeline_cfg.reader_threads < 1 || pipeline_cfg.reader_threads > MAX_STAGE_THREADS ||
+      pipeline_cfg.queue_depth < 2) {
+    fprintf(stderr, "Stage threads must be 1-%d and queue depth at least 2\n",
+            MAX_STAGE_THREADS);
+    exit(EXIT_FAILURE);
+  }
+  if (heavy_limit < 1 || heavy_limit > MAX_SLOTS || light_limit < 1 ||
+      light_limit > MAX_SLOTS || heavy_wait_ms < 0 || light_slo_ms < 1) {
+    fprintf(stderr, "Slot limits must be 1-%d, waits and SLO positive\n",
+            MAX_SLOTS);
+    exit(EXIT_FAILURE);
+  }
+}
+
 /*Function: Main - setsup the alternation logic, socket declaration and listen and acceptance of connections*/
 int main(int argc, char *argv[]) {
-  int sockfd, newsockfd, portno = MIRROR2_PORT;    // socket fds -  individual client connections
-  socklen_t clilen;            // size of client address
-  struct sockaddr_in cli_addr; // server and client address
+  int sockfd, localfd, newsockfd, portno = MIRROR2_PORT;    // socket fds -  individual client connections
   int pid;
   int conn_id = 1;
 
+  parse_options(argc, argv);
+  node_port = portno; // Place in the -g shard list
+  signal(SIGPIPE, SIG_IGN); // Disconnected clients surface as send() errors
+  node_argv = argv;
+  signal(SIGHUP, request_reload); // Graceful reload
+  signal(SIGUSR2, request_reload);
+  scheduler_init(); // Shared with every connection process
+  node_register(portno); // Load seen by the main server's router
+  route_init();
+  catalog_start();  // Loads, indexes or follows ~ in the background
+
   // Bind socket for serverw24
   sockfd = setup_and_bind_socket(portno);
   listen(sockfd, 5);
-  clilen = sizeof(cli_addr);
+  localfd = setup_local_socket(portno); // Same-host clients skip the TCP stack
   printf("Mirror2 is listening on port %d...\n", portno);
 
   // Accept connections and handle them based on should_handle() function
   while (1) {
-    newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr,
-                       &clilen); // Accept connection for serverw24
+    newsockfd = accept_connection(sockfd, localfd); // Accept connection for serverw24
     if (newsockfd < 0)
       caught_error("ERROR: Failed while accepting connection for serverw24");
 
@@ -655,6 +6795,7 @@ int main(int argc, char *argv[]) {
         caught_error("ERROR: Failed while forking");
       if (pid == 0) {
         close(sockfd);
+        close(localfd);
         printf("Handling connection %d\n", conn_id);
         crequest(newsockfd); // Forward commands for processing - validation
         close(newsockfd);
@@ -663,11 +6804,12 @@ int main(int argc, char *argv[]) {
         close(newsockfd);
         conn_id++; // Increment the connection count - for alteration purposes. (Loadbalancing)
       }
+  }
 
   close(sockfd);
+  close(localfd);
   return 0;
 }
-}
 
 /*
 APPENDIX: